@@ -1993,6 +1993,7 @@ namespace miniply {
     }
 
     const Vec3* vpos = reinterpret_cast<const Vec3*>(pos);
+    const uint32_t numTris = n - 2;
 
     // Calculate the geometric normal of the face
     Vec3 origin = vpos[indices[0]];
@@ -2051,7 +2052,7 @@ namespace miniply {
     dst[1] = indices[next[first]];
     dst[2] = indices[prev[first]];
 
-    return n - 2;
+    return numTris;
   }
 
 } // namespace miniply
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+
+/**
+ * Bump allocator for short lived temporaries.
+ *
+ * Allocations are carved out of a single chunk and never freed one by one:
+ * reset() releases them all at once. Allocations that do not fit go to the
+ * heap until the next reset(), which then grows the chunk to the high
+ * water mark, so that an arena reused for similar work stops touching the
+ * heap after a few rounds. An arena must only be used by one thread.
+ */
+struct Arena {
+	/* Methods */
+	Arena(size_t capacity = 0);
+	~Arena();
+	void *alloc(size_t size);
+	void reset();
+	/* Members */
+	char *chunk = nullptr;
+	size_t capacity = 0;
+	size_t used = 0;
+	/* Heap blocks allocated since the last reset, and their total size */
+	void *overflow = nullptr;
+	size_t overflow_size = 0;
+
+	void *alloc_overflow(size_t size);
+};
+
+inline void *Arena::alloc(size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (used + size > capacity)
+		return alloc_overflow(size);
+
+	void *p = chunk + used;
+	used += size;
+	return p;
+}
+
+/**
+ * realloc() and free() counterparts for containers that may live in an
+ * arena : with a null arena they fall back to the heap. Memory from an
+ * arena is not freed, the old block is left to the next reset.
+ */
+inline void *arena_realloc(Arena *arena, void *ptr, size_t old_size,
+			   size_t new_size)
+{
+	if (!arena)
+		return realloc(ptr, new_size);
+
+	void *p = arena->alloc(new_size);
+	if (ptr) {
+		memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+	}
+	return p;
+}
+
+inline void arena_free(Arena *arena, void *ptr)
+{
+	if (!arena)
+		free(ptr);
+}
+
+/**
+ * meshoptimizer allocation hooks, installed with meshopt_setAllocator for
+ * the time of a build and replaced by the defaults afterwards. They
+ * allocate from the arena bound to the calling thread with
+ * bind_meshopt_arena(), and from the heap if there is none.
+ */
+void bind_meshopt_arena(Arena *arena);
+void *meshopt_arena_allocate(size_t size);
+void meshopt_arena_deallocate(void *ptr);
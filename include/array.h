@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <assert.h>
 
+#include "arena.h"
+
 #define ARRAY_FIRST_CAPACITY 8
 
 template <typename T>
@@ -13,11 +15,12 @@ struct TArray {
 	size_t size;
 	size_t capacity;
 	T *data;
+	Arena *arena;
 	/**
 	 * Methods
 	 */
 	TArray();
-	TArray(size_t size);
+	TArray(size_t size, Arena *arena = nullptr);
 	~TArray();
 	T& operator[] (size_t i);
 	const T& operator[] (size_t i) const;
@@ -26,15 +29,18 @@ struct TArray {
 	void resize(size_t size);
 	void reserve(size_t capacity);
 	void clear();
+	void release();
 };
 
 template< typename T>
-TArray<T>::TArray(): size{0}, capacity{0}, data{nullptr} {}
+TArray<T>::TArray(): size{0}, capacity{0}, data{nullptr}, arena{nullptr} {}
 
 template <typename T>
-TArray<T>::TArray(size_t size): size{size}, capacity{size}
+TArray<T>::TArray(size_t size, Arena *arena): size{size}, capacity{size},
+	arena{arena}
 {
-	data = static_cast<T*>(malloc(size * sizeof(T)));
+	data = static_cast<T*>(arena_realloc(arena, nullptr, 0,
+					     size * sizeof(T)));
 };
 
 template<typename T>
@@ -42,7 +48,7 @@ inline TArray<T>::~TArray()
 {
 	size = 0;
 	capacity = 0;
-	free(data);
+	arena_free(arena, data);
 }
 
 template<typename T>
@@ -63,9 +69,11 @@ template<typename T>
 inline void TArray<T>::push_back(const T &t)
 {
 	if (size >= capacity) {
+		size_t old_capacity = capacity;
 		capacity = capacity < ARRAY_FIRST_CAPACITY ? 
 			ARRAY_FIRST_CAPACITY : 2 * capacity;
-		data = static_cast<T*>(realloc(data, capacity * sizeof(T)));
+		data = static_cast<T*>(arena_realloc(arena, data,
+			old_capacity * sizeof(T), capacity * sizeof(T)));
 	}
 	data[size++] = t;
 }
@@ -88,7 +96,8 @@ void TArray<T>::resize(size_t size)
 	
 	if (size > capacity)
 	{
-		data = static_cast<T*>(realloc(data, size * sizeof(T)));
+		data = static_cast<T*>(arena_realloc(arena, data,
+			capacity * sizeof(T), size * sizeof(T)));
 		capacity = size;
 	}
 }
@@ -98,7 +107,8 @@ void TArray<T>::reserve(size_t capacity)
 {
 	if (capacity > this->capacity)
 	{
-		data = static_cast<T*>(realloc(data, capacity * sizeof(T)));
+		data = static_cast<T*>(arena_realloc(arena, data,
+			this->capacity * sizeof(T), capacity * sizeof(T)));
 		this->capacity = capacity;
 	}
 }
@@ -111,3 +121,12 @@ inline void TArray<T>::clear()
 	free(data);*/
 }
 
+/* Same as clear, but also gives the storage back */
+template<typename T>
+inline void TArray<T>::release()
+{
+	arena_free(arena, data);
+	data = nullptr;
+	size = 0;
+	capacity = 0;
+}
@@ -7,6 +7,8 @@
 #include "quat.h"
 #include "vec3.h"
 #include <math.h>
+#include <stddef.h>
+#include <stdint.h>
 
 enum Visibility { None, Partial, Full };
 
@@ -163,6 +165,26 @@ struct Camera {
 	CameraFrustum frustum;
 };
 
-int is_visible(const float *vtx, int n, const float *pvm);
-enum Visibility visibility(const Aabb &bbox, const float *pvm);
+/**
+ * Plane based visibility tests, the planes being those of the clip volume
+ * of a projection (see frustum_from_matrix), extracted once and tested
+ * against many boxes. A box is None when it lies entirely outside one of
+ * the planes, Full when it lies inside all of them, and Partial otherwise.
+ *
+ * The bulk test takes boxes as arrays of bounds, and classifies them 8 at
+ * a time with AVX2 when the CPU has it.
+ */
+struct AabbArrays {
+	const float *min_x;
+	const float *min_y;
+	const float *min_z;
+	const float *max_x;
+	const float *max_y;
+	const float *max_z;
+};
+
+Frustum frustum_from_matrix(const float *pvm);
+enum Visibility visibility(const Aabb &bbox, const Frustum &frustum);
+void visibility(const AabbArrays &boxes, size_t count,
+		const Frustum &frustum, uint8_t *vis);
 
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <assert.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <type_traits>
+
+#include "hash_table.h"
+#include "sys_utils.h"
+
+/**
+ * Insert only hash table shared by several threads, without locks.
+ *
+ * Keys are claimed with a compare and swap on their slot, and values are
+ * atomics as well. The table does not grow : it must be created for the
+ * number of keys it will hold. Hasher is the one of HashTable, and keys
+ * that is_equal must compare equal whatever the thread.
+ *
+ * Guarantees, with any number of concurrent calls :
+ * - a key is inserted once, by exactly one of the threads inserting it,
+ * - get() either misses a key whose insertion has not completed yet or
+ *   returns its value, never a value under construction,
+ * - everything inserted before a synchronization point (such as the end
+ *   of a ThreadPool run) is seen by every thread after it.
+ * size() is only exact when there are no concurrent inserts, and clear()
+ * must not run concurrently with anything else.
+ */
+template <typename K, typename V, class H = DefaultHasher<K>>
+struct ConcurrentHashTable {
+	static_assert(std::is_integral<V>::value,
+		      "ConcurrentHashTable values must be integers.");
+public:
+	/* Methods */
+	ConcurrentHashTable(size_t expected_nkeys, H hasher = H(),
+			    V empty_val = static_cast<V>(~0ull));
+	~ConcurrentHashTable();
+	size_t size() const;
+	void clear();
+	bool get(K key, V &val) const;
+	bool get_or_set(K key, V alt_val, V &val);
+	V fetch_min(K key, V val, size_t *slot = nullptr);
+	V value_at(size_t slot) const;
+protected:
+	/* Members */
+	std::atomic<size_t> _size;
+	size_t _buckets;
+	std::atomic<K> *keys;
+	std::atomic<V> *vals;
+	H hasher;
+	/* Value of a slot whose key is claimed but not yet set */
+	V empty_val;
+	/* Methods */
+	size_t claim(K key, bool &found);
+	V wait_val(size_t bucket) const;
+};
+
+template <typename K, typename V, class H>
+ConcurrentHashTable<K, V, H>::ConcurrentHashTable(size_t expected_keys,
+						  H hasher, V empty_val)
+	: _size(0), _buckets(1), hasher(hasher), empty_val(empty_val)
+{
+	while (_buckets < (3 * expected_keys / 2)) {
+		_buckets *= 2;
+	}
+
+	MALLOC_NUM(keys, _buckets);
+	MALLOC_NUM(vals, _buckets);
+
+	clear();
+}
+
+template <typename K, typename V, class H>
+ConcurrentHashTable<K, V, H>::~ConcurrentHashTable()
+{
+	free(keys);
+	free(vals);
+}
+
+template <typename K, typename V, class H>
+inline size_t ConcurrentHashTable<K, V, H>::size() const
+{
+	return (_size.load(std::memory_order_relaxed));
+}
+
+template <typename K, typename V, class H>
+void ConcurrentHashTable<K, V, H>::clear()
+{
+	for (size_t i = 0; i < _buckets; ++i) {
+		keys[i].store(hasher.empty_key, std::memory_order_relaxed);
+		vals[i].store(empty_val, std::memory_order_relaxed);
+	}
+	_size.store(0, std::memory_order_release);
+}
+
+/**
+ * Slot of key, claimed for it if it was not there. Slots only ever go from
+ * empty to a key, hence a key seen in a slot stays there.
+ */
+template <typename K, typename V, class H>
+size_t ConcurrentHashTable<K, V, H>::claim(K key, bool &found)
+{
+	size_t mask = _buckets - 1;
+	size_t bucket = hasher.hash(key) & mask;
+
+	for (size_t probe = 0; probe < _buckets; probe++) {
+		K k = keys[bucket].load(std::memory_order_acquire);
+		if (hasher.is_empty(k)) {
+			if (keys[bucket].compare_exchange_strong(k, key,
+					std::memory_order_acq_rel,
+					std::memory_order_acquire)) {
+				_size.fetch_add(1, std::memory_order_relaxed);
+				found = false;
+				return (bucket);
+			}
+			/* Lost the slot, k is the winner's key */
+		}
+		if (hasher.is_equal(k, key)) {
+			found = true;
+			return (bucket);
+		}
+		/* quadratic probing */
+		bucket = (bucket + probe + 1) & mask;
+	}
+
+	/* The table was created too small */
+	assert(false && "Table is full !\n");
+	abort();
+}
+
+/* Value of a claimed slot, once its inserter has set it */
+template <typename K, typename V, class H>
+inline V ConcurrentHashTable<K, V, H>::wait_val(size_t bucket) const
+{
+	V v;
+	while ((v = vals[bucket].load(std::memory_order_acquire)) ==
+	       empty_val) {
+		sched_yield();
+	}
+	return (v);
+}
+
+/* Returns false if key is not in the table */
+template <typename K, typename V, class H>
+bool ConcurrentHashTable<K, V, H>::get(K key, V &val) const
+{
+	size_t mask = _buckets - 1;
+	size_t bucket = hasher.hash(key) & mask;
+
+	for (size_t probe = 0; probe < _buckets; probe++) {
+		K k = keys[bucket].load(std::memory_order_acquire);
+		if (hasher.is_empty(k))
+			return (false);
+		if (hasher.is_equal(k, key)) {
+			val = wait_val(bucket);
+			return (true);
+		}
+		bucket = (bucket + probe + 1) & mask;
+	}
+	return (false);
+}
+
+/**
+ * Same as HashTable::get_or_set : inserts key with alt_val and returns
+ * false if it was not in the table, else returns true with its value in
+ * val. alt_val must not be empty_val.
+ */
+template <typename K, typename V, class H>
+bool ConcurrentHashTable<K, V, H>::get_or_set(K key, V alt_val, V &val)
+{
+	assert(alt_val != empty_val);
+
+	bool found;
+	size_t bucket = claim(key, found);
+	if (!found) {
+		vals[bucket].store(alt_val, std::memory_order_release);
+		val = alt_val;
+		return (false);
+	}
+	val = wait_val(bucket);
+	return (true);
+}
+
+/**
+ * Inserts key or lowers its value to val, whichever thread comes first.
+ * Once all threads are done, a key holds the least value given for it,
+ * which makes for deterministic results. Returns the previous value,
+ * empty_val if there was none, and the slot of key if asked for.
+ */
+template <typename K, typename V, class H>
+V ConcurrentHashTable<K, V, H>::fetch_min(K key, V val, size_t *slot)
+{
+	assert(val != empty_val);
+
+	bool found;
+	size_t bucket = claim(key, found);
+	if (slot) {
+		*slot = bucket;
+	}
+	V cur = vals[bucket].load(std::memory_order_relaxed);
+	while ((cur == empty_val || val < cur) &&
+	       !vals[bucket].compare_exchange_weak(cur, val,
+						   std::memory_order_acq_rel,
+						   std::memory_order_relaxed)) {
+	}
+	return (cur);
+}
+
+/* Value of a slot given by fetch_min, saves looking its key up again */
+template <typename K, typename V, class H>
+inline V ConcurrentHashTable<K, V, H>::value_at(size_t slot) const
+{
+	assert(slot < _buckets);
+	return (wait_val(slot));
+}
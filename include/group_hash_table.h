@@ -0,0 +1,393 @@
+#pragma once
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "arena.h"
+#include "sys_utils.h"
+
+/**
+ * Open addressing hash table probing groups of slots at once, after
+ * SwissTable. Each slot has a control byte, either empty or holding 7 bits
+ * of the key hash, and a whole group of control bytes is matched against
+ * a hash tag with a few SIMD instructions. Hence the hasher's is_equal is
+ * only called on slots whose tag matches, which saves most of the
+ * comparisons of expensive keys such as vertices.
+ *
+ * It has the interface of HashTable (no deletion, same hashers) and can be
+ * used in its place. On top of it :
+ * - with cache_hash, the hash of every key is kept, and grow() does not
+ *   need to hash keys again,
+ * - clear() is O(1) : groups carry the generation at which they were last
+ *   written, and groups of an older generation are empty.
+ *
+ * The control bytes and generation of a group share a cache line, and
+ * keys are stored along with their value, so that a lookup usually costs
+ * as many cache misses as with HashTable.
+ */
+
+/* Groups are 16 slots whatever the target, so that the layout of a table
+ * does not depend on the flags of the unit that instantiates it */
+#define GROUP_WIDTH 16
+
+#define GROUP_CTRL_EMPTY 0x80
+
+/* Bit masks of the control bytes of a group equal to tag, or empty */
+#if defined(__SSE2__)
+inline uint32_t group_match(const uint8_t *ctrl, uint8_t tag)
+{
+	__m128i c = _mm_loadu_si128((const __m128i *)ctrl);
+	__m128i t = _mm_set1_epi8((char)tag);
+	return ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(c, t)));
+}
+
+inline uint32_t group_empty(const uint8_t *ctrl)
+{
+	__m128i c = _mm_loadu_si128((const __m128i *)ctrl);
+	return ((uint32_t)_mm_movemask_epi8(c));
+}
+#else
+inline uint32_t group_match(const uint8_t *ctrl, uint8_t tag)
+{
+	uint32_t mask = 0;
+	for (int i = 0; i < GROUP_WIDTH; ++i) {
+		mask |= (uint32_t)(ctrl[i] == tag) << i;
+	}
+	return (mask);
+}
+
+inline uint32_t group_empty(const uint8_t *ctrl)
+{
+	uint32_t mask = 0;
+	for (int i = 0; i < GROUP_WIDTH; ++i) {
+		mask |= (uint32_t)(ctrl[i] >> 7) << i;
+	}
+	return (mask);
+}
+#endif
+
+/* Control bytes of a group and their generation, a power of 2 in size */
+struct GroupHeader {
+	uint8_t ctrl[GROUP_WIDTH];
+	uint32_t stamp;
+	uint8_t pad[GROUP_WIDTH - sizeof(uint32_t)];
+};
+
+template <typename K, typename V, bool cache_hash>
+struct GroupSlot {
+	K key;
+	V val;
+};
+
+template <typename K, typename V>
+struct GroupSlot<K, V, true> {
+	K key;
+	V val;
+	uint32_t hash;
+};
+
+template <typename K, typename V, class H, bool cache_hash = false>
+struct GroupHashTable {
+public:
+	/* Methods */
+	GroupHashTable(size_t expected_nkeys = 8, H hasher = H(),
+		       Arena *arena = nullptr);
+	~GroupHashTable();
+	size_t size() const;
+	void clear();
+	void reserve(size_t expected_nkeys);
+	V* get(K key) const;
+	V* get_or_set(K key, V alt_val);
+	void set_at(K key, V val);
+	float load_factor() const;
+protected:
+	typedef GroupSlot<K, V, cache_hash> Slot;
+	/* Members */
+	size_t _size;
+	size_t _buckets;
+	GroupHeader *groups;
+	Slot *slots;
+	/* Allocated blocks, groups being aligned on cache lines */
+	void *groups_mem;
+	uint32_t generation;
+	H hasher;
+	Arena *arena;
+	/* Methods */
+	uint32_t mix(K key) const;
+	size_t find(uint32_t h, K key, bool &found) const;
+	size_t find_empty(uint32_t h) const;
+	void insert_at(size_t slot, uint32_t h, K key, V val);
+	void alloc(size_t buckets);
+	void grow(size_t buckets);
+	bool load_factor_ok() const;
+};
+
+/* Lowest power of 2 number of slots keeping expected_keys under 7 / 8 */
+static inline size_t group_buckets(size_t expected_keys)
+{
+	size_t buckets = GROUP_WIDTH;
+	while (buckets - buckets / 8 < expected_keys) {
+		buckets *= 2;
+	}
+	return (buckets);
+}
+
+template <typename K, typename V, class H, bool cache_hash>
+GroupHashTable<K, V, H, cache_hash>::GroupHashTable(size_t expected_keys,
+						    H hasher, Arena *arena)
+	: _size(0), hasher(hasher), arena(arena)
+{
+	alloc(group_buckets(expected_keys));
+}
+
+template <typename K, typename V, class H, bool cache_hash>
+GroupHashTable<K, V, H, cache_hash>::~GroupHashTable()
+{
+	arena_free(arena, groups_mem);
+	arena_free(arena, slots);
+}
+
+template <typename K, typename V, class H, bool cache_hash>
+void GroupHashTable<K, V, H, cache_hash>::alloc(size_t buckets)
+{
+	/* 7 bits of the 32 bits mixed hash go to the tag */
+	assert(buckets / GROUP_WIDTH <= ((size_t)1 << 25));
+
+	size_t count = buckets / GROUP_WIDTH;
+	size_t size = count * sizeof(GroupHeader) + 64;
+	_buckets = buckets;
+	groups_mem = arena_realloc(arena, nullptr, 0, size);
+	groups = (GroupHeader *)(((uintptr_t)groups_mem + 63) &
+				 ~(uintptr_t)63);
+	slots = (Slot *)arena_realloc(arena, nullptr, 0,
+				      buckets * sizeof(Slot));
+	for (size_t g = 0; g < count; ++g) {
+		groups[g].stamp = 0;
+	}
+	generation = 1;
+}
+
+template <typename K, typename V, class H, bool cache_hash>
+inline size_t GroupHashTable<K, V, H, cache_hash>::size() const
+{
+	return (_size);
+}
+
+template <typename K, typename V, class H, bool cache_hash>
+void GroupHashTable<K, V, H, cache_hash>::clear()
+{
+	_size = 0;
+	if UNLIKELY(++generation == 0) {
+		for (size_t g = 0; g < _buckets / GROUP_WIDTH; ++g) {
+			groups[g].stamp = 0;
+		}
+		generation = 1;
+	}
+}
+
+template <typename K, typename V, class H, bool cache_hash>
+void GroupHashTable<K, V, H, cache_hash>::reserve(size_t expected_keys)
+{
+	grow(group_buckets(expected_keys));
+}
+
+/* Hashers may only fill the low bits, mix them into the high ones */
+template <typename K, typename V, class H, bool cache_hash>
+inline uint32_t GroupHashTable<K, V, H, cache_hash>::mix(K key) const
+{
+	uint64_t h = (uint64_t)hasher.hash(key) * 0x9e3779b97f4a7c15llu;
+	return ((uint32_t)(h >> 32));
+}
+
+/**
+ * Slot of key if found, else the first empty slot of its probe sequence.
+ * Groups are probed quadratically, which visits all of them.
+ */
+template <typename K, typename V, class H, bool cache_hash>
+inline size_t GroupHashTable<K, V, H, cache_hash>::find(uint32_t h, K key,
+							bool &found) const
+{
+	size_t mask = _buckets / GROUP_WIDTH - 1;
+	size_t group = (h >> 7) & mask;
+	uint8_t tag = h & 0x7f;
+
+	for (size_t probe = 0; probe <= mask; probe++) {
+		const GroupHeader &g = groups[group];
+		size_t base = group * GROUP_WIDTH;
+		/* Groups are seldom full, hence keys are mostly found first in
+		 * their group : load its first slots along with the header */
+		__builtin_prefetch(slots + base);
+		if (g.stamp != generation) {
+			found = false;
+			return (base);
+		}
+		uint32_t match = group_match(g.ctrl, tag);
+		while (match) {
+			size_t slot = base + __builtin_ctz(match);
+			if (hasher.is_equal(slots[slot].key, key)) {
+				found = true;
+				return (slot);
+			}
+			match &= match - 1;
+		}
+		uint32_t empty = group_empty(g.ctrl);
+		if (empty) {
+			found = false;
+			return (base + __builtin_ctz(empty));
+		}
+		group = (group + probe + 1) & mask;
+	}
+
+	/* we should never reach this point */
+	assert(false && "Table is full !\n");
+	found = false;
+	return (0);
+}
+
+/* Same as find for a key known not to be in the table */
+template <typename K, typename V, class H, bool cache_hash>
+inline size_t GroupHashTable<K, V, H, cache_hash>::find_empty(uint32_t h) const
+{
+	size_t mask = _buckets / GROUP_WIDTH - 1;
+	size_t group = (h >> 7) & mask;
+
+	for (size_t probe = 0; probe <= mask; probe++) {
+		const GroupHeader &g = groups[group];
+		size_t base = group * GROUP_WIDTH;
+		if (g.stamp != generation)
+			return (base);
+		uint32_t empty = group_empty(g.ctrl);
+		if (empty)
+			return (base + __builtin_ctz(empty));
+		group = (group + probe + 1) & mask;
+	}
+
+	assert(false && "Table is full !\n");
+	return (0);
+}
+
+template <typename K, typename V, class H, bool cache_hash>
+inline void GroupHashTable<K, V, H, cache_hash>::insert_at(size_t slot,
+							   uint32_t h, K key,
+							   V val)
+{
+	GroupHeader &g = groups[slot / GROUP_WIDTH];
+	if (g.stamp != generation) {
+		memset(g.ctrl, GROUP_CTRL_EMPTY, GROUP_WIDTH);
+		g.stamp = generation;
+	}
+	g.ctrl[slot % GROUP_WIDTH] = h & 0x7f;
+	slots[slot].key = key;
+	slots[slot].val = val;
+	if constexpr (cache_hash) {
+		slots[slot].hash = h;
+	}
+	_size++;
+}
+
+template <typename K, typename V, class H, bool cache_hash>
+inline V* GroupHashTable<K, V, H, cache_hash>::get(K key) const
+{
+	bool found;
+	size_t slot = find(mix(key), key, found);
+	return found ? &slots[slot].val : nullptr;
+}
+
+template <typename K, typename V, class H, bool cache_hash>
+inline V* GroupHashTable<K, V, H, cache_hash>::get_or_set(K key, V alt_val)
+{
+	bool found;
+	uint32_t h = mix(key);
+	size_t slot = find(h, key, found);
+	if (found)
+		return &slots[slot].val;
+
+	insert_at(slot, h, key, alt_val);
+	if UNLIKELY(!load_factor_ok()) {
+		grow(2 * _buckets);
+		assert(load_factor_ok());
+	}
+	return nullptr;
+}
+
+template <typename K, typename V, class H, bool cache_hash>
+inline void GroupHashTable<K, V, H, cache_hash>::set_at(K key, V val)
+{
+	bool found;
+	uint32_t h = mix(key);
+	size_t slot = find(h, key, found);
+	if (found) {
+		slots[slot].val = val;
+		return;
+	}
+
+	insert_at(slot, h, key, val);
+	if UNLIKELY(!load_factor_ok()) {
+		grow(2 * _buckets);
+		assert(load_factor_ok());
+	}
+}
+
+template <typename K, typename V, class H, bool cache_hash>
+float GroupHashTable<K, V, H, cache_hash>::load_factor() const
+{
+	return static_cast<float>(_size) / _buckets;
+}
+
+template <typename K, typename V, class H, bool cache_hash>
+void GroupHashTable<K, V, H, cache_hash>::grow(size_t new_buckets)
+{
+	if (new_buckets <= _buckets) return;
+
+#ifdef DEBUG
+	printf("GroupHashTable Grow to %zu!\n", new_buckets);
+#endif
+
+	assert((new_buckets & (new_buckets - 1)) == 0);
+
+	size_t old_count = _buckets / GROUP_WIDTH;
+	uint32_t old_generation = generation;
+	GroupHeader *old_groups = groups;
+	Slot *old_slots = slots;
+	void *old_groups_mem = groups_mem;
+
+	alloc(new_buckets);
+	_size = 0;
+
+	for (size_t g = 0; g < old_count; ++g) {
+		if (old_groups[g].stamp != old_generation) continue;
+
+		for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+			if (old_groups[g].ctrl[i] & GROUP_CTRL_EMPTY) continue;
+
+			const Slot &s = old_slots[g * GROUP_WIDTH + i];
+			uint32_t h;
+			if constexpr (cache_hash) {
+				h = s.hash;
+			} else {
+				h = mix(s.key);
+			}
+			insert_at(find_empty(h), h, s.key, s.val);
+		}
+	}
+
+	arena_free(arena, old_groups_mem);
+	arena_free(arena, old_slots);
+}
+
+template <typename K, typename V, class H, bool cache_hash>
+inline bool GroupHashTable<K, V, H, cache_hash>::load_factor_ok() const
+{
+	/* 87.5% load factor limit */
+	return (_size <= _buckets - _buckets / 8);
+}
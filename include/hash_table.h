@@ -6,6 +6,7 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include "arena.h"
 #include "sys_utils.h"
 
 /* a trivial hasher (meant for arithmetic types) */
@@ -24,7 +25,8 @@ template <typename K, typename V, class H = DefaultHasher<K>>
 struct HashTable {
 public:
 	/* Methods */
-	HashTable(size_t expected_nkeys = 8, H hasher = H());
+	HashTable(size_t expected_nkeys = 8, H hasher = H(),
+		  Arena *arena = nullptr);
 	~HashTable();
 	size_t size() const;
 	void clear();
@@ -40,6 +42,7 @@ protected:
 	K *keys;
 	V *vals;
 	H hasher;
+	Arena *arena;
 	/* Methods */
 	void grow(size_t buckets);
 	bool load_factor_ok() const;
@@ -71,16 +74,18 @@ static inline size_t hash_lookup(K *keys, size_t buckets, H hasher, K key)
 }
 
 template<typename K, typename V, typename H>
-HashTable<K, V, H>::HashTable(size_t expected_keys, H hasher)
-	: _size(0), _buckets(1), hasher(hasher) 
+HashTable<K, V, H>::HashTable(size_t expected_keys, H hasher, Arena *arena)
+	: _size(0), _buckets(1), hasher(hasher), arena(arena)
 {
 	while (_buckets < (3 * expected_keys / 2))
 	{
 		_buckets *= 2;
 	}
 	
-	keys = static_cast<K*>(malloc(_buckets * sizeof(K)));
-	vals = static_cast<V*>(malloc(_buckets * sizeof(V)));
+	keys = static_cast<K*>(arena_realloc(arena, nullptr, 0,
+					     _buckets * sizeof(K)));
+	vals = static_cast<V*>(arena_realloc(arena, nullptr, 0,
+					     _buckets * sizeof(V)));
 	assert(keys != nullptr && vals != nullptr);
 
 	clear();
@@ -92,8 +97,8 @@ HashTable<K, V, H>::~HashTable()
 	_buckets = 0;
 	_size = 0;
 
-	free(keys);
-	free(vals);
+	arena_free(arena, keys);
+	arena_free(arena, vals);
 }
 
 template<typename K, typename V, typename H>
@@ -188,8 +193,10 @@ void HashTable<K, V, H>::grow(size_t new_buckets)
 
 	assert((new_buckets & (new_buckets - 1)) == 0);
 
-	K *newk = (K *)malloc(new_buckets * sizeof(*newk));
-	V *newv = (V *)malloc(new_buckets * sizeof(*newv));
+	K *newk = (K *)arena_realloc(arena, nullptr, 0,
+				     new_buckets * sizeof(*newk));
+	V *newv = (V *)arena_realloc(arena, nullptr, 0,
+				     new_buckets * sizeof(*newv));
 	
 	for (size_t i = 0; i < new_buckets; ++i) {
 		newk[i] = hasher.empty_key;
@@ -208,8 +215,8 @@ void HashTable<K, V, H>::grow(size_t new_buckets)
 		newv[new_idx] = vals[probe];
 	}
 	
-	free(keys);
-	free(vals);
+	arena_free(arena, keys);
+	arena_free(arena, vals);
 	keys = newk;
 	vals = newv;
 	_buckets = new_buckets;
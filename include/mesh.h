@@ -5,6 +5,8 @@
 #include "vec2.h"
 #include "vec3.h"
 
+struct Arena;
+
 #define MAX_UV_MAPS 2
 
 namespace VtxAttr {
@@ -38,6 +40,10 @@ struct MBuf {
 	Vec2 *uv[MAX_UV_MAPS] = {nullptr};
 	uint32_t *remap       = nullptr;
 
+	/* Streams are allocated from this arena when set, from the heap
+	 * otherwise */
+	Arena *arena          = nullptr;
+
 	void clear();
 	void reserve_indices (size_t num, bool shrink = false);
 	void reserve_vertices(size_t num, bool shrink = false);
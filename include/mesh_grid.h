@@ -4,8 +4,8 @@
 
 #include "array.h"
 #include "camera.h"
+#include "group_hash_table.h"
 #include "hash.h"
-#include "hash_table.h"
 #include "mesh.h"
 #include "vec3.h"
 
@@ -30,7 +30,7 @@ struct CellCoordHasher {
 	bool is_empty(CellCoord coord) const;
 	bool is_equal(CellCoord c1, CellCoord c2) const;
 };
-typedef HashTable<CellCoord, uint32_t, CellCoordHasher> CellTable;
+typedef GroupHashTable<CellCoord, uint32_t, CellCoordHasher> CellTable;
 
 inline size_t CellCoordHasher::hash(CellCoord coord) const
 {
@@ -49,6 +49,136 @@ inline bool CellCoordHasher::is_equal(CellCoord c1, CellCoord c2) const
 
 CellCoord parent_coord(const CellCoord coord);
 
+/* Spread the 16 low bits of v so that they occupy every third bit */
+inline uint64_t spread_bits_3(uint64_t v)
+{
+	v &= 0xFFFF;
+	v = (v | (v << 16)) & 0x0000FF0000FF;
+	v = (v | (v << 8)) & 0x00F00F00F00F;
+	v = (v | (v << 4)) & 0x0C30C30C30C3;
+	v = (v | (v << 2)) & 0x249249249249;
+	return v;
+}
+
+/**
+ * Morton key of a cell within its level. Coordinates are biased by
+ * 2^(15 - lod) so that negative ones sort before positive ones and so that
+ * the key of a parent is the key of any of its children >> 3 : sorting a
+ * level by key sorts the level below by parent first, octant second.
+ */
+inline uint64_t cell_morton_key(CellCoord coord)
+{
+	uint16_t bias = 0x8000 >> coord.lod;
+	uint64_t x = (uint16_t)(coord.x + bias);
+	uint64_t y = (uint16_t)(coord.y + bias);
+	uint64_t z = (uint16_t)(coord.z + bias);
+
+	return spread_bits_3(x) | (spread_bits_3(y) << 1) |
+	       (spread_bits_3(z) << 2);
+}
+
+/* Box of cells of one level, bounds included */
+struct CellBox {
+	CellCoord min;
+	CellCoord max;
+	bool contains(CellCoord coord) const;
+};
+
+inline bool CellBox::contains(CellCoord coord) const
+{
+	return (coord.lod == min.lod && coord.x >= min.x && coord.x <= max.x &&
+		coord.y >= min.y && coord.y <= max.y && coord.z >= min.z &&
+		coord.z <= max.z);
+}
+
+struct InitCtx;
+struct MeshGridFile;
+struct PlyStream;
+struct ThreadPool;
+struct MeshGrid;
+
+struct Candidate {
+	uint32_t idx;
+	uint32_t parent_idx;
+	/* enum Visibility */
+	uint8_t vis;
+};
+
+/**
+ * What the incremental selection knows of a cell from earlier frames. Its
+ * acceptability (low bit of lod_stamp) holds as long as the view point
+ * stays within radius of the reference view point, and its visibility
+ * (low 2 bits of vis_stamp) as long as the projection does not change.
+ * Stamps are the epochs at which they were decided.
+ */
+struct CellDecision {
+	float radius;
+	uint32_t lod_stamp;
+	uint32_t vis_stamp;
+	uint32_t parent;
+};
+
+/* Cell of the budgeted selection, refined by decreasing priority */
+struct RefineCandidate {
+	float priority;
+	uint32_t idx;
+	uint32_t parent_idx;
+	uint8_t vis;
+};
+
+/* Ancestor of the cut cell being updated, one per level */
+struct CutPathEntry {
+	uint32_t idx;
+	uint8_t vis;
+	bool refined;
+};
+
+/**
+ * Buffers of select_cells_from_view_point, kept from one selection to the
+ * next, whatever the view. They are sized for the whole grid on first use
+ * (a cell is visited or drawn at most once per selection), hence later
+ * selections do not allocate. The high water marks tell how much of them
+ * selections actually needed.
+ */
+struct SelectionContext {
+	/* Breadth first traversal queue */
+	TArray<Candidate> to_visit;
+	/* Result : cells to draw, and their parent cells */
+	TArray<uint32_t> to_draw;
+	TArray<uint32_t> parents;
+	/* Parallel selection : fate of the to_visit entries of a level (see
+	 * select_cell), and where each chunk of them writes its outputs */
+	TArray<uint8_t> fates;
+	TArray<uint32_t> chunk_offsets;
+	/* Budgeted selection : max heap of the cells that can be refined */
+	TArray<RefineCandidate> refine_heap;
+	/* Incremental selection : cut of the last frame in depth first order,
+	 * culled cells included, and the next one being built */
+	TArray<uint32_t> cuts[2];
+	int cut_side = 0;
+	TArray<CellDecision> decisions;
+	TArray<CutPathEntry> path;
+	bool cut_valid = false;
+	float cut_error_multiplier;
+	bool cut_continuous_lod;
+	bool cut_frustum_cull;
+	Vec3 ref_vp;
+	float ref_pvm[16];
+	uint32_t lod_epoch = 0;
+	uint32_t vis_epoch = 0;
+	/* Least radius of the acceptabilities the cut depends on */
+	float min_radius;
+	bool rebase;
+	/* Cells tested by the last incremental selection */
+	size_t tested = 0;
+	/* High water marks */
+	size_t max_visited = 0;
+	size_t max_drawn = 0;
+	/* Methods */
+	void reserve(const MeshGrid &mg);
+	void clear();
+};
+
 struct MeshGrid {
 	/* Grid */
 	Vec3 base;
@@ -65,31 +195,90 @@ struct MeshGrid {
 	/* Facilities to access or query meshlets */
 	uint32_t levels;
 	float err_tol;
+	/* Adaptive subdivision : cells are only split while they hold more
+	 * than cell_budget indices, leaving leaf cells at any level. Zero
+	 * for a uniform grid, all of whose leaves are at level 0. */
+	uint32_t cell_budget = 0;
 	TArray<uint32_t> cell_offsets;
 	TArray<uint32_t> cell_counts;
-	CellTable cell_table;
+	/* Implicit octree : cells are in Morton order within a level, hence
+	 * the children of a cell are contiguous from its first child on, one
+	 * per bit set in its child mask (octants as in child_coord). */
+	TArray<uint32_t> cell_first_child;
+	TArray<uint8_t> cell_child_mask;
 	/* Methods */
 	MeshGrid(Vec3 base, float step, uint32_t levels, float err_tol);
+	MeshGrid(const MeshGridFile &file);
+	uint32_t find_cell(CellCoord coord);
 	Mesh *get_cell(CellCoord ccoord);
+	unsigned get_child_count(uint32_t idx) const;
 	unsigned get_children(CellCoord pcoord, Mesh *children[8]);
+	void init_cell_index();
 	void build_from_mesh(const MBuf &src, const Mesh &mesh,
-			     int num_threads = 1);
-	void init_from_mesh(const MBuf &src, const Mesh &mesh);
-	void build_level(uint32_t level, uint8_t num_threads = 1);
+			     ThreadPool &pool, bool deterministic = false);
+	int build_from_stream(PlyStream &stream, MBuf &src, Mesh &mesh,
+			      ThreadPool &pool, bool deterministic = false);
+	void build_levels(ThreadPool &pool, bool deterministic);
+	void init_from_mesh(const MBuf &src, const Mesh &mesh,
+			    ThreadPool &pool, const CellBox *box = NULL);
+	void init_level0(InitCtx &ic, TArray<uint64_t> &keys,
+			 TArray<uint32_t> &tris, ThreadPool &pool);
+	void init_level0_cells(InitCtx &ic, TArray<uint64_t> &cell_keys,
+			       TArray<uint32_t> &cell_starts,
+			       uint32_t cell_count, ThreadPool &pool);
+	uint32_t merge_leaf_cells(uint64_t *keys, uint32_t *cell_starts,
+				  uint8_t *cell_lods, uint32_t cell_count);
+	void sort_cells_by_level();
+	int update_region(const MBuf &patch, const Mesh &patch_mesh,
+			  const Aabb &region, ThreadPool &pool);
+	void compact_data();
+	int build_out_of_core(MBuf &src, Mesh &mesh, ThreadPool &pool,
+			      size_t mem_budget, const char *filename,
+			      PlyStream *stream = NULL);
 	void build_parent_cell(CellCoord pcoord);
 	void compute_mean_relative_error();
-	enum Visibility get_visibility(const float *pvm, CellCoord coord);
+	Aabb get_cell_bounds(CellCoord coord) const;
+	enum Visibility get_visibility(const Frustum &frustum,
+				       CellCoord coord) const;
+	void get_visibility(const Frustum &frustum, uint32_t first,
+			    uint32_t count, uint8_t *vis) const;
+	float cell_lod_distance(const Vec3 &vp, uint32_t idx,
+				bool continuous_lod, float error_multiplier,
+				float &kappa);
 	bool cell_is_acceptable(const Vec3 &vp, uint32_t idx,
 				bool continuous_lod, float error_multiplier);
+	float cell_acceptance_margin(const Vec3 &vp, uint32_t idx,
+				     bool continuous_lod,
+				     float error_multiplier);
+	uint8_t select_cell(const Candidate &candi, const Vec3 &vp,
+			    float error_multiplier, bool continuous_lod);
+	void select_cells_from_view_point(const Vec3 &vp,
+					  float error_multiplier,
+					  bool continuous_lod,
+					  bool frustum_cull, const float *pvm,
+					  SelectionContext &sel);
 	void select_cells_from_view_point(const Vec3 &vp,
 					  float error_multiplier,
 					  bool continuous_lod,
 					  bool frustum_cull, const float *pvm,
-					  TArray<uint32_t> &to_draw,
-					  TArray<uint32_t> &parents);
+					  SelectionContext &sel,
+					  ThreadPool &pool);
+	void update_cells_from_view_point(const Vec3 &vp,
+					  float error_multiplier,
+					  bool continuous_lod,
+					  bool frustum_cull, const float *pvm,
+					  SelectionContext &sel);
+	void select_cells_with_budget(const Vec3 &vp, uint32_t tri_budget,
+				      uint32_t vtx_budget, bool frustum_cull,
+				      const float *pvm, SelectionContext &sel);
 	float cell_view_ratio_dinf(const Vec3 vp, CellCoord coord);
 	float cell_view_ratio_d2(const Vec3 vp, CellCoord coord);
 	uint32_t get_triangle_count(uint32_t level);
 	uint32_t get_vertex_count(uint32_t level);
+	Aabb get_bounds();
 };
 
+inline unsigned MeshGrid::get_child_count(uint32_t idx) const
+{
+	return __builtin_popcount(cell_child_mask[idx]);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "mesh_grid.h"
+
+/**
+ * On-disk MeshGrid cache (.myo files).
+ *
+ * The file starts with a MeshGridFileHeader followed by one section per
+ * MeshGrid array. Every section starts on a MESH_GRID_FILE_ALIGN boundary
+ * so that, once the file is mapped, index and vertex streams can be handed
+ * to the GPU straight from the file pages. Data is stored in host byte
+ * order (little-endian on every platform we target).
+ */
+
+#define MESH_GRID_FILE_MAGIC "MYOSGRID"
+#define MESH_GRID_FILE_VERSION 3
+#define MESH_GRID_FILE_ALIGN 4096
+
+enum MeshGridSection {
+	MGS_CELL_COORDS,
+	MGS_CELLS,
+	MGS_CELL_ERRORS,
+	MGS_CELL_OFFSETS,
+	MGS_CELL_COUNTS,
+	MGS_INDICES,
+	MGS_POSITIONS,
+	MGS_NORMALS,
+	MGS_UV0,
+	MGS_UV1,
+	MGS_REMAP,
+	MGS_COUNT
+};
+
+struct MeshGridFileSection {
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct MeshGridFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t vtx_attr;
+	float base[3];
+	float step;
+	uint32_t levels;
+	float err_tol;
+	float mean_relative_error;
+	uint32_t cell_budget;
+	uint32_t cell_count;
+	uint64_t index_count;
+	uint64_t vertex_count;
+	MeshGridFileSection sections[MGS_COUNT];
+};
+
+/**
+ * A read-only mapping of a .myo file. Section pointers stay valid until
+ * close_mesh_grid_file() is called.
+ */
+struct MeshGridFile {
+	int fd = -1;
+	void *addr = nullptr;
+	size_t size = 0;
+	const MeshGridFileHeader *header = nullptr;
+
+	const void *section(MeshGridSection s) const;
+	size_t section_size(MeshGridSection s) const;
+};
+
+/**
+ * Write mg to filename. Index and vertex sections come from mg.data, or
+ * from the files in spill (indexed by section, NULL for absent streams)
+ * for grids built out of core, whose streams never sit in memory.
+ */
+int save_mesh_grid(const char *filename, const MeshGrid &mg,
+		   FILE *const *spill = NULL);
+
+/**
+ * Map filename into file. The header and cells are checked, which does not
+ * touch the index and vertex streams. With verify, indices and the remap
+ * are checked as well, at the cost of reading these streams whole.
+ */
+int open_mesh_grid_file(const char *filename, MeshGridFile &file,
+			bool verify = false);
+
+void close_mesh_grid_file(MeshGridFile &file);
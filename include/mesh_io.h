@@ -1,6 +1,84 @@
+#pragma once
+
 #include <stdio.h>
+#include "array.h"
 #include "mesh.h"
 
+struct ThreadPool;
+
 int load_obj(const char *filename, MBuf& data, Mesh& mesh);
+int load_obj(const char *filename, MBuf &data, Mesh &mesh, ThreadPool &pool);
 int load_ply(const char* filename, MBuf &data, Mesh &mesh);
+int load_ply(const char *filename, MBuf &data, Mesh &mesh, ThreadPool &pool);
+
+#define PLY_MAX_ELEMENTS 8
+#define PLY_MAX_PROPERTIES 32
+#define PLY_NAME_LEN 32
+
+struct PlyProperty {
+	char name[PLY_NAME_LEN];
+	uint8_t type;
+	/* Type of the item count of list properties, PLY_NONE otherwise */
+	uint8_t count_type;
+};
+
+struct PlyElement {
+	char name[PLY_NAME_LEN];
+	size_t count;
+	uint32_t prop_count;
+	PlyProperty props[PLY_MAX_PROPERTIES];
+};
+
+/**
+ * Incremental PLY reader (ASCII or binary). open() parses the header and
+ * loads the vertices, faces are then read by chunks of triangles with
+ * read_triangles(), so that a chunk can be processed while the next one is
+ * parsed. Polygons are split as load_ply does. Binary little endian rows of
+ * the usual layouts are copied straight from the read buffer.
+ */
+struct PlyStream {
+	/* Methods */
+	int open(const char *filename, MBuf &data, Mesh &mesh);
+	size_t read_triangles(uint32_t *indices, size_t max_tris);
+	void close();
+	/* Members */
+	FILE *file = nullptr;
+	int format = 0;
+	PlyElement elements[PLY_MAX_ELEMENTS];
+	uint32_t element_count = 0;
+	uint32_t vertex_count = 0;
+	/* Vertex positions, to split polygons */
+	const Vec3 *positions = nullptr;
+	/* Face element, its vertex index list, and faces not read yet */
+	uint32_t face_elem = 0;
+	uint32_t index_prop = 0;
+	size_t face_count = 0;
+	size_t faces_left = 0;
+	/* Binary little endian faces with scalars only around the index
+	 * list, and the size of these before and after it */
+	bool fast_faces = false;
+	uint32_t face_head = 0;
+	uint32_t face_tail = 0;
+	/* Set on malformed faces or read errors */
+	bool error = false;
+	/* Read buffer */
+	char *buf = nullptr;
+	size_t buf_pos = 0;
+	size_t buf_end = 0;
+	/* Polygon being split, and its triangles, which may span two
+	 * chunks from poly_next on */
+	TArray<uint32_t> poly;
+	TArray<uint32_t> poly_tris;
+	uint32_t poly_next = 0;
 
+	int parse_header();
+	bool fill(size_t num);
+	bool read_value(uint8_t type, double &value);
+	bool skip_property(const PlyProperty &prop);
+	bool skip_bytes(size_t num);
+	int read_vertices(const PlyElement &elem, MBuf &data, Mesh &mesh);
+	int skip_element(const PlyElement &elem);
+	void init_fast_faces();
+	bool read_fast_triangle(uint32_t *tri);
+	int read_face(const PlyElement &elem);
+};
@@ -7,12 +7,32 @@
 #include "mesh.h"
 #include "vertex_table.h"
 
+struct ThreadPool;
+
 Aabb compute_mesh_bounds(const Vec3* positions, size_t vertex_count);
 
 Aabb compute_mesh_bounds(const Mesh& mesh, const MBuf& data);
 
 void compute_mesh_normals(const Mesh& mesh, MBuf& data);
 
+/* Same result, on the threads of pool */
+void compute_mesh_normals(const Mesh& mesh, MBuf& data, ThreadPool& pool);
+
+/* Same, for indices split in chunks of chunk_tris triangles (the last one
+ * may be shorter) */
+void compute_mesh_normals(const Mesh& mesh, MBuf& data,
+			  uint32_t *const *idx_chunks, size_t chunk_tris,
+			  ThreadPool& pool);
+
+/* Same, for triangles that are not kept : they are added by chunks, in
+ * order, once started. remap holds one entry per vertex of mesh. */
+void start_mesh_normals(const Mesh& mesh, MBuf& data, uint32_t *remap,
+			ThreadPool& pool);
+void add_mesh_normals(const Mesh& mesh, MBuf& data, const uint32_t *remap,
+		      const uint32_t *indices, size_t index_count);
+void finish_mesh_normals(const Mesh& mesh, MBuf& data, const uint32_t *remap,
+			 ThreadPool& pool);
+
 void concat_mesh(Mesh& dst_m, MBuf& dst_d, const Mesh& src_m, const MBuf& src_d);
 
 void join_mesh_from_indices(Mesh& dst_m, MBuf& dst_d, const Mesh& src_m, 
@@ -31,7 +51,58 @@ void copy_indices(MBuf& dst, size_t dst_off, const MBuf& src, size_t src_off,
 void copy_vertices(MBuf& dst, size_t dst_off, const MBuf& src, size_t src_off,
 		   size_t vtx_num, size_t vtx_off = 0);
 
+/* Copies vertices src_off + src_idx[i] of src to dst_off + i in dst, one
+ * attribute stream after the other */
+void gather_vertices(MBuf& dst, size_t dst_off, const MBuf& src,
+		     const uint32_t *src_idx, size_t vtx_num,
+		     size_t src_off = 0);
+
+/* Same as copy_vertices for a single vertex, without the calls */
+inline void copy_vertex(MBuf& dst, size_t dst_off, const MBuf& src,
+			size_t src_off)
+{
+	uint32_t vtx_attr = src.vtx_attr & dst.vtx_attr;
+
+	dst.positions[dst_off] = src.positions[src_off];
+	if (vtx_attr & VtxAttr::NML)
+		dst.normals[dst_off] = src.normals[src_off];
+	if (vtx_attr & VtxAttr::UV0)
+		dst.uv[0][dst_off] = src.uv[0][src_off];
+	if (vtx_attr & VtxAttr::UV1)
+		dst.uv[1][dst_off] = src.uv[1][src_off];
+	if (vtx_attr & VtxAttr::MAP)
+		dst.remap[dst_off] = src.remap[src_off];
+}
+
 uint32_t copy_unique_vertices(MBuf& dst_d, uint32_t dst_off, const MBuf& src_d, 
 		uint32_t *vtx_idx, uint32_t vtx_count, VertexTable& vtx_table,
 		uint32_t *remap);
 
+/* Templated versions : vtx_attr is the exact set of attributes of the
+ * destination, including VtxAttr::MAP if it has one. */
+
+template <uint32_t vtx_attr>
+inline void copy_vertex(MBuf& dst, size_t dst_off, const MBuf& src,
+			size_t src_off)
+{
+	dst.positions[dst_off] = src.positions[src_off];
+	if constexpr (vtx_attr & VtxAttr::NML)
+		dst.normals[dst_off] = src.normals[src_off];
+	if constexpr (vtx_attr & VtxAttr::UV0)
+		dst.uv[0][dst_off] = src.uv[0][src_off];
+	if constexpr (vtx_attr & VtxAttr::UV1)
+		dst.uv[1][dst_off] = src.uv[1][src_off];
+	if constexpr (vtx_attr & VtxAttr::MAP)
+		dst.remap[dst_off] = src.remap[src_off];
+}
+
+template <uint32_t vtx_attr>
+void join_mesh_from_vertices(Mesh& dst_m, MBuf& dst_d, const Mesh& src_m,
+		const MBuf& src_d, TVertexTable<vtx_attr>& vtx_table,
+		uint32_t *remap);
+
+template <uint32_t vtx_attr>
+uint32_t copy_unique_vertices(MBuf& dst_d, uint32_t dst_off,
+		const MBuf& src_d, uint32_t *vtx_idx, uint32_t vtx_count,
+		TVertexTable<vtx_attr>& vtx_table, uint32_t *remap);
+
@@ -8,6 +8,8 @@ struct MyosotisCfg {
 
 	bool adaptative_lod = true;
 	bool continuous_lod = true;
+	bool incremental_lod = false;
+	bool budget_lod = false;
 	bool colorize_lod = false;
 	bool colorize_cells = false;
 	bool smooth_shading = false;
@@ -18,6 +20,7 @@ struct MyosotisCfg {
 	float camera_fov = 45.0f;
 	int level = 0;
 	float pix_error = 2;
+	int tri_budget = 2000000;
 	// ImVec4 clear_color = ImVec4(0.25f, 0.22f, 0.15f, 1.00f);
 	ImVec4 clear_color = ImVec4(0.75f, 0.85f, 0.95f, 1.00f);
 };
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ThreadPool;
+
+/**
+ * Stable LSD radix sort of (key, value) pairs by key, on the threads of
+ * pool. Keys are sorted 8 bits at a time and bytes that are equal in all
+ * keys are skipped, hence narrow key ranges cost fewer passes. Each thread
+ * sorts a contiguous slice of every pass, so the result does not depend on
+ * the number of threads.
+ */
+void radix_sort_pairs(uint64_t *keys, uint32_t *vals, size_t count,
+		      ThreadPool &pool);
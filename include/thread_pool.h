@@ -0,0 +1,58 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+
+/* A job is run once by every thread of the pool */
+typedef void (*ThreadJob)(void *ctx, int thread_id);
+
+/* A task is run once per index of a parallel_for */
+typedef void (*ThreadTask)(void *ctx, uint32_t idx, int thread_id);
+
+/**
+ * Persistent pool of worker threads.
+ *
+ * The calling thread takes part in every job as thread 0, hence a pool of
+ * num_threads threads only spawns num_threads - 1 workers. Workers sleep
+ * between jobs. Jobs must not be nested.
+ */
+struct ThreadPool {
+	/* Methods */
+	ThreadPool(int num_threads);
+	~ThreadPool();
+	int size() const { return num_threads; }
+	void run(ThreadJob job, void *ctx);
+	void parallel_for(uint32_t count, ThreadTask task, void *ctx);
+
+	/* Members */
+	int num_threads;
+	pthread_t *threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	uint64_t generation = 0;
+	int running = 0;
+	bool quit = false;
+	ThreadJob job = nullptr;
+	void *job_ctx = nullptr;
+
+	/**
+	 * Work-stealing ranges for parallel_for, one per thread. Bounds
+	 * [begin, end) are packed in a single word as (begin << 32 | end) so
+	 * that the owner (popping from the front) and thieves (taking half
+	 * from the back) only ever race on one CAS.
+	 */
+	struct alignas(64) Range {
+		std::atomic<uint64_t> bounds;
+	};
+	Range *ranges;
+	ThreadTask task = nullptr;
+	void *task_ctx = nullptr;
+
+	bool pop_task(int thread_id, uint32_t &idx);
+	bool steal_tasks(int thread_id, uint32_t &idx);
+};
+
+int default_thread_count();
@@ -2,6 +2,8 @@
 
 #include "mesh.h"
 
+struct ThreadPool;
+
 /* I. Non templated version (uses branching for vertex attribs) */
 uint32_t build_vertex_remap_old(const Mesh& mesh, const MBuf& data, 
 			    uint32_t vtx_attr, uint32_t *remap);
@@ -25,5 +27,18 @@ template <uint32_t vtx_attr>
 uint32_t build_vertex_remap_from_indices(const Mesh& mesh, const MBuf& data, 
 					 uint32_t *remap);
 
-constexpr auto build_position_remap = build_vertex_remap<VtxAttr::POS>;
+/* Same remap as build_vertex_remap, on the threads of pool. Large meshes
+ * are welded by build_vertex_remap_sorted. */
+template <uint32_t vtx_attr>
+uint32_t build_vertex_remap(const Mesh& mesh, const MBuf& data,
+			    uint32_t *remap, ThreadPool &pool);
+
+/* Same remap again, by sorting vertices rather than with hash tables */
+template <uint32_t vtx_attr>
+uint32_t build_vertex_remap_sorted(const Mesh& mesh, const MBuf& data,
+				   uint32_t *remap, ThreadPool &pool);
+
+constexpr uint32_t (*build_position_remap)(const Mesh&, const MBuf&,
+					   uint32_t *) =
+	build_vertex_remap<VtxAttr::POS>;
 
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 
+#include "group_hash_table.h"
 #include "hash_table.h"
 #include "hash.h"
 #include "mesh.h"
@@ -17,19 +18,20 @@ struct VertexHasher {
 	bool is_equal(uint32_t key1, uint32_t key2) const;
 };
 
-using _VertexTable = HashTable<uint32_t, uint32_t, VertexHasher>;
+/* Vertex hashes are costly, cache them */
+using _VertexTable = GroupHashTable<uint32_t, uint32_t, VertexHasher, true>;
 
 struct VertexTable : public _VertexTable {
 	VertexTable(size_t expected_nkeys, const MBuf* data, 
-		    uint32_t vtx_attr);
+		    uint32_t vtx_attr, Arena* arena = nullptr);
 	const MBuf* get_mesh_data() const {return hasher.data;};
 	void set_mesh_data(const MBuf* data) {hasher.data = data;}
 };
 
 inline
 VertexTable::VertexTable(size_t expected_nkeys, const MBuf* data, 
-			 uint32_t vtx_attr)
-	: _VertexTable::HashTable(expected_nkeys, {data, vtx_attr}) 
+			 uint32_t vtx_attr, Arena* arena)
+	: _VertexTable(expected_nkeys, {data, vtx_attr}, arena)
 {
 }
 
@@ -100,17 +102,22 @@ struct TVertexHasher {
 };
 
 template <uint32_t vtx_attr>
-using _TVertexTable = HashTable<uint32_t, uint32_t, TVertexHasher<vtx_attr>>;
+using _TVertexTable =
+    GroupHashTable<uint32_t, uint32_t, TVertexHasher<vtx_attr>, true>;
 
 template <uint32_t vtx_attr>
 struct TVertexTable : public _TVertexTable<vtx_attr> {
-	TVertexTable(size_t init_num, const MBuf* data); 
+	TVertexTable(size_t init_num, const MBuf* data,
+		     Arena* arena = nullptr);
+	const MBuf* get_mesh_data() const {return this->hasher.data;};
+	void set_mesh_data(const MBuf* data) {this->hasher.data = data;}
 };
 	
 template <uint32_t vtx_attr>
 inline 
-TVertexTable<vtx_attr>::TVertexTable(size_t expected_nkeys, const MBuf* data)
-	: _TVertexTable<vtx_attr>::HashTable(expected_nkeys, {data})
+TVertexTable<vtx_attr>::TVertexTable(size_t expected_nkeys, const MBuf* data,
+				     Arena* arena)
+	: _TVertexTable<vtx_attr>(expected_nkeys, {data}, arena)
 {
 }
 
@@ -0,0 +1,83 @@
+#include "arena.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "sys_utils.h"
+
+/* Heap blocks are chained through a header placed in front of them */
+struct ArenaOverflow {
+	void *next;
+	size_t pad;
+};
+
+Arena::Arena(size_t capacity)
+{
+	if (capacity) {
+		MALLOC_SIZ(chunk, capacity);
+		this->capacity = capacity;
+	}
+}
+
+Arena::~Arena()
+{
+	reset();
+	free(chunk);
+}
+
+void *Arena::alloc_overflow(size_t size)
+{
+	ArenaOverflow *block;
+	MALLOC_SIZ(block, sizeof(ArenaOverflow) + size);
+	block->next = overflow;
+	overflow = block;
+	overflow_size += size;
+
+	return (block + 1);
+}
+
+void Arena::reset()
+{
+	while (overflow) {
+		ArenaOverflow *block = (ArenaOverflow *)overflow;
+		overflow = block->next;
+		free(block);
+	}
+
+	/* Make room for everything that was needed since the last reset */
+	if (overflow_size) {
+		size_t needed = used + overflow_size;
+		capacity = (capacity * 2 > needed) ? capacity * 2 : needed;
+		free(chunk);
+		MALLOC_SIZ(chunk, capacity);
+	}
+
+	used = 0;
+	overflow_size = 0;
+}
+
+static thread_local Arena *meshopt_arena = nullptr;
+
+void bind_meshopt_arena(Arena *arena)
+{
+	meshopt_arena = arena;
+}
+
+void *meshopt_arena_allocate(size_t size)
+{
+	if (meshopt_arena)
+		return meshopt_arena->alloc(size);
+
+	void *p;
+	MALLOC_SIZ(p, size);
+	return p;
+}
+
+/* Only called on memory allocated by meshoptimizer itself within a call,
+ * hence bound to the same arena (or to none) as at allocation time. */
+void meshopt_arena_deallocate(void *ptr)
+{
+	if (!meshopt_arena)
+		free(ptr);
+}
@@ -1,5 +1,11 @@
 #include <assert.h>
 #include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VISIBILITY_AVX2
+#endif
 
 #include "aabb.h"
 #include "camera.h"
@@ -193,89 +199,202 @@ Vec3 Camera::world_coord_at(float x, float y, float depth) const
 	return transform(clip_to_world(), ndc);
 }
 
-int is_visible(const float *vtx, int n, const float *pvm)
+/**
+ * Gribb and Hartmann : the clip volume is -w <= x, y, z <= w, that is
+ * w +- x >= 0 and so on, w, x, y and z being the rows of pvm applied to a
+ * point. Planes are not normalised, their sign is all that matters.
+ */
+Frustum frustum_from_matrix(const float *pvm)
 {
-	bool clipx, clip_R, clip_L;
-	bool clipy, clip_T, clip_B;
-	bool clipz, clip_F, clip_N;
-	float T, W;
-	clipx = clip_R = clip_L = 1;
-	clipy = clip_T = clip_B = 1;
-	clipz = clip_F = clip_N = 1;
-	for (int i = 0; i < n; ++i) {
-		W = pvm[3] * vtx[3 * i + 0] + pvm[7] * vtx[3 * i + 1] +
-		    pvm[11] * vtx[3 * i + 2] + pvm[15];
-		if (clipx) {
-			T = pvm[0] * vtx[3 * i + 0] + pvm[4] * vtx[3 * i + 1] +
-			    pvm[8] * vtx[3 * i + 2] + pvm[12];
-			clip_R = clip_R && (T > W);
-			clip_L = clip_L && (T < -W);
-			clipx = clip_R || clip_L;
-		}
-		if (clipy) {
-			T = pvm[1] * vtx[3 * i + 0] + pvm[5] * vtx[3 * i + 1] +
-			    pvm[9] * vtx[3 * i + 2] + pvm[13];
-			clip_T = clip_T && (T > W);
-			clip_B = clip_B && (T < -W);
-			clipy = clip_T || clip_B;
-		}
-		if (clipz) {
-			T = pvm[2] * vtx[3 * i + 0] + pvm[6] * vtx[3 * i + 1] +
-			    pvm[10] * vtx[3 * i + 2] + pvm[14];
-			clip_F = clip_F && (T > W);
-			clip_N = clip_N && (T < -W);
-			clipz = clip_F || clip_N;
+	Frustum f;
+	f.l = {{{pvm[3] + pvm[0], pvm[7] + pvm[4], pvm[11] + pvm[8]}},
+	       pvm[15] + pvm[12]};
+	f.r = {{{pvm[3] - pvm[0], pvm[7] - pvm[4], pvm[11] - pvm[8]}},
+	       pvm[15] - pvm[12]};
+	f.b = {{{pvm[3] + pvm[1], pvm[7] + pvm[5], pvm[11] + pvm[9]}},
+	       pvm[15] + pvm[13]};
+	f.t = {{{pvm[3] - pvm[1], pvm[7] - pvm[5], pvm[11] - pvm[9]}},
+	       pvm[15] - pvm[13]};
+	f.n = {{{pvm[3] + pvm[2], pvm[7] + pvm[6], pvm[11] + pvm[10]}},
+	       pvm[15] + pvm[14]};
+	f.f = {{{pvm[3] - pvm[2], pvm[7] - pvm[6], pvm[11] - pvm[10]}},
+	       pvm[15] - pvm[14]};
+	return (f);
+}
+
+/**
+ * A box is out of the frustum if its corner farthest along the normal of
+ * a plane is behind it, and fully in if the nearest corners are in front
+ * of all planes. Both kernels compute the same sums in the same order,
+ * hence give the same result.
+ */
+static void visibility_scalar(const AabbArrays &boxes, size_t first,
+			      size_t count, const Frustum &frustum,
+			      uint8_t *vis)
+{
+	const Plane *planes[6] = {&frustum.l, &frustum.r, &frustum.b,
+				  &frustum.t, &frustum.n, &frustum.f};
+
+	for (size_t i = first; i < first + count; ++i) {
+		bool out = false;
+		bool cross = false;
+		for (int p = 0; p < 6; ++p) {
+			const Plane &pl = *planes[p];
+			/* Farthest and nearest corners along the normal */
+			float fx = pl.a >= 0 ? boxes.max_x[i] : boxes.min_x[i];
+			float fy = pl.b >= 0 ? boxes.max_y[i] : boxes.min_y[i];
+			float fz = pl.c >= 0 ? boxes.max_z[i] : boxes.min_z[i];
+			float nx = pl.a >= 0 ? boxes.min_x[i] : boxes.max_x[i];
+			float ny = pl.b >= 0 ? boxes.min_y[i] : boxes.max_y[i];
+			float nz = pl.c >= 0 ? boxes.min_z[i] : boxes.max_z[i];
+			float dfar = pl.a * fx + pl.b * fy + pl.c * fz + pl.d;
+			float dnear = pl.a * nx + pl.b * ny + pl.c * nz + pl.d;
+			out = out || dfar < 0;
+			cross = cross || dnear < 0;
 		}
-		if (!(clipx || clipy || clipz))
-			return 1;
+		vis[i] = out ? Visibility::None
+			     : (cross ? Visibility::Partial : Visibility::Full);
 	}
-	return 0;
 }
 
-enum Visibility visibility(const Aabb &bbox, const float *pvm)
+#ifdef VISIBILITY_AVX2
+/**
+ * Same as visibility_scalar for 8 boxes, returning the masks of the boxes
+ * out of the frustum and crossing its planes
+ */
+__attribute__((target("avx2"))) static inline void
+visibility8_avx2(__m256 min_x, __m256 min_y, __m256 min_z, __m256 max_x,
+		 __m256 max_y, __m256 max_z, const Frustum &frustum,
+		 int &out_mask, int &cross_mask)
 {
-	bool clip_R = true;
-	bool clip_L = true;
-	bool clip_T = true;
-	bool clip_B = true;
-	bool clip_F = true;
-	bool clip_N = true;
+	const Plane *planes[6] = {&frustum.l, &frustum.r, &frustum.b,
+				  &frustum.t, &frustum.n, &frustum.f};
+
+	__m256 zero = _mm256_setzero_ps();
+	__m256 out = zero;
+	__m256 cross = zero;
+
+	for (int p = 0; p < 6; ++p) {
+		const Plane &pl = *planes[p];
+		__m256 a = _mm256_set1_ps(pl.a);
+		__m256 b = _mm256_set1_ps(pl.b);
+		__m256 c = _mm256_set1_ps(pl.c);
+		__m256 d = _mm256_set1_ps(pl.d);
+		__m256 fx = pl.a >= 0 ? max_x : min_x;
+		__m256 fy = pl.b >= 0 ? max_y : min_y;
+		__m256 fz = pl.c >= 0 ? max_z : min_z;
+		__m256 nx = pl.a >= 0 ? min_x : max_x;
+		__m256 ny = pl.b >= 0 ? min_y : max_y;
+		__m256 nz = pl.c >= 0 ? min_z : max_z;
+		__m256 dfar = _mm256_add_ps(
+		    _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a, fx),
+						_mm256_mul_ps(b, fy)),
+				  _mm256_mul_ps(c, fz)),
+		    d);
+		__m256 dnear = _mm256_add_ps(
+		    _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a, nx),
+						_mm256_mul_ps(b, ny)),
+				  _mm256_mul_ps(c, nz)),
+		    d);
+		out = _mm256_or_ps(out, _mm256_cmp_ps(dfar, zero, _CMP_LT_OQ));
+		cross = _mm256_or_ps(cross,
+				     _mm256_cmp_ps(dnear, zero, _CMP_LT_OQ));
+	}
 
-	bool fully_in = true;
+	out_mask = _mm256_movemask_ps(out);
+	cross_mask = _mm256_movemask_ps(cross);
+}
 
-	float T, W;
+static inline uint8_t visibility_from_masks(int out_mask, int cross_mask,
+					    int i)
+{
+	if ((out_mask >> i) & 1)
+		return (Visibility::None);
+	return ((cross_mask >> i) & 1 ? Visibility::Partial : Visibility::Full);
+}
 
+/* The 8 boxes from first on */
+__attribute__((target("avx2"))) static void
+visibility_avx2(const AabbArrays &boxes, size_t first,
+		const Frustum &frustum, uint8_t *vis)
+{
+	int out_mask;
+	int cross_mask;
+	visibility8_avx2(_mm256_loadu_ps(boxes.min_x + first),
+			 _mm256_loadu_ps(boxes.min_y + first),
+			 _mm256_loadu_ps(boxes.min_z + first),
+			 _mm256_loadu_ps(boxes.max_x + first),
+			 _mm256_loadu_ps(boxes.max_y + first),
+			 _mm256_loadu_ps(boxes.max_z + first), frustum,
+			 out_mask, cross_mask);
 	for (int i = 0; i < 8; ++i) {
-
-		float x = (i & 1) ? (bbox.min.x) : (bbox.max.x);
-		float y = (i & 2) ? (bbox.min.y) : (bbox.max.y);
-		float z = (i & 4) ? (bbox.min.z) : (bbox.max.z);
-
-		W = pvm[3] * x + pvm[7] * y + pvm[11] * z + pvm[15];
-		T = pvm[0] * x + pvm[4] * y + pvm[8] * z + pvm[12];
-		bool is_R = (T > W);
-		bool is_L = (T < -W);
-		clip_R = clip_R && is_R;
-		clip_L = clip_L && is_L;
-		fully_in = fully_in && !is_R && !is_L;
-
-		T = pvm[1] * x + pvm[5] * y + pvm[9] * z + pvm[13];
-		bool is_T = (T > W);
-		bool is_B = (T < -W);
-		clip_T = clip_T && is_T;
-		clip_B = clip_B && is_B;
-		fully_in = fully_in && !is_T && !is_B;
-
-		T = pvm[2] * x + pvm[6] * y + pvm[10] * z + pvm[14];
-		bool is_F = (T > W);
-		bool is_N = (T < -W);
-		clip_F = clip_F && is_F;
-		clip_N = clip_N && is_N;
-		fully_in = fully_in && !is_F && !is_N;
+		vis[first + i] = visibility_from_masks(out_mask, cross_mask, i);
 	}
+}
 
-	if (clip_R || clip_L || clip_T || clip_B || clip_F || clip_N)
-		return Visibility::None;
-	return fully_in ? Visibility::Full : Visibility::Partial;
+/* A single box, in every lane */
+__attribute__((target("avx2"))) static uint8_t
+visibility_avx2(const Aabb &bbox, const Frustum &frustum)
+{
+	int out_mask;
+	int cross_mask;
+	visibility8_avx2(_mm256_set1_ps(bbox.min.x), _mm256_set1_ps(bbox.min.y),
+			 _mm256_set1_ps(bbox.min.z), _mm256_set1_ps(bbox.max.x),
+			 _mm256_set1_ps(bbox.max.y), _mm256_set1_ps(bbox.max.z),
+			 frustum, out_mask, cross_mask);
+	return (visibility_from_masks(out_mask, cross_mask, 0));
+}
+
+static bool cpu_has_avx2()
+{
+	__builtin_cpu_init();
+	return (__builtin_cpu_supports("avx2"));
 }
 
+static const bool use_avx2 = cpu_has_avx2();
+#endif
+
+void visibility(const AabbArrays &boxes, size_t count,
+		const Frustum &frustum, uint8_t *vis)
+{
+	size_t i = 0;
+#ifdef VISIBILITY_AVX2
+	if (use_avx2) {
+		for (; i + 8 <= count; i += 8) {
+			visibility_avx2(boxes, i, frustum, vis);
+		}
+		/* The last boxes go through the same kernel, from a padded
+		 * copy */
+		if (i < count) {
+			float bounds[6][8] = {};
+			size_t n = count - i;
+			memcpy(bounds[0], boxes.min_x + i, n * sizeof(float));
+			memcpy(bounds[1], boxes.min_y + i, n * sizeof(float));
+			memcpy(bounds[2], boxes.min_z + i, n * sizeof(float));
+			memcpy(bounds[3], boxes.max_x + i, n * sizeof(float));
+			memcpy(bounds[4], boxes.max_y + i, n * sizeof(float));
+			memcpy(bounds[5], boxes.max_z + i, n * sizeof(float));
+			AabbArrays tail = {bounds[0], bounds[1], bounds[2],
+					   bounds[3], bounds[4], bounds[5]};
+			uint8_t tail_vis[8];
+			visibility_avx2(tail, 0, frustum, tail_vis);
+			memcpy(vis + i, tail_vis, n);
+		}
+		return;
+	}
+#endif
+	visibility_scalar(boxes, i, count - i, frustum, vis);
+}
+
+enum Visibility visibility(const Aabb &bbox, const Frustum &frustum)
+{
+#ifdef VISIBILITY_AVX2
+	if (use_avx2)
+		return ((enum Visibility)visibility_avx2(bbox, frustum));
+#endif
+	AabbArrays box = {&bbox.min.x, &bbox.min.y, &bbox.min.z,
+			  &bbox.max.x, &bbox.max.y, &bbox.max.z};
+	uint8_t vis;
+	visibility(box, 1, frustum, &vis);
+	return ((enum Visibility)vis);
+}
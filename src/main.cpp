@@ -17,12 +17,14 @@
 #include "aabb.h"
 #include "chrono.h"
 #include "mesh_grid.h"
+#include "mesh_grid_io.h"
 #include "mesh_io.h"
 #include "mesh_optimize.h"
 #include "mesh_stats.h"
 #include "mesh_utils.h"
 #include "myosotis.h"
 #include "shaders.h"
+#include "thread_pool.h"
 #include "transform.h"
 #include "version.h"
 #include "viewer.h"
@@ -32,31 +34,164 @@
 
 void syntax(char *argv[])
 {
-	printf("Syntax : %s mesh_file_name [max_level]\n", argv[0]);
+	printf("Syntax : %s [-d] [-a cell_budget] [-m mem_budget_mb] "
+	       "[-p patch_file] [-t num_threads] [-o grid_file.myo] "
+	       "mesh_file_name [max_level] [err_tol] [optimize]\n",
+	       argv[0]);
+	printf("         %s [-t num_threads] [-v] grid_file.myo\n", argv[0]);
+}
+
+/**
+ * Replace the level 0 cells overlapped by the bounds of the mesh in
+ * patch_file with its triangles, which must be all the triangles of the
+ * edited mesh in these cells, and rebuild the grid above them.
+ */
+static int apply_patch(MeshGrid &mg, const char *patch_file, ThreadPool &pool)
+{
+	MBuf patch;
+	Mesh patch_mesh;
+	size_t len = strlen(patch_file);
+	const char *ext = patch_file + (len - MIN(len, (size_t)3));
+	int res;
+	if (strncmp(ext, "obj", 3) == 0) {
+		res = load_obj(patch_file, patch, patch_mesh, pool);
+	} else if (strncmp(ext, "ply", 3) == 0) {
+		res = load_ply(patch_file, patch, patch_mesh, pool);
+	} else {
+		printf("Unsupported (yet) patch file type extension: %s\n",
+		       ext);
+		return (EXIT_FAILURE);
+	}
+	if (res || !patch_mesh.index_count) {
+		printf("Error reading patch file.\n");
+		return (EXIT_FAILURE);
+	}
+	if ((mg.data.vtx_attr & VtxAttr::NML) &&
+	    !(patch.vtx_attr & VtxAttr::NML)) {
+		compute_mesh_normals(patch_mesh, patch, pool);
+	}
+
+	Aabb region = compute_mesh_bounds(patch_mesh, patch);
+	res = mg.update_region(patch, patch_mesh, region, pool);
+	patch.clear();
+	if (res == EXIT_SUCCESS) {
+		/* Replaced data is not worth saving */
+		mg.compact_data();
+	}
+
+	return (res);
 }
 
 int main(int argc, char **argv)
 {
+	const char *grid_file_name = NULL;
+	int num_threads = default_thread_count();
+	bool deterministic = false;
+	uint32_t cell_budget = 0;
+	size_t mem_budget = 0;
+	const char *patch_file = NULL;
+	bool verify = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "a:dm:o:p:t:v")) != -1) {
+		switch (opt) {
+		case 'a':
+			/* Adaptive subdivision, max index count per leaf */
+			cell_budget = atoi(optarg);
+			break;
+		case 'd':
+			/* Same grid layout whatever the number of threads */
+			deterministic = true;
+			break;
+		case 'm':
+			/* Out of core build, within about this many MB once
+			 * the input is binned */
+			mem_budget = (size_t)atoi(optarg) << 20;
+			break;
+		case 'o':
+			grid_file_name = optarg;
+			break;
+		case 'p':
+			/* Edited part of the mesh, applied once built */
+			patch_file = optarg;
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'v':
+			/* Check the streams of a mapped grid, not only cells */
+			verify = true;
+			break;
+		default:
+			syntax(argv);
+			return (EXIT_FAILURE);
+		}
+	}
+	/* Shift positional arguments so that argv[1] is the mesh file */
+	argv[optind - 1] = argv[0];
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	if (argc <= 1) {
 		syntax(argv);
 		return (EXIT_FAILURE);
 	}
+	if (mem_budget && !grid_file_name) {
+		printf("Out of core builds need an output grid file (-o).\n");
+		return (EXIT_FAILURE);
+	}
+
+	ThreadPool pool(num_threads);
+	printf("Using %d threads\n", pool.size());
+
+	MeshGrid *mg_ptr;
+	MeshGridFile mg_file;
+	Vec3 model_center;
+	float model_size;
+	size_t len = strlen(argv[1]);
+	const char *ext = argv[1] + (len - 3);
+	if (patch_file && (mem_budget || strncmp(ext, "myo", 3) == 0)) {
+		printf("Patches only apply to grids built in memory.\n");
+		return (EXIT_FAILURE);
+	}
 
-	/* Load and process mesh to build mesh_grid */
-	timer_start();
+	if (strncmp(ext, "myo", 3) == 0) {
+		/* Map a previously built mesh grid */
+		timer_start();
+		if (open_mesh_grid_file(argv[1], mg_file, verify)) {
+			printf("Error reading mesh grid file.\n");
+			return (EXIT_FAILURE);
+		}
+		mg_ptr = new MeshGrid(mg_file);
+		Aabb bbox = mg_ptr->get_bounds();
+		model_center = (bbox.min + bbox.max) * 0.5f;
+		model_size = max(bbox.max - bbox.min);
+		timer_stop("mapping mesh grid");
+	} else {
+		/* Load and process mesh to build mesh_grid */
+		timer_start();
 
-	MBuf data;
-	Mesh mesh;
-	{
-		size_t len = strlen(argv[1]);
-		const char *ext = argv[1] + (len - 3);
+		MBuf data;
+		Mesh mesh;
+		PlyStream stream;
+		bool optimize = (argc > 4 && *argv[4] == '1');
+		bool streaming = false;
 		if (strncmp(ext, "obj", 3) == 0) {
-			if (load_obj(argv[1], data, mesh)) {
+			if (load_obj(argv[1], data, mesh, pool)) {
 				printf("Error reading Wavefront file.\n");
 				return (EXIT_FAILURE);
 			}
+		} else if (strncmp(ext, "ply", 3) == 0 && !optimize) {
+			/* Only vertices are read here, triangles are binned
+			 * into the grid, or its slabs, as they are parsed */
+			if (stream.open(argv[1], data, mesh)) {
+				printf("Error reading PLY file.\n");
+				return (EXIT_FAILURE);
+			}
+			/* Face count, until polygons are split */
+			mesh.index_count = 3 * stream.face_count;
+			streaming = true;
 		} else if (strncmp(ext, "ply", 3) == 0) {
-			if (load_ply(argv[1], data, mesh)) {
+			if (load_ply(argv[1], data, mesh, pool)) {
 				printf("Error reading PLY file.\n");
 				return (EXIT_FAILURE);
 			}
@@ -65,71 +200,137 @@ int main(int argc, char **argv)
 			       ext);
 			return (EXIT_FAILURE);
 		}
-	}
 
-	printf("Triangles : %d Vertices : %d\n", mesh.index_count / 3,
-	       mesh.vertex_count);
-	timer_stop("loading mesh");
+		printf("Triangles : %d Vertices : %d\n", mesh.index_count / 3,
+		       mesh.vertex_count);
+		timer_stop("loading mesh");
+
+		/* Input mesh stat and optimization */
+		if (optimize) {
+			timer_start();
+			meshopt_statistics("Raw", data, mesh);
+			timer_start();
+			meshopt_optimize(data, mesh);
+			timer_stop("optimize mesh");
+			meshopt_statistics("Optimized", data, mesh);
+		}
+
+		/* Computing mesh normals, once triangles are known */
+		if (!streaming && !(data.vtx_attr & VtxAttr::NML)) {
+			timer_start();
+			printf("Computing normals.\n");
+			compute_mesh_normals(mesh, data, pool);
+			timer_stop("compute_mesh_normals");
+		}
 
-	/* Input mesh stat and optimization */
-	if (argc > 4 && *argv[4] == '1') {
+		/* Computing mesh bounds */
 		timer_start();
-		meshopt_statistics("Raw", data, mesh);
+		Aabb bbox = compute_mesh_bounds(mesh, data);
+		model_center = (bbox.min + bbox.max) * 0.5f;
+		Vec3 model_extent = (bbox.max - bbox.min);
+		model_size = max(model_extent);
+		printf("Model size : %f\n", model_size);
+		timer_stop("compute_mesh_bounds");
+
+		/* Building mesh_grid */
 		timer_start();
-		meshopt_optimize(data, mesh);
-		timer_stop("optimize mesh");
-		meshopt_statistics("Optimized", data, mesh);
-	}
+		int max_level;
+		if (argc > 2) {
+			max_level = atoi(argv[2]);
+		} else {
+			max_level = 0;
+			while ((1ul << (2 * max_level + 2)) *
+				   TARGET_CELL_IDX_COUNT <
+			       mesh.index_count) {
+				max_level += 1;
+				if (max_level == 15)
+					break;
+			}
+			/* Dense regions may be split further than the mean
+			 * when subdividing adaptively */
+			if (cell_budget) {
+				max_level = MIN(max_level + 2, 15);
+			}
+			printf("Maximum octree level unspecified. Using %d "
+			       "based on mesh index count.\n",
+			       max_level);
+		}
+		float err_tol;
+		if (argc > 3) {
+			err_tol = atof(argv[3]);
+		} else {
+			err_tol = ERR_TOL;
+		}
+		float step = model_size / (1 << max_level);
+		Vec3 base = bbox.min;
+		mg_ptr = new MeshGrid(base, step, max_level, err_tol);
+		mg_ptr->cell_budget = cell_budget;
+		if (mem_budget) {
+			/* The grid goes straight to the file, then gets
+			 * mapped as a previously built one */
+			int res = mg_ptr->build_out_of_core(
+			    data, mesh, pool, mem_budget, grid_file_name,
+			    streaming ? &stream : NULL);
+			stream.close();
+			if (res)
+				return (EXIT_FAILURE);
+			timer_stop("split_mesh_with_grid");
+			delete mg_ptr;
+			if (open_mesh_grid_file(grid_file_name, mg_file)) {
+				printf("Error reading mesh grid file.\n");
+				return (EXIT_FAILURE);
+			}
+			mg_ptr = new MeshGrid(mg_file);
+		} else if (streaming) {
+			int res = mg_ptr->build_from_stream(
+			    stream, data, mesh, pool, deterministic);
+			stream.close();
+			if (res)
+				return (EXIT_FAILURE);
+			timer_stop("split_mesh_with_grid");
+		} else {
+			mg_ptr->build_from_mesh(data, mesh, pool,
+						deterministic);
+			timer_stop("split_mesh_with_grid");
+		}
 
-	/* Computing mesh normals */
-	if (!(data.vtx_attr & VtxAttr::NML)) {
-		timer_start();
-		printf("Computing normals.\n");
-		compute_mesh_normals(mesh, data);
-		timer_stop("compute_mesh_normals");
-	}
+		/* Dispose original mesh */
+		data.clear();
 
-	/* Computing mesh bounds */
-	timer_start();
-	Aabb bbox = compute_mesh_bounds(mesh, data);
-	Vec3 model_center = (bbox.min + bbox.max) * 0.5f;
-	Vec3 model_extent = (bbox.max - bbox.min);
-	float model_size = max(model_extent);
-	printf("Model size : %f\n", model_size);
-	timer_stop("compute_mesh_bounds");
-
-	/* Building mesh_grid */
-	timer_start();
-	int max_level;
-	if (argc > 2) {
-		max_level = atoi(argv[2]);
-	} else {
-		max_level = 0;
-		while ((1ul << (2 * max_level + 2)) * TARGET_CELL_IDX_COUNT <
-		       mesh.index_count) {
-			max_level += 1;
-			if (max_level == 15)
-				break;
+		if (patch_file) {
+			timer_start();
+			if (apply_patch(*mg_ptr, patch_file, pool)) {
+				return (EXIT_FAILURE);
+			}
+			timer_stop("apply patch");
+		}
+
+		/* Save mesh grid for later runs */
+		if (grid_file_name && !mem_budget) {
+			timer_start();
+			if (save_mesh_grid(grid_file_name, *mg_ptr)) {
+				return (EXIT_FAILURE);
+			}
+			timer_stop("saving mesh grid");
 		}
-		printf(
-		    "Maximum octree level unspecified. Using %d based on mesh "
-		    "index count.\n",
-		    max_level);
-	}
-	float err_tol;
-	if (argc > 3) {
-		err_tol = atof(argv[3]);
-	} else {
-		err_tol = ERR_TOL;
 	}
-	float step = model_size / (1 << max_level);
-	Vec3 base = bbox.min;
-	MeshGrid mg(base, step, max_level, err_tol);
-	mg.build_from_mesh(data, mesh, 8);
-	timer_stop("split_mesh_with_grid");
 
-	/* Dispose original mesh */
-	data.clear();
+	MeshGrid &mg = *mg_ptr;
+	int max_level = mg.levels - 1;
+
+	/* Streams to upload, either from the built grid or from the mapping */
+	size_t idx_num = mg.next_index_offset;
+	size_t vtx_num = mg.next_vertex_offset;
+	const void *gpu_indices = mg.data.indices;
+	const void *gpu_positions = mg.data.positions;
+	const void *gpu_normals = mg.data.normals;
+	const void *gpu_remap = mg.data.remap;
+	if (mg_file.header) {
+		gpu_indices = mg_file.section(MGS_INDICES);
+		gpu_positions = mg_file.section(MGS_POSITIONS);
+		gpu_normals = mg_file.section(MGS_NORMALS);
+		gpu_remap = mg_file.section(MGS_REMAP);
+	}
 
 	/* Main window and context */
 	Myosotis app;
@@ -154,10 +355,9 @@ int main(int argc, char **argv)
 	glGenBuffers(1, &mg_idx);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mg_idx);
 	printf("Allocating %zuMb for indices\n",
-	       mg.data.idx_capacity * sizeof(uint32_t) / (1 << 20));
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-		     mg.data.idx_capacity * sizeof(uint32_t), mg.data.indices,
-		     GL_STATIC_DRAW);
+	       idx_num * sizeof(uint32_t) / (1 << 20));
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, idx_num * sizeof(uint32_t),
+		     gpu_indices, GL_STATIC_DRAW);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
 	/* Mesh grid Position buffer */
@@ -165,9 +365,9 @@ int main(int argc, char **argv)
 	glGenBuffers(1, &mg_pos);
 	glBindBuffer(GL_ARRAY_BUFFER, mg_pos);
 	printf("Allocating %zuMb for positions\n",
-	       mg.data.vtx_capacity * sizeof(Vec3) / (1 << 20));
-	glBufferData(GL_ARRAY_BUFFER, mg.data.vtx_capacity * sizeof(Vec3),
-		     mg.data.positions, GL_STATIC_DRAW);
+	       vtx_num * sizeof(Vec3) / (1 << 20));
+	glBufferData(GL_ARRAY_BUFFER, vtx_num * sizeof(Vec3), gpu_positions,
+		     GL_STATIC_DRAW);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 	/* Mesh grid Normal buffer */
@@ -175,9 +375,9 @@ int main(int argc, char **argv)
 	glGenBuffers(1, &mg_nml);
 	glBindBuffer(GL_ARRAY_BUFFER, mg_nml);
 	printf("Allocating %zuMb for normals\n",
-	       mg.data.vtx_capacity * sizeof(Vec3) / (1 << 20));
-	glBufferData(GL_ARRAY_BUFFER, mg.data.vtx_capacity * sizeof(Vec3),
-		     mg.data.normals, GL_STATIC_DRAW);
+	       vtx_num * sizeof(Vec3) / (1 << 20));
+	glBufferData(GL_ARRAY_BUFFER, vtx_num * sizeof(Vec3), gpu_normals,
+		     GL_STATIC_DRAW);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 	/* Mesh grid Vertex Parent Idx buffer */
@@ -185,10 +385,9 @@ int main(int argc, char **argv)
 	glGenBuffers(1, &mg_par);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mg_par);
 	printf("Allocating %zuMb for parent index\n",
-	       mg.data.vtx_capacity * sizeof(uint32_t) / (1 << 20));
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-		     mg.data.vtx_capacity * sizeof(uint32_t), mg.data.remap,
-		     GL_STATIC_DRAW);
+	       vtx_num * sizeof(uint32_t) / (1 << 20));
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, vtx_num * sizeof(uint32_t),
+		     gpu_remap, GL_STATIC_DRAW);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
 	/* Setup VAOs */
@@ -258,8 +457,7 @@ int main(int argc, char **argv)
 
 	/* Rendering loop */
 	printf("Starting rendering loop\n");
-	TArray<uint32_t> to_draw;
-	TArray<uint32_t> parents;
+	SelectionContext sel;
 	while (!app.should_close()) {
 		app.new_frame();
 
@@ -298,17 +496,25 @@ int main(int argc, char **argv)
 				Mat4 proj_vm =
 				    app.viewer.camera.world_to_clip();
 				float *pvm = &proj_vm(0, 0);
-				to_draw.clear();
-				parents.clear();
-
 				// timer_start();
-				mg.select_cells_from_view_point(
-				    vp, error_multiplier,
-				    app.cfg.continuous_lod,
-				    app.cfg.frustum_cull, pvm, to_draw,
-				    parents);
+				if (app.cfg.budget_lod) {
+					mg.select_cells_with_budget(
+					    vp, app.cfg.tri_budget, 0,
+					    app.cfg.frustum_cull, pvm, sel);
+				} else if (app.cfg.incremental_lod) {
+					mg.update_cells_from_view_point(
+					    vp, error_multiplier,
+					    app.cfg.continuous_lod,
+					    app.cfg.frustum_cull, pvm, sel);
+				} else {
+					mg.select_cells_from_view_point(
+					    vp, error_multiplier,
+					    app.cfg.continuous_lod,
+					    app.cfg.frustum_cull, pvm, sel,
+					    pool);
+				}
 				// timer_stop("Selection");
-				app.stat.drawn_cells = to_draw.size;
+				app.stat.drawn_cells = sel.to_draw.size;
 			}
 
 			glUseProgram(mesh_prg);
@@ -328,10 +534,11 @@ int main(int argc, char **argv)
 
 			app.stat.drawn_tris = 0;
 
-			for (int i = to_draw.size - 1; i >= 0; --i) {
-				Mesh &mesh = mg.cells[to_draw[i]];
-				Mesh &pmesh = mg.cells[parents[i]];
-				CellCoord coord = mg.cell_coords[to_draw[i]];
+			for (int i = sel.to_draw.size - 1; i >= 0; --i) {
+				uint32_t cell = sel.to_draw[i];
+				Mesh &mesh = mg.cells[cell];
+				Mesh &pmesh = mg.cells[sel.parents[i]];
+				CellCoord coord = mg.cell_coords[cell];
 				glUniform1i(9, coord.lod);
 				glUniform1i(10, coord.x);
 				glUniform1i(11, coord.y);
@@ -384,8 +591,13 @@ int main(int argc, char **argv)
 		glfwSwapBuffers(app.window);
 	}
 
+	printf("Selection high water marks : %zu visited, %zu drawn cells\n",
+	       sel.max_visited, sel.max_drawn);
+
 	/* Cleaning */
 	app.clean();
+	delete mg_ptr;
+	close_mesh_grid_file(mg_file);
 
 	return (EXIT_SUCCESS);
 }
@@ -5,19 +5,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "arena.h"
 #include "sys_utils.h"
 #include "vec2.h"
 #include "vec3.h"
 
+/* REALLOC_NUM and MEMFREE counterparts going through the MBuf arena */
+#define MBUF_REALLOC_NUM(ptr, old_num, num) do {\
+	ptr = VOIDSTARCAST(ptr)arena_realloc(arena, ptr,\
+		(old_num) * sizeof (*ptr), (num) * sizeof (*ptr));\
+	if (UNLIKELY(num != 0 && ptr == NULL)) abort();\
+	} while(0)
+
+#define MBUF_MEMFREE(ptr) do {arena_free(arena, ptr); ptr = NULL;} while (0)
+
 void MBuf::clear()
 {
-	MEMFREE(indices);
+	MBUF_MEMFREE(indices);
 	idx_capacity = 0;
-	MEMFREE(positions);
-	MEMFREE(normals);
-	MEMFREE(uv[0]);
-	MEMFREE(uv[1]);
-	MEMFREE(remap);
+	MBUF_MEMFREE(positions);
+	MBUF_MEMFREE(normals);
+	MBUF_MEMFREE(uv[0]);
+	MBUF_MEMFREE(uv[1]);
+	MBUF_MEMFREE(remap);
 	vtx_capacity = 0;
 }
 
@@ -31,7 +41,7 @@ void MBuf::reserve_indices(size_t num, bool shrink)
 
 	// printf("Reserving %zu indices\n", num);
 
-	REALLOC_NUM(indices, num);
+	MBUF_REALLOC_NUM(indices, idx_capacity, num);
 	idx_capacity = num;
 }
 
@@ -46,23 +56,23 @@ void MBuf::reserve_vertices(size_t num, bool shrink)
 	// printf("Reserving %zu vertices\n", num);
 
 	if (true) {
-		REALLOC_NUM(positions, num);
+		MBUF_REALLOC_NUM(positions, vtx_capacity, num);
 	}
 
 	if (vtx_attr & VtxAttr::NML) {
-		REALLOC_NUM(normals, num);
+		MBUF_REALLOC_NUM(normals, vtx_capacity, num);
 	}
 
 	if (vtx_attr & VtxAttr::UV0) {
-		REALLOC_NUM(uv[0], num);
+		MBUF_REALLOC_NUM(uv[0], vtx_capacity, num);
 	}
 
 	if (vtx_attr & VtxAttr::UV1) {
-		REALLOC_NUM(uv[1], num);
+		MBUF_REALLOC_NUM(uv[1], vtx_capacity, num);
 	}
 
 	if (vtx_attr & VtxAttr::MAP) {
-		REALLOC_NUM(remap, num);
+		MBUF_REALLOC_NUM(remap, vtx_capacity, num);
 	}
 
 	vtx_capacity = num;
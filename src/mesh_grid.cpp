@@ -1,21 +1,32 @@
 #include "mesh_grid.h"
 
 #include <assert.h>
+#include <math.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <atomic>
+
+#include "arena.h"
 #include "camera.h"
 #include "chrono.h"
+#include "group_hash_table.h"
 #include "hash_table.h"
 #include "math_utils.h"
 #include "mesh.h"
+#include "mesh_grid_io.h"
+#include "mesh_io.h"
 #include "mesh_utils.h"
 #include "meshoptimizer/src/meshoptimizer_mod.h"
+#include "radix_sort.h"
+#include "thread_pool.h"
 #include "vec3.h"
+#include "vertex_table.h"
 
 static inline void point_to_cell_coord(CellCoord &coord, const Vec3 &p,
 				       const Vec3 &base, float inv_step)
@@ -53,33 +64,137 @@ CellCoord child_coord(const CellCoord coord, uint32_t i)
 	return ccoord;
 }
 
+/* Index of a cell among the children of its parent, as in child_coord */
+static inline uint32_t child_octant(CellCoord coord)
+{
+	return (coord.x & 1) | ((coord.y & 1) << 1) | ((coord.z & 1) << 2);
+}
+
+/* Binary search of a cell among coords[first, first + count), which are
+ * cells of one level in Morton order. Returns ~0u if there is none. */
+static uint32_t search_cell(const CellCoord *coords, uint32_t first,
+			    uint32_t count, CellCoord coord)
+{
+	uint64_t key = cell_morton_key(coord);
+	uint32_t lo = first;
+	uint32_t hi = first + count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (cell_morton_key(coords[mid]) < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo < first + count && coords[lo] == coord)
+		return lo;
+
+	return ~0u;
+}
+
+uint32_t MeshGrid::find_cell(CellCoord coord)
+{
+	if (coord.lod < 0 || (uint32_t)coord.lod >= levels)
+		return ~0u;
+
+	return search_cell(cell_coords.data, cell_offsets[coord.lod],
+			   cell_counts[coord.lod], coord);
+}
+
 Mesh *MeshGrid::get_cell(CellCoord ccoord)
 {
-	uint32_t *p = cell_table.get(ccoord);
-	return p ? &cells[*p] : NULL;
+	uint32_t idx = find_cell(ccoord);
+	return (idx != ~0u) ? &cells[idx] : NULL;
 }
 
 unsigned MeshGrid::get_children(CellCoord pcoord, Mesh *children[8])
 {
-	unsigned child_count = 0;
+	uint32_t idx = find_cell(pcoord);
+	if (idx == ~0u)
+		return 0;
 
-	for (int i = 0; i < 8; ++i) {
-		CellCoord ccoord = child_coord(pcoord, i);
-		uint32_t *p = cell_table.get(ccoord);
-		if (p) {
-			children[child_count] = &cells[*p];
-			child_count++;
-		}
+	unsigned child_count = get_child_count(idx);
+	for (unsigned i = 0; i < child_count; ++i) {
+		children[i] = &cells[cell_first_child[idx] + i];
 	}
 
 	return child_count;
 }
 
+/**
+ * Cells being in Morton order within a level, the children of a cell are
+ * contiguous in the level below, in the order of their parents. Hence the
+ * index is built by walking each level alongside the level below.
+ */
+void MeshGrid::init_cell_index()
+{
+	cell_first_child.resize(cells.size);
+	cell_child_mask.resize(cells.size);
+
+	for (uint32_t i = 0; i < cell_counts[0]; ++i) {
+		cell_first_child[cell_offsets[0] + i] = 0;
+		cell_child_mask[cell_offsets[0] + i] = 0;
+	}
+
+	for (uint32_t level = 1; level < levels; ++level) {
+		uint32_t c = cell_offsets[level - 1];
+		uint32_t c_end = c + cell_counts[level - 1];
+		for (uint32_t i = 0; i < cell_counts[level]; ++i) {
+			uint32_t p = cell_offsets[level] + i;
+			uint8_t mask = 0;
+			cell_first_child[p] = c;
+			while (c < c_end &&
+			       parent_coord(cell_coords[c]) == cell_coords[p]) {
+				mask |= 1 << child_octant(cell_coords[c]);
+				c++;
+			}
+			/* No mask for leaf cells of adaptive grids */
+			assert(mask || cell_budget);
+			cell_child_mask[p] = mask;
+		}
+		assert(c == c_end);
+	}
+}
+
 MeshGrid::MeshGrid(Vec3 base, float step, uint32_t max_level, float err_tol)
     : base{base}, step{step}, levels{max_level + 1}, err_tol{err_tol},
-      cell_offsets(levels), cell_counts(levels),
-      cell_table(1 << (2 * levels + 4))
+      cell_offsets(levels), cell_counts(levels)
+{
+}
+
+/* Cell arrays are copied (they are small), while the MBuf streams are
+ * left in the mapping : data stays empty and the viewer uploads index
+ * and vertex streams straight from the file sections. */
+MeshGrid::MeshGrid(const MeshGridFile &file)
+    : MeshGrid(Vec3(file.header->base[0], file.header->base[1],
+		    file.header->base[2]),
+	       file.header->step, file.header->levels - 1,
+	       file.header->err_tol)
 {
+	const MeshGridFileHeader *h = file.header;
+	uint32_t cell_count = h->cell_count;
+
+	mean_relative_error = h->mean_relative_error;
+	cell_budget = h->cell_budget;
+	data.vtx_attr = h->vtx_attr;
+	next_index_offset = h->index_count;
+	next_vertex_offset = h->vertex_count;
+
+	cell_coords.resize(cell_count);
+	cells.resize(cell_count);
+	cell_errors.resize(cell_count);
+	memcpy(cell_coords.data, file.section(MGS_CELL_COORDS),
+	       file.section_size(MGS_CELL_COORDS));
+	memcpy(cells.data, file.section(MGS_CELLS),
+	       file.section_size(MGS_CELLS));
+	memcpy(cell_errors.data, file.section(MGS_CELL_ERRORS),
+	       file.section_size(MGS_CELL_ERRORS));
+	memcpy(cell_offsets.data, file.section(MGS_CELL_OFFSETS),
+	       file.section_size(MGS_CELL_OFFSETS));
+	memcpy(cell_counts.data, file.section(MGS_CELL_COUNTS),
+	       file.section_size(MGS_CELL_COUNTS));
+
+	init_cell_index();
 }
 
 uint32_t MeshGrid::get_triangle_count(uint32_t level)
@@ -110,6 +225,30 @@ uint32_t MeshGrid::get_vertex_count(uint32_t level)
 	return (count);
 }
 
+/* Bounds of the leaf cells */
+Aabb MeshGrid::get_bounds()
+{
+	Aabb bbox = {base, base};
+	bool first = true;
+
+	for (uint32_t i = 0; i < cells.size; i++) {
+		if (cell_child_mask[i])
+			continue;
+		CellCoord coord = cell_coords[i];
+		float extent = step * (1 << coord.lod);
+		Vec3 cmin = base + extent * Vec3(coord.x, coord.y, coord.z);
+		Vec3 cmax = cmin + Vec3(extent, extent, extent);
+		if (first) {
+			bbox = {cmin, cmax};
+			first = false;
+		} else {
+			bbox |= {cmin, cmax};
+		}
+	}
+
+	return bbox;
+}
+
 static CellCoord block_base_coord(const CellCoord coord)
 {
 	CellCoord base;
@@ -120,140 +259,532 @@ static CellCoord block_base_coord(const CellCoord coord)
 	return base;
 }
 
+/* Blocks producing the child cells of a block are its dependencies. A
+ * block at level L produces cells with coordinates in {2m - 1, 2m} along
+ * each axis, whose parents lie in at most two blocks per axis : a block
+ * has at most 8 dependents. */
+struct BlockDeps {
+	uint32_t count;
+	uint32_t idx[8];
+};
+
+/* Parent cells of a block, ~0u where the cell does not exist */
+struct BlockCells {
+	uint32_t idx[8];
+};
+
 struct MeshGridBuilder {
 	MeshGrid &mg;
-	int num_threads;
-	TArray<CellCoord> todo_blocks;
-	int next_index = 0;
-	pthread_mutex_t block_mutex;
-	MeshGridBuilder(MeshGrid &mg, int num_thread);
+	ThreadPool &pool;
+	/* Blocks of all levels, the scheduling graph and the ready queue */
+	TArray<CellCoord> blocks;
+	TArray<BlockCells> block_cells;
+	TArray<BlockDeps> dependents;
+	/* Block of every cell above level 0 */
+	TArray<uint32_t> cell_blocks;
+	/* Only dirty blocks are built, the others are kept as they are */
+	TArray<uint8_t> dirty;
+	uint32_t dirty_count = 0;
+	std::atomic<uint32_t> *pending = nullptr;
+	std::atomic<uint32_t> *ready = nullptr;
+	std::atomic<uint32_t> ready_head{0};
+	std::atomic<uint32_t> ready_tail{0};
+	/* Append cursors in mg.data and its capacity as seen by blocks */
+	std::atomic<uint32_t> next_index_offset{0};
+	std::atomic<uint32_t> next_vertex_offset{0};
+	std::atomic<size_t> idx_capacity{0};
+	std::atomic<size_t> vtx_capacity{0};
+	/* Threads accessing mg.data flag themselves in their own cache line,
+	 * a grow waits for all of them to leave. Growing is rare, hence the
+	 * common path never touches a shared lock. */
+	struct alignas(64) DataReader {
+		std::atomic<bool> active;
+	};
+	DataReader *readers = nullptr;
+	std::atomic<bool> growing{false};
+	pthread_mutex_t grow_mutex;
+	/* Per thread scratch memory for block temporaries, reset per block */
+	Arena *arenas = nullptr;
+	/* Room to pre allocate for upper levels, level 0 size if zero */
+	uint32_t alloc_idx = 0;
+	uint32_t alloc_vtx = 0;
+	/* End of level 0 data, upper levels are appended past it */
+	uint32_t level0_idx_end = 0;
+	uint32_t level0_vtx_end = 0;
+	/* Scratch buffer and per cell offsets for relayout() */
+	MBuf relayout_buf;
+	TArray<Mesh> relayout_cells;
+	MeshGridBuilder(MeshGrid &mg, ThreadPool &pool);
 	~MeshGridBuilder();
-	void build_level(int level);
+	void init_cells_and_blocks();
+	void mark_dirty_blocks(const CellBox *dirty_boxes);
+	void link_blocks();
+	void build();
+	void relayout();
 	void build_parent_cell(CellCoord pcoord);
-	void build_block(CellCoord bcoord);
-	bool build_next_block(void);
+	template <uint32_t vtx_attr>
+	void build_block(uint32_t block_idx, int thread_id);
+	void push_ready(uint32_t block_idx);
+	void enter_data(int thread_id);
+	void leave_data(int thread_id);
+	void reserve_data(uint32_t idx_num, uint32_t vtx_num,
+			  uint32_t &idx_off, uint32_t &vtx_off);
 };
 
-MeshGridBuilder::MeshGridBuilder(MeshGrid &mg, int num_threads)
-    : mg{mg}, num_threads{num_threads}
+MeshGridBuilder::MeshGridBuilder(MeshGrid &mg, ThreadPool &pool)
+    : mg{mg}, pool{pool}
 {
-	pthread_mutex_init(&block_mutex, NULL);
+	pthread_mutex_init(&grow_mutex, NULL);
+
+	readers = new DataReader[pool.size()];
+	for (int t = 0; t < pool.size(); ++t) {
+		readers[t].active.store(false, std::memory_order_relaxed);
+	}
+	arenas = new Arena[pool.size()];
 }
 
-MeshGridBuilder::~MeshGridBuilder() { pthread_mutex_destroy(&block_mutex); }
+MeshGridBuilder::~MeshGridBuilder()
+{
+	delete[] pending;
+	delete[] ready;
+	delete[] readers;
+	delete[] arenas;
+	pthread_mutex_destroy(&grow_mutex);
+}
 
-void *build_blocks(void *args)
+static void push_cell(MeshGrid &mg, CellCoord coord, const Mesh &cell)
 {
-	struct MeshGridBuilder *builder = (struct MeshGridBuilder *)args;
+	mg.cells.push_back(cell);
+	mg.cell_coords.push_back(coord);
+	mg.cell_errors.push_back(0.f);
+	mg.cell_counts[coord.lod]++;
+}
 
-	while (builder->build_next_block()) {
+/**
+ * The whole octree topology follows from the leaves : a cell exists at
+ * level L iff it is a leaf or the parent of a cell at level L - 1. Hence
+ * every cell can be given its final slot (cells stay contiguous per level)
+ * and every block can be discovered, with its dependencies, before anything
+ * is built.
+ */
+
+void MeshGridBuilder::init_cells_and_blocks()
+{
+	/* Leaf cells above level 0 (adaptive grids) follow level 0 cells,
+	 * by level then in Morton order. Take them out, to merge them in
+	 * their level. */
+	uint32_t leaf_first = mg.cell_offsets[0] + mg.cell_counts[0];
+	uint32_t leaf_count = mg.cells.size - leaf_first;
+	TArray<CellCoord> leaf_coords(leaf_count);
+	TArray<Mesh> leaf_cells(leaf_count);
+	memcpy(leaf_coords.data, &mg.cell_coords.data[leaf_first],
+	       leaf_count * sizeof(CellCoord));
+	memcpy(leaf_cells.data, &mg.cells.data[leaf_first],
+	       leaf_count * sizeof(Mesh));
+	mg.cells.resize(leaf_first);
+	mg.cell_coords.resize(leaf_first);
+	mg.cell_errors.resize(leaf_first);
+
+	/* Parents of sorted cells come in sorted order, duplicates being
+	 * consecutive. A level holds either parents of the level below or
+	 * leaves, never both for one cell. */
+	uint32_t l = 0;
+	for (uint32_t level = 1; level < mg.levels; ++level) {
+		mg.cell_offsets[level] = mg.cells.size;
+		mg.cell_counts[level] = 0;
+
+		uint32_t child_offset = mg.cell_offsets[level - 1];
+		uint32_t child_count = mg.cell_counts[level - 1];
+		CellCoord last_pcoord = CellCoordHasher::empty_key;
+		for (uint32_t i = 0; i < child_count; ++i) {
+			CellCoord pcoord =
+			    parent_coord(mg.cell_coords[child_offset + i]);
+			if (pcoord == last_pcoord)
+				continue;
+			last_pcoord = pcoord;
+			uint64_t key = cell_morton_key(pcoord);
+			while (l < leaf_count &&
+			       leaf_coords[l].lod == (int16_t)level &&
+			       cell_morton_key(leaf_coords[l]) < key) {
+				push_cell(mg, leaf_coords[l], leaf_cells[l]);
+				l++;
+			}
+			push_cell(mg, pcoord, Mesh{0, 0, 0, 0});
+		}
+		while (l < leaf_count && leaf_coords[l].lod == (int16_t)level) {
+			push_cell(mg, leaf_coords[l], leaf_cells[l]);
+			l++;
+		}
 	}
-	return NULL;
+	assert(l == leaf_count);
+	mg.init_cell_index();
+
+	if (mg.levels < 2)
+		return;
+
+	/* Group parent cells into blocks */
+	uint32_t first = mg.cell_offsets[1];
+	uint32_t count = mg.cells.size - first;
+	cell_blocks.resize(count);
+	CellTable block_table(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		/* Leaves are not built */
+		if (!mg.cell_child_mask[first + i]) {
+			cell_blocks[i] = ~0u;
+			continue;
+		}
+		CellCoord pcoord = mg.cell_coords[first + i];
+		CellCoord bcoord = block_base_coord(pcoord);
+		uint32_t *p = block_table.get(bcoord);
+		uint32_t b;
+		if (!p) {
+			b = blocks.size;
+			block_table.set_at(bcoord, b);
+			blocks.push_back(bcoord);
+			BlockCells bc;
+			memset(bc.idx, 0xFF, sizeof(bc.idx));
+			block_cells.push_back(bc);
+			dependents.push_back(BlockDeps{0, {0}});
+			dirty.push_back(1);
+		} else {
+			b = *p;
+		}
+		uint32_t octant = (pcoord.x - bcoord.x) |
+				  ((pcoord.y - bcoord.y) << 1) |
+				  ((pcoord.z - bcoord.z) << 2);
+		block_cells[b].idx[octant] = first + i;
+		cell_blocks[i] = b;
+	}
+	dirty_count = blocks.size;
 }
 
-bool MeshGridBuilder::build_next_block()
+/* Only keep dirty the blocks lying in the dirty box of their level */
+void MeshGridBuilder::mark_dirty_blocks(const CellBox *dirty_boxes)
 {
-	// MUTEX LOCK protection for next_index
-	pthread_mutex_lock(&block_mutex);
-	unsigned todo_index = next_index;
-	if (todo_index >= todo_blocks.size) {
-		pthread_mutex_unlock(&block_mutex);
-		return false;
+	dirty_count = 0;
+	for (uint32_t b = 0; b < blocks.size; ++b) {
+		dirty[b] = dirty_boxes[blocks[b].lod].contains(blocks[b]);
+		dirty_count += dirty[b];
 	}
-	next_index += 1;
-	pthread_mutex_unlock(&block_mutex);
-	// MUTEX UNLOCK protection for next_index
+}
 
-	build_block(todo_blocks[todo_index]);
+/* Link each dirty block to the dirty blocks producing its child cells.
+ * Links of a previous build, if any, are dropped. */
+void MeshGridBuilder::link_blocks()
+{
+	uint32_t first = (mg.levels > 1) ? mg.cell_offsets[1] : 0;
+
+	delete[] pending;
+	delete[] ready;
+	pending = new std::atomic<uint32_t>[blocks.size];
+	ready = new std::atomic<uint32_t>[blocks.size];
+	ready_head.store(0, std::memory_order_relaxed);
+	ready_tail.store(0, std::memory_order_relaxed);
+
+	for (uint32_t b = 0; b < blocks.size; ++b) {
+		pending[b].store(0, std::memory_order_relaxed);
+		ready[b].store(~0u, std::memory_order_relaxed);
+		dependents[b].count = 0;
+	}
+
+	for (uint32_t b = 0; b < blocks.size; ++b) {
+		if (!dirty[b])
+			continue;
+		uint32_t deps[64];
+		uint32_t dep_count = 0;
+		for (uint32_t i = 0; blocks[b].lod > 1 && i < 8; ++i) {
+			uint32_t pidx = block_cells[b].idx[i];
+			if (pidx == ~0u)
+				continue;
+			uint32_t c = mg.cell_first_child[pidx];
+			uint32_t c_end = c + mg.get_child_count(pidx);
+			for (; c < c_end; ++c) {
+				uint32_t d = cell_blocks[c - first];
+				if (d == ~0u || !dirty[d])
+					continue;
+				bool known = false;
+				for (uint32_t k = 0; k < dep_count; ++k) {
+					known |= (deps[k] == d);
+				}
+				if (!known) {
+					deps[dep_count++] = d;
+				}
+			}
+		}
+		pending[b].store(dep_count, std::memory_order_relaxed);
+		for (uint32_t k = 0; k < dep_count; ++k) {
+			BlockDeps &d = dependents[deps[k]];
+			assert(d.count < 8);
+			d.idx[d.count++] = b;
+		}
+	}
+}
 
-	return true;
+void MeshGridBuilder::push_ready(uint32_t block_idx)
+{
+	uint32_t slot = ready_tail.fetch_add(1, std::memory_order_relaxed);
+	ready[slot].store(block_idx, std::memory_order_release);
 }
 
-void MeshGridBuilder::build_level(int level)
+template <uint32_t vtx_attr>
+static void build_blocks_job(void *ctx, int thread_id)
 {
-	/* Base level is built elsewhere */
-	assert(level > 0);
+	MeshGridBuilder *builder = (MeshGridBuilder *)ctx;
+	uint32_t num_blocks = builder->dirty_count;
+
+	for (;;) {
+		/* Every block goes through the ready queue exactly once,
+		 * so claiming a slot is claiming a block. The slot may not
+		 * be published yet, in which case a running block will
+		 * eventually publish it. */
+		uint32_t slot = builder->ready_head.fetch_add(1);
+		if (slot >= num_blocks)
+			break;
+
+		uint32_t b;
+		while ((b = builder->ready[slot].load(
+			    std::memory_order_acquire)) == ~0u) {
+			sched_yield();
+		}
 
-	/* Pre allocate sufficently to avoid reallocation during of
-	 * these during fct call, this allows to avoid some costly
-	 * mutex lock.
-	 */
-	size_t max_cells = mg.cell_coords.size + mg.cell_counts[level - 1];
-	mg.cell_coords.reserve(max_cells);
-	mg.cells.reserve(max_cells);
-	mg.cell_errors.reserve(max_cells);
-	mg.cell_table.reserve(max_cells);
-
-	/* Initiate, cell_counts[level] will be incremented during process */
-	mg.cell_offsets[level] = mg.cells.size;
-	mg.cell_counts[level] = 0;
-
-	todo_blocks.reserve(mg.cell_counts[level - 1]);
-	CellTable recorded_blocks(mg.cell_counts[level - 1]);
-
-	/* Discover blocks and record them for later treatment */
-	todo_blocks.clear();
-	CellCoord *cell_coords = &mg.cell_coords[mg.cell_offsets[level - 1]];
-	int num_cells = mg.cell_counts[level - 1];
-	for (int i = 0; i < num_cells; ++i) {
-		CellCoord ccoord = cell_coords[i];
-		CellCoord pcoord = parent_coord(ccoord);
-		CellCoord bcoord = block_base_coord(pcoord);
-		if (!recorded_blocks.get(bcoord)) {
-			recorded_blocks.set_at(bcoord, todo_blocks.size);
-			todo_blocks.push_back(bcoord);
+		builder->build_block<vtx_attr>(b, thread_id);
+
+		/* Release dependents whose last dependency was this block */
+		const BlockDeps &deps = builder->dependents[b];
+		for (uint32_t k = 0; k < deps.count; ++k) {
+			uint32_t d = deps.idx[k];
+			if (builder->pending[d].fetch_sub(1) == 1) {
+				builder->push_ready(d);
+			}
 		}
 	}
+}
 
-	/* Pre allocate an upper bound on the number of new indices and
-	 * vertices in MBuf. This eases the parallel process of building
-	 * blocks by avoiding a lot of otherwise necessary mutex locks.
-	 */
-	uint32_t alloc_idx = mg.get_triangle_count(level - 1) * 3;
-	uint32_t alloc_vtx = mg.get_vertex_count(level - 1);
+void MeshGridBuilder::build()
+{
+	link_blocks();
+
+	/* Pre allocate as much as level 0 for all upper levels, this is
+	 * plenty in practice. Should it not be enough, reserve_data grows
+	 * the buffers once every reader has left them. */
+	if (!alloc_idx || !alloc_vtx) {
+		alloc_idx = mg.get_triangle_count(0) * 3;
+		alloc_vtx = mg.get_vertex_count(0);
+	}
 	mg.data.reserve_indices(mg.next_index_offset + alloc_idx);
 	mg.data.reserve_vertices(mg.next_vertex_offset + alloc_vtx);
+	idx_capacity.store(mg.data.idx_capacity);
+	vtx_capacity.store(mg.data.vtx_capacity);
+	next_index_offset.store(mg.next_index_offset);
+	next_vertex_offset.store(mg.next_vertex_offset);
+	level0_idx_end = mg.next_index_offset;
+	level0_vtx_end = mg.next_vertex_offset;
+
+	/* Simplifier scratch goes to the arena of the block being built */
+	meshopt_setAllocator(meshopt_arena_allocate, meshopt_arena_deallocate);
+
+	/* Blocks with no dirty child block are ready right away */
+	for (uint32_t b = 0; b < blocks.size; ++b) {
+		if (dirty[b] &&
+		    pending[b].load(std::memory_order_relaxed) == 0) {
+			push_ready(b);
+		}
+	}
+
+	/* Vertex attributes are dispatched once here, block builds handle
+	 * them at compile time */
+	switch (mg.data.vtx_attr) {
+	case VtxAttr::P | VtxAttr::MAP:
+		pool.run(build_blocks_job<VtxAttr::P | VtxAttr::MAP>, this);
+		break;
+	case VtxAttr::PN | VtxAttr::MAP:
+		pool.run(build_blocks_job<VtxAttr::PN | VtxAttr::MAP>, this);
+		break;
+	case VtxAttr::PT | VtxAttr::MAP:
+		pool.run(build_blocks_job<VtxAttr::PT | VtxAttr::MAP>, this);
+		break;
+	case VtxAttr::PNT | VtxAttr::MAP:
+		pool.run(build_blocks_job<VtxAttr::PNT | VtxAttr::MAP>, this);
+		break;
+	default:
+		fprintf(stderr, "Error: unsupported vertex attributes %u.\n",
+			mg.data.vtx_attr);
+		abort();
+	}
+
+	/* meshoptimizer calls outside block builds get its own allocator */
+	meshopt_setAllocator(::operator new, ::operator delete);
+
+	mg.next_index_offset = next_index_offset.load();
+	mg.next_vertex_offset = next_vertex_offset.load();
+}
+
+static void relayout_cell_task(void *ctx, uint32_t i, int thread_id)
+{
+	(void)thread_id;
+
+	MeshGridBuilder *builder = (MeshGridBuilder *)ctx;
+	MeshGrid &mg = builder->mg;
+	const Mesh &src = mg.cells[mg.cell_offsets[1] + i];
+	const Mesh &dst = builder->relayout_cells[i];
+
+	/* Leaves keep their level 0 data */
+	if (!mg.cell_child_mask[mg.cell_offsets[1] + i])
+		return;
 
-	/* Launch (and then join) threads to build separate blocks */
-	pthread_t thread[num_threads];
-	next_index = 0;
-	for (int i = 0; i < num_threads; ++i) {
-		pthread_create(&thread[i], NULL, build_blocks, (void *)this);
+	copy_indices(builder->relayout_buf, dst.index_offset, mg.data,
+		     src.index_offset, src.index_count);
+	copy_vertices(builder->relayout_buf, dst.vertex_offset, mg.data,
+		      src.vertex_offset, src.vertex_count);
+}
+
+/**
+ * Upper level cells are appended to mg.data in completion order, which
+ * depends on scheduling. Move them so that their data follows cell order,
+ * making the whole layout a function of the input mesh alone. Indices and
+ * remap entries are cell relative, hence cells are moved as is. Upper
+ * levels hold a fraction of level 0 data : this is a cheap, parallel copy.
+ */
+void MeshGridBuilder::relayout()
+{
+	if (mg.levels < 2)
+		return;
+
+	uint32_t first = mg.cell_offsets[1];
+	uint32_t count = mg.cells.size - first;
+	uint32_t idx_num = mg.next_index_offset - level0_idx_end;
+	uint32_t vtx_num = mg.next_vertex_offset - level0_vtx_end;
+	if (!count || !idx_num || !vtx_num)
+		return;
+
+	relayout_cells.resize(count);
+	uint32_t idx_off = 0;
+	uint32_t vtx_off = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		const Mesh &cell = mg.cells[first + i];
+		if (!mg.cell_child_mask[first + i])
+			continue;
+		relayout_cells[i] = Mesh{idx_off, cell.index_count, vtx_off,
+					 cell.vertex_count};
+		idx_off += cell.index_count;
+		vtx_off += cell.vertex_count;
+	}
+	assert(idx_off == idx_num && vtx_off == vtx_num);
+
+	relayout_buf.vtx_attr = mg.data.vtx_attr;
+	relayout_buf.reserve_indices(idx_num);
+	relayout_buf.reserve_vertices(vtx_num);
+
+	pool.parallel_for(count, relayout_cell_task, this);
+
+	copy_indices(mg.data, level0_idx_end, relayout_buf, 0, idx_num);
+	copy_vertices(mg.data, level0_vtx_end, relayout_buf, 0, vtx_num);
+	for (uint32_t i = 0; i < count; ++i) {
+		Mesh &cell = mg.cells[first + i];
+		if (!mg.cell_child_mask[first + i])
+			continue;
+		cell.index_offset =
+		    level0_idx_end + relayout_cells[i].index_offset;
+		cell.vertex_offset =
+		    level0_vtx_end + relayout_cells[i].vertex_offset;
 	}
-	for (int i = 0; i < num_threads; ++i) {
-		pthread_join(thread[i], NULL);
+
+	relayout_buf.clear();
+	relayout_cells.clear();
+}
+
+void MeshGridBuilder::enter_data(int thread_id)
+{
+	std::atomic<bool> &active = readers[thread_id].active;
+
+	for (;;) {
+		active.store(true);
+		if LIKELY (!growing.load())
+			return;
+		active.store(false);
+		while (growing.load(std::memory_order_acquire)) {
+			sched_yield();
+		}
 	}
 }
 
+void MeshGridBuilder::leave_data(int thread_id)
+{
+	readers[thread_id].active.store(false, std::memory_order_release);
+}
+
+/* Reserve ranges in mg.data for a new cell with two fetch-adds, growing
+ * mg.data if needed. Must be called outside of enter_data/leave_data. */
+void MeshGridBuilder::reserve_data(uint32_t idx_num, uint32_t vtx_num,
+				   uint32_t &idx_off, uint32_t &vtx_off)
+{
+	idx_off = next_index_offset.fetch_add(idx_num);
+	vtx_off = next_vertex_offset.fetch_add(vtx_num);
+
+	size_t idx_end = (size_t)idx_off + idx_num;
+	size_t vtx_end = (size_t)vtx_off + vtx_num;
+
+	if LIKELY (idx_end <= idx_capacity.load(std::memory_order_acquire) &&
+		   vtx_end <= vtx_capacity.load(std::memory_order_acquire))
+		return;
+
+	pthread_mutex_lock(&grow_mutex);
+	growing.store(true);
+	for (int t = 0; t < pool.size(); ++t) {
+		while (readers[t].active.load()) {
+			sched_yield();
+		}
+	}
+	if (idx_end > mg.data.idx_capacity) {
+		mg.data.reserve_indices(
+		    MAX(idx_end, mg.data.idx_capacity * 3 / 2));
+		idx_capacity.store(mg.data.idx_capacity);
+	}
+	if (vtx_end > mg.data.vtx_capacity) {
+		mg.data.reserve_vertices(
+		    MAX(vtx_end, mg.data.vtx_capacity * 3 / 2));
+		vtx_capacity.store(mg.data.vtx_capacity);
+	}
+	growing.store(false, std::memory_order_release);
+	pthread_mutex_unlock(&grow_mutex);
+}
+
 void MeshGrid::build_from_mesh(const MBuf &src, const Mesh &mesh,
-			       int num_threads)
+			       ThreadPool &pool, bool deterministic)
 {
 	data.vtx_attr = src.vtx_attr | VtxAttr::MAP;
 
-	init_from_mesh(src, mesh);
+	init_from_mesh(src, mesh, pool);
 
 	/* Hack : destroy init mesh here */
 	MBuf *hack = (MBuf *)&src;
 	hack->clear();
 
-	printf("Number of cells at level 0 : %d\n", cell_counts[0]);
+	build_levels(pool, deterministic);
+}
 
-	MeshGridBuilder builder(*this, num_threads);
+/* Build upper levels from level 0 */
+void MeshGrid::build_levels(ThreadPool &pool, bool deterministic)
+{
+	/* Levels are not built one after the other : a block is built as
+	 * soon as the blocks producing its children are done. */
+	{
+		MeshGridBuilder builder(*this, pool);
+		builder.init_cells_and_blocks();
+		builder.build();
+		if (deterministic) {
+			builder.relayout();
+		}
+	}
 
+	printf("Number of cells at level 0 : %d\n", cell_counts[0]);
 	for (uint32_t level = 1; level < levels; level++) {
-		builder.build_level(level);
 		printf("Number of cells at level %d : %d\n", level,
 		       cell_counts[level]);
 		printf("Number of triangles at level %d  : %d (ratio : %f)\n",
 		       level, get_triangle_count(level),
 		       (float)get_triangle_count(level) /
 			   get_triangle_count(level - 1));
-		// printf("MEM : indices %zuMb vertices %zuMb\n",
-		//        data.idx_capacity * sizeof(*data.indices) / (1 << 20),
-		//        data.vtx_capacity *
-		//	   (sizeof(*data.positions) + sizeof(*data.normals) +
-		//	    sizeof(*data.remap)) /
-		//	   (1 << 20));
 	}
 	/* Shrink to fit */
 	data.reserve_indices(next_index_offset, true);
@@ -263,136 +794,1962 @@ void MeshGrid::build_from_mesh(const MBuf &src, const Mesh &mesh,
 	printf("Mean relative error : %f\n", mean_relative_error);
 }
 
-void MeshGrid::init_from_mesh(const MBuf &src, const Mesh &mesh)
+/* Triangles are processed by chunks in the parallel passes of
+ * init_from_mesh */
+#define INIT_CHUNK_TRIS 4096
+
+/* Streamed triangles come by chunks of STREAM_CHUNK_TRIS (a power of two
+ * multiple of INIT_CHUNK_TRIS), all full but the last one */
+#define STREAM_CHUNK_TRIS (16 * INIT_CHUNK_TRIS)
+
+/* Cleared after every cell, which is O(1) with generations */
+typedef GroupHashTable<uint32_t, uint32_t, DefaultHasher<uint32_t>>
+    IndexTable;
+
+struct InitCtx {
+	MeshGrid *mg;
+	const MBuf *src;
+	const Mesh *mesh;
+	size_t tri_count;
+	/* Triangles whose cell is out of box are dropped, if not NULL */
+	const CellBox *box;
+	/* Cell key and index of every triangle, sorted by key */
+	uint64_t *keys;
+	uint32_t *tris;
+	/* Number of cells starting in each chunk of sorted triangles, then
+	 * the index of the first of them */
+	uint32_t *chunk_cells;
+	/* First sorted triangle of every cell, plus one past the last */
+	uint32_t *cell_starts;
+	/* Source vertex of every cell vertex, stored at the cell index
+	 * offset (a cell has no more vertices than indices) */
+	uint32_t *vtx_src;
+	/* One index remap table per thread */
+	IndexTable **idx_remaps;
+};
+
+static inline Vec3 triangle_barycenter(const Vec3 *positions,
+				       const uint32_t *tri)
+{
+	const Vec3 v1 = positions[tri[0]];
+	const Vec3 v2 = positions[tri[1]];
+	const Vec3 v3 = positions[tri[2]];
+
+	return (v1 + v2 + v3) * (1.f / 3.f);
+}
+
+static inline Vec3 triangle_barycenter(const MBuf &src, const Mesh &mesh,
+				       size_t tri_idx)
+{
+	const uint32_t *indices = src.indices + mesh.index_offset;
+	const Vec3 *positions = src.positions + mesh.vertex_offset;
+
+	return (triangle_barycenter(positions, indices + 3 * tri_idx));
+}
+
+static inline const uint32_t *triangle_indices(const InitCtx *ic,
+					       size_t tri_idx)
+{
+	return (ic->src->indices + ic->mesh->index_offset + 3 * tri_idx);
+}
+
+/* Cell keys of n (at most INIT_CHUNK_TRIS) triangles given by their
+ * indices. Triangles out of box, if not NULL, get an invalid key. */
+static void bin_triangles(const MeshGrid &mg, const Vec3 *positions,
+			  const uint32_t *indices, uint32_t n,
+			  const CellBox *box, uint64_t *keys)
+{
+	float inv_step = 1.f / mg.step;
+
+	/* Gather barycenters in grid space first, so that quantization runs
+	 * as a separate loop over plain arrays that the compiler vectorizes */
+	float fx[INIT_CHUNK_TRIS];
+	float fy[INIT_CHUNK_TRIS];
+	float fz[INIT_CHUNK_TRIS];
+	for (uint32_t i = 0; i < n; ++i) {
+		Vec3 bary = triangle_barycenter(positions, indices + 3 * i);
+		Vec3 f = (bary - mg.base) * inv_step;
+		fx[i] = f.x;
+		fy[i] = f.y;
+		fz[i] = f.z;
+	}
+
+	int16_t qx[INIT_CHUNK_TRIS];
+	int16_t qy[INIT_CHUNK_TRIS];
+	int16_t qz[INIT_CHUNK_TRIS];
+	for (uint32_t i = 0; i < n; ++i) {
+		qx[i] = floorf(fx[i]);
+		qy[i] = floorf(fy[i]);
+		qz[i] = floorf(fz[i]);
+	}
+
+	for (uint32_t i = 0; i < n; ++i) {
+		CellCoord coord{{0, qx[i], qy[i], qz[i]}};
+		keys[i] = cell_morton_key(coord);
+	}
+
+	/* Dropped triangles sort last, past any valid (48 bits) key */
+	for (uint32_t i = 0; box && i < n; ++i) {
+		CellCoord coord{{0, qx[i], qy[i], qz[i]}};
+		if (!box->contains(coord)) {
+			keys[i] = ~0ull;
+		}
+	}
+}
+
+static void bin_triangles_task(void *ctx, uint32_t chunk, int thread_id)
+{
+	(void)thread_id;
+
+	InitCtx *ic = (InitCtx *)ctx;
+	size_t begin = (size_t)chunk * INIT_CHUNK_TRIS;
+	uint32_t n = MIN(ic->tri_count - begin, (size_t)INIT_CHUNK_TRIS);
+
+	bin_triangles(*ic->mg, ic->src->positions + ic->mesh->vertex_offset,
+		      triangle_indices(ic, begin), n, ic->box,
+		      ic->keys + begin);
+	for (uint32_t i = 0; i < n; ++i) {
+		ic->tris[begin + i] = begin + i;
+	}
+}
+
+static inline void chunk_bounds(const InitCtx *ic, uint32_t chunk,
+				size_t &begin, size_t &end)
+{
+	begin = (size_t)chunk * INIT_CHUNK_TRIS;
+	end = MIN(begin + INIT_CHUNK_TRIS, ic->tri_count);
+}
+
+static void count_cells_task(void *ctx, uint32_t chunk, int thread_id)
+{
+	(void)thread_id;
+
+	InitCtx *ic = (InitCtx *)ctx;
+	size_t begin, end;
+	chunk_bounds(ic, chunk, begin, end);
+
+	uint32_t count = 0;
+	for (size_t i = begin; i < end; ++i) {
+		count += (i == 0 || ic->keys[i] != ic->keys[i - 1]);
+	}
+	ic->chunk_cells[chunk] = count;
+}
+
+static void find_cells_task(void *ctx, uint32_t chunk, int thread_id)
+{
+	(void)thread_id;
+
+	InitCtx *ic = (InitCtx *)ctx;
+	size_t begin, end;
+	chunk_bounds(ic, chunk, begin, end);
+
+	uint32_t cell_idx = ic->chunk_cells[chunk];
+	for (size_t i = begin; i < end; ++i) {
+		if (i == 0 || ic->keys[i] != ic->keys[i - 1]) {
+			ic->cell_starts[cell_idx++] = i;
+		}
+	}
+}
+
+static void scatter_indices_task(void *ctx, uint32_t chunk, int thread_id)
+{
+	(void)thread_id;
+
+	InitCtx *ic = (InitCtx *)ctx;
+	uint32_t *dst_idx = ic->mg->data.indices;
+	size_t begin, end;
+	chunk_bounds(ic, chunk, begin, end);
+
+	for (size_t i = begin; i < end; ++i) {
+		memcpy(dst_idx + 3 * i, triangle_indices(ic, ic->tris[i]),
+		       3 * sizeof(uint32_t));
+	}
+}
+
+static void compact_cell_task(void *ctx, uint32_t cell_idx, int thread_id)
+{
+	InitCtx *ic = (InitCtx *)ctx;
+	IndexTable &idx_remap = *ic->idx_remaps[thread_id];
+	Mesh &cell = ic->mg->cells[cell_idx];
+
+	uint32_t *cell_indices = ic->mg->data.indices + cell.index_offset;
+	uint32_t *cell_vtx_src = ic->vtx_src + cell.index_offset;
+
+	cell.vertex_count = 0;
+	for (size_t i = 0; i < cell.index_count; ++i) {
+		uint32_t old_idx = cell_indices[i];
+		uint32_t new_idx;
+		uint32_t *p = idx_remap.get(old_idx);
+		if (!p) {
+			new_idx = cell.vertex_count;
+			idx_remap.set_at(old_idx, new_idx);
+			cell_vtx_src[cell.vertex_count++] = old_idx;
+		} else {
+			new_idx = *p;
+		}
+		cell_indices[i] = new_idx;
+	}
+	/* Clear idx_remap for use with next cell */
+	idx_remap.clear();
+}
+
+static void copy_cell_vertices_task(void *ctx, uint32_t cell_idx,
+				    int thread_id)
+{
+	(void)thread_id;
+
+	InitCtx *ic = (InitCtx *)ctx;
+	const Mesh &cell = ic->mg->cells[cell_idx];
+	const uint32_t *cell_vtx_src = ic->vtx_src + cell.index_offset;
+
+	gather_vertices(ic->mg->data, cell.vertex_offset, *ic->src,
+			cell_vtx_src, cell.vertex_count,
+			ic->mesh->vertex_offset);
+}
+
+/**
+ * Level 0 is built in parallel passes : triangles get the Morton key of
+ * their cell, are radix sorted by key (which yields cells in Morton order,
+ * triangles keeping their input order within a cell), then every cell
+ * compacts its own vertices once offsets are known.
+ */
+void MeshGrid::init_from_mesh(const MBuf &src, const Mesh &mesh,
+			      ThreadPool &pool, const CellBox *box)
 {
 	cell_offsets[0] = 0;
 	cell_counts[0] = 0;
 
-	/* Loop over triangles and fill triangle to cell table. */
+	InitCtx ic;
+	ic.mg = this;
+	ic.src = &src;
+	ic.mesh = &mesh;
+	ic.tri_count = mesh.index_count / 3;
+	ic.box = box;
 
-	size_t tri_count = mesh.index_count / 3;
-	TArray<uint32_t> tri_idx_to_cell_idx(tri_count);
+	if (!ic.tri_count)
+		return;
 
-	CellCoord cell_coord{{0, 0, 0, 0}};
-	float inv_step = 1.f / step;
-	for (size_t tri_idx = 0; tri_idx < tri_count; ++tri_idx) {
-		const uint32_t *indices = src.indices + mesh.index_offset;
-		const Vec3 *positions = src.positions + mesh.vertex_offset;
+	uint32_t chunk_count =
+	    (ic.tri_count + INIT_CHUNK_TRIS - 1) / INIT_CHUNK_TRIS;
+
+	/* Bin triangles into cells */
+	TArray<uint64_t> keys(ic.tri_count);
+	TArray<uint32_t> tris(ic.tri_count);
+	ic.keys = keys.data;
+	ic.tris = tris.data;
+	pool.parallel_for(chunk_count, bin_triangles_task, &ic);
+
+	init_level0(ic, keys, tris, pool);
+}
 
-		const Vec3 v1 = positions[indices[3 * tri_idx + 0]];
-		const Vec3 v2 = positions[indices[3 * tri_idx + 1]];
-		const Vec3 v3 = positions[indices[3 * tri_idx + 2]];
+/* Level 0 cells from binned triangles */
+void MeshGrid::init_level0(InitCtx &ic, TArray<uint64_t> &keys,
+			   TArray<uint32_t> &tris, ThreadPool &pool)
+{
+	const CellBox *box = ic.box;
+	uint32_t chunk_count =
+	    (ic.tri_count + INIT_CHUNK_TRIS - 1) / INIT_CHUNK_TRIS;
+
+	radix_sort_pairs(ic.keys, ic.tris, ic.tri_count, pool);
+
+	/* Forget dropped triangles, now at the end */
+	if (box) {
+		size_t lo = 0;
+		size_t hi = ic.tri_count;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (keys[mid] != ~0ull) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		ic.tri_count = lo;
+		chunk_count =
+		    (ic.tri_count + INIT_CHUNK_TRIS - 1) / INIT_CHUNK_TRIS;
+		if (!ic.tri_count)
+			return;
+	}
 
-		const Vec3 bary = (v1 + v2 + v3) * (1.f / 3.f);
+	/* Find where cells start among sorted triangles */
+	TArray<uint32_t> chunk_cells(chunk_count);
+	ic.chunk_cells = chunk_cells.data;
+	pool.parallel_for(chunk_count, count_cells_task, &ic);
+	uint32_t cell_count = 0;
+	for (uint32_t c = 0; c < chunk_count; ++c) {
+		uint32_t n = chunk_cells[c];
+		chunk_cells[c] = cell_count;
+		cell_count += n;
+	}
+	TArray<uint32_t> cell_starts(cell_count + 1);
+	ic.cell_starts = cell_starts.data;
+	pool.parallel_for(chunk_count, find_cells_task, &ic);
+	cell_starts[cell_count] = ic.tri_count;
+
+	TArray<uint64_t> cell_keys(cell_count);
+	for (uint32_t cell_idx = 0; cell_idx < cell_count; ++cell_idx) {
+		cell_keys[cell_idx] = keys[cell_starts[cell_idx]];
+	}
+	keys.release();
+	chunk_cells.release();
 
+	/* Reorder indices according to cells */
+	data.reserve_indices(3 * ic.tri_count);
+	pool.parallel_for(chunk_count, scatter_indices_task, &ic);
+	tris.release();
+
+	init_level0_cells(ic, cell_keys, cell_starts, cell_count, pool);
+}
+
+/**
+ * Level 0 cells from their triangles, whose source indices are already in
+ * data.indices by cell in Morton order. Cell c starts at triangle
+ * cell_starts[c] and has Morton key cell_keys[c].
+ */
+void MeshGrid::init_level0_cells(InitCtx &ic, TArray<uint64_t> &cell_keys,
+				 TArray<uint32_t> &cell_starts,
+				 uint32_t cell_count, ThreadPool &pool)
+{
+	const MBuf &src = *ic.src;
+	const Mesh &mesh = *ic.mesh;
+	size_t index_count = 3 * ic.tri_count;
+
+	TArray<uint8_t> cell_lods(cell_count);
+	for (uint32_t cell_idx = 0; cell_idx < cell_count; ++cell_idx) {
+		cell_lods[cell_idx] = 0;
+	}
+	if (cell_budget) {
+		cell_count = merge_leaf_cells(cell_keys.data, cell_starts.data,
+					      cell_lods.data, cell_count);
+	}
+
+	/* Create cells, the first triangle of a cell gives its coordinates */
+	float inv_step = 1.f / step;
+	size_t max_index_count = 0;
+	cells.resize(cell_count);
+	cell_coords.resize(cell_count);
+	cell_errors.resize(cell_count);
+	for (uint32_t cell_idx = 0; cell_idx < cell_count; ++cell_idx) {
+		uint32_t start = cell_starts[cell_idx];
+		uint32_t tri_num = cell_starts[cell_idx + 1] - start;
+
+		CellCoord cell_coord{{0, 0, 0, 0}};
+		Vec3 bary = triangle_barycenter(
+		    src.positions + mesh.vertex_offset,
+		    data.indices + 3 * (size_t)start);
 		point_to_cell_coord(cell_coord, bary, base, inv_step);
+		for (uint32_t lod = 0; lod < cell_lods[cell_idx]; ++lod) {
+			cell_coord = parent_coord(cell_coord);
+		}
+
+		cell_coords[cell_idx] = cell_coord;
+		cell_errors[cell_idx] = 0.f;
+		cells[cell_idx] = Mesh{3 * start, 3 * tri_num, 0, 0};
+		max_index_count = MAX(max_index_count, 3 * (size_t)tri_num);
+	}
+	cell_keys.release();
+	cell_starts.release();
+
+	/**
+	 * Make cell indices local. max_index_count is also an upper bound
+	 * on max vertex_count per cell.
+	 */
+	TArray<uint32_t> vtx_src(index_count);
+	ic.vtx_src = vtx_src.data;
+	ic.idx_remaps = (IndexTable **)malloc(pool.size() *
+					      sizeof(IndexTable *));
+	for (int t = 0; t < pool.size(); ++t) {
+		ic.idx_remaps[t] = new IndexTable(max_index_count);
+	}
+	pool.parallel_for(cell_count, compact_cell_task, &ic);
+	for (int t = 0; t < pool.size(); ++t) {
+		delete ic.idx_remaps[t];
+	}
+	free(ic.idx_remaps);
+
+	/* Compute vertex offsets and copy vertices */
+	size_t total_vertex_count = 0;
+	for (uint32_t cell_idx = 0; cell_idx < cell_count; ++cell_idx) {
+		cells[cell_idx].vertex_offset = total_vertex_count;
+		total_vertex_count += cells[cell_idx].vertex_count;
+	}
+	data.reserve_vertices(total_vertex_count);
+	pool.parallel_for(cell_count, copy_cell_vertices_task, &ic);
+
+	next_index_offset = index_count;
+	next_vertex_offset = total_vertex_count;
+
+	/* Level 0 cells first, then leaves of upper levels by level */
+	if (cell_budget) {
+		sort_cells_by_level();
+	}
+	cell_counts[0] = 0;
+	while (cell_counts[0] < cells.size &&
+	       cell_coords[cell_counts[0]].lod == 0) {
+		cell_counts[0]++;
+	}
+}
+
+/**
+ * Streamed triangles are appended to the blocks of their cell as soon as
+ * their chunk is binned, which releases the chunk : only the cells grow
+ * with the input, by about a block per cell on top of its triangles.
+ */
+#define STREAM_BLOCK_TRIS 64
+#define STREAM_SLAB_BLOCKS 4096
+/* Parsed chunks not yet appended, per thread, before the parser waits */
+#define STREAM_CHUNKS_AHEAD 2
+
+#define STREAM_NO_BLOCK UINT32_MAX
+
+struct StreamBlock {
+	uint32_t next;
+	uint32_t tri_count;
+	uint32_t indices[3 * STREAM_BLOCK_TRIS];
+};
+
+/* Level 0 cell with its key and its list of blocks */
+struct StreamCell {
+	uint64_t key;
+	uint32_t first_block;
+	uint32_t last_block;
+	uint32_t tri_count;
+};
+
+struct MortonKeyHasher {
+	static constexpr uint64_t empty_key = ~0ull;
+	size_t hash(uint64_t key) const { return murmur2_64(0, key); }
+	bool is_empty(uint64_t key) const { return (key == empty_key); }
+	bool is_equal(uint64_t k1, uint64_t k2) const { return (k1 == k2); }
+};
+typedef GroupHashTable<uint64_t, uint32_t, MortonKeyHasher> MortonTable;
+
+/* Triangles of a stream chunk and, once binned, their cell keys */
+struct StreamChunk {
+	uint32_t *indices;
+	uint64_t *keys;
+	size_t tri_count;
+};
+
+struct StreamCtx {
+	MeshGrid *mg;
+	PlyStream *stream;
+	MBuf *src;
+	const Mesh *mesh;
+	const Vec3 *positions;
+	/* Position remap of the normals being computed, NULL if src has
+	 * normals */
+	const uint32_t *nml_remap;
+	/**
+	 * Chunks are pushed by the parser, taken in order by binning threads
+	 * from next_chunk on, and appended in order from next_append on by
+	 * one thread at a time. The parser waits while max_ahead chunks are
+	 * not appended.
+	 */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	TArray<StreamChunk> chunks;
+	uint32_t next_chunk;
+	uint32_t next_append;
+	uint32_t max_ahead;
+	bool appending;
+	bool done;
+	/* Set by the parser if the input has too many triangles */
+	bool overflow;
+	size_t tri_count;
+	/* Cells and their blocks, held by the appending thread */
+	TArray<StreamCell> cells;
+	MortonTable *cell_table;
+	TArray<StreamBlock *> slabs;
+	uint32_t block_count;
+	/* Cells in Morton order, and their first triangle once gathered */
+	const uint32_t *order;
+	const uint32_t *cell_starts;
+	/* First triangle of every block once gathered */
+	uint32_t *block_starts;
+	uint32_t *indices;
+};
+
+static inline StreamBlock *stream_block(StreamCtx *sc, uint32_t b)
+{
+	return (sc->slabs[b / STREAM_SLAB_BLOCKS] + b % STREAM_SLAB_BLOCKS);
+}
+
+static uint32_t new_stream_block(StreamCtx *sc)
+{
+	if (sc->block_count == sc->slabs.size * STREAM_SLAB_BLOCKS) {
+		StreamBlock *slab;
+		MALLOC_NUM(slab, STREAM_SLAB_BLOCKS);
+		sc->slabs.push_back(slab);
+	}
+	uint32_t b = sc->block_count++;
+	StreamBlock *block = stream_block(sc, b);
+	block->next = STREAM_NO_BLOCK;
+	block->tri_count = 0;
+
+	return (b);
+}
+
+static void stream_cell_add(StreamCtx *sc, StreamCell &cell,
+			    const uint32_t *tri)
+{
+	StreamBlock *block = NULL;
+	if (cell.last_block != STREAM_NO_BLOCK) {
+		block = stream_block(sc, cell.last_block);
+	}
+	if (!block || block->tri_count == STREAM_BLOCK_TRIS) {
+		uint32_t b = new_stream_block(sc);
+		if (block) {
+			block->next = b;
+		} else {
+			cell.first_block = b;
+		}
+		cell.last_block = b;
+		block = stream_block(sc, b);
+	}
+	memcpy(block->indices + 3 * block->tri_count++, tri,
+	       3 * sizeof(uint32_t));
+	cell.tri_count++;
+}
+
+/* Add the triangles of a binned chunk to normals and to their cells */
+static void append_stream_chunk(StreamCtx *sc, const StreamChunk &chunk)
+{
+	if (sc->nml_remap) {
+		add_mesh_normals(*sc->mesh, *sc->src, sc->nml_remap,
+				 chunk.indices, 3 * chunk.tri_count);
+	}
+
+	/* Consecutive triangles often share their cell */
+	uint64_t last_key = MortonKeyHasher::empty_key;
+	uint32_t cell_idx = 0;
+	for (size_t i = 0; i < chunk.tri_count; ++i) {
+		uint64_t key = chunk.keys[i];
+		if (key != last_key) {
+			uint32_t *p =
+			    sc->cell_table->get_or_set(key, sc->cells.size);
+			if (p) {
+				cell_idx = *p;
+			} else {
+				cell_idx = sc->cells.size;
+				sc->cells.push_back(StreamCell{
+				    key, STREAM_NO_BLOCK, STREAM_NO_BLOCK, 0});
+			}
+			last_key = key;
+		}
+		stream_cell_add(sc, sc->cells[cell_idx],
+				chunk.indices + 3 * i);
+	}
+}
+
+static void *stream_parse_thread(void *arg)
+{
+	StreamCtx *sc = (StreamCtx *)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&sc->mutex);
+		while (sc->chunks.size - sc->next_append >= sc->max_ahead) {
+			pthread_cond_wait(&sc->cond, &sc->mutex);
+		}
+		pthread_mutex_unlock(&sc->mutex);
+
+		uint32_t *indices;
+		MALLOC_NUM(indices, 3 * STREAM_CHUNK_TRIS);
+		size_t tri_num =
+		    sc->stream->read_triangles(indices, STREAM_CHUNK_TRIS);
+		if (!tri_num) {
+			free(indices);
+			break;
+		}
+		if (3 * (sc->tri_count + tri_num) > UINT32_MAX) {
+			sc->overflow = true;
+			free(indices);
+			break;
+		}
+		sc->tri_count += tri_num;
+
+		pthread_mutex_lock(&sc->mutex);
+		sc->chunks.push_back(StreamChunk{indices, NULL, tri_num});
+		pthread_cond_broadcast(&sc->cond);
+		pthread_mutex_unlock(&sc->mutex);
+
+		if (tri_num < STREAM_CHUNK_TRIS)
+			break;
+	}
+
+	pthread_mutex_lock(&sc->mutex);
+	sc->done = true;
+	pthread_cond_broadcast(&sc->cond);
+	pthread_mutex_unlock(&sc->mutex);
+
+	return (NULL);
+}
+
+/**
+ * Bin chunks as the parser delivers them, until it is done. A thread which
+ * finds no other one appending appends every chunk binned in order, so
+ * that triangles keep their input order within a cell.
+ */
+static void bin_stream_job(void *ctx, int thread_id)
+{
+	(void)thread_id;
+
+	StreamCtx *sc = (StreamCtx *)ctx;
+
+	pthread_mutex_lock(&sc->mutex);
+	for (;;) {
+		while (sc->next_chunk == sc->chunks.size && !sc->done) {
+			pthread_cond_wait(&sc->cond, &sc->mutex);
+		}
+		if (sc->next_chunk == sc->chunks.size)
+			break;
+		uint32_t c = sc->next_chunk++;
+		StreamChunk chunk = sc->chunks[c];
+		pthread_mutex_unlock(&sc->mutex);
+
+		uint64_t *keys;
+		MALLOC_NUM(keys, chunk.tri_count);
+		for (size_t t = 0; t < chunk.tri_count; t += INIT_CHUNK_TRIS) {
+			uint32_t n = MIN(chunk.tri_count - t,
+					 (size_t)INIT_CHUNK_TRIS);
+			bin_triangles(*sc->mg, sc->positions,
+				      chunk.indices + 3 * t, n, NULL, keys + t);
+		}
+
+		/* Chunks may have moved meanwhile */
+		pthread_mutex_lock(&sc->mutex);
+		sc->chunks[c].keys = keys;
+		if (sc->appending)
+			continue;
+		sc->appending = true;
+		while (sc->next_append < sc->chunks.size &&
+		       sc->chunks[sc->next_append].keys) {
+			StreamChunk &next = sc->chunks[sc->next_append];
+			chunk = next;
+			next.indices = NULL;
+			next.keys = NULL;
+			pthread_mutex_unlock(&sc->mutex);
+
+			append_stream_chunk(sc, chunk);
+			free(chunk.indices);
+			free(chunk.keys);
+
+			pthread_mutex_lock(&sc->mutex);
+			sc->next_append++;
+			pthread_cond_broadcast(&sc->cond);
+		}
+		sc->appending = false;
+	}
+	pthread_mutex_unlock(&sc->mutex);
+}
+
+static void free_stream_blocks(StreamCtx *sc)
+{
+	for (uint32_t s = 0; s < sc->slabs.size; ++s) {
+		free(sc->slabs[s]);
+	}
+	sc->slabs.release();
+	sc->cells.release();
+}
+
+static void stream_block_starts_task(void *ctx, uint32_t c, int thread_id)
+{
+	(void)thread_id;
+
+	StreamCtx *sc = (StreamCtx *)ctx;
+	const StreamCell &cell = sc->cells[sc->order[c]];
+	uint32_t start = sc->cell_starts[c];
+
+	for (uint32_t b = cell.first_block; b != STREAM_NO_BLOCK;) {
+		const StreamBlock *block = stream_block(sc, b);
+		sc->block_starts[b] = start;
+		start += block->tri_count;
+		b = block->next;
+	}
+}
+
+/* Blocks are gathered slab by slab, each slab being freed once copied */
+static void gather_stream_slab_task(void *ctx, uint32_t s, int thread_id)
+{
+	(void)thread_id;
+
+	StreamCtx *sc = (StreamCtx *)ctx;
+	uint32_t begin = s * STREAM_SLAB_BLOCKS;
+	uint32_t end = MIN(begin + STREAM_SLAB_BLOCKS, sc->block_count);
+
+	for (uint32_t b = begin; b < end; ++b) {
+		const StreamBlock *block = stream_block(sc, b);
+		memcpy(sc->indices + 3 * (size_t)sc->block_starts[b],
+		       block->indices, 3 * block->tri_count * sizeof(uint32_t));
+	}
+	MEMFREE(sc->slabs[s]);
+}
+
+/**
+ * Same as build_from_mesh, but triangles come from a PLY stream whose
+ * vertices are already read into src and mesh. The stream is parsed on a
+ * thread of its own while the pool bins the chunks it delivers into the
+ * lists of their cells, and no more than a few chunks are parsed ahead.
+ * Lists are then gathered to the grid indices one slab of blocks at a
+ * time, freeing the slab, hence the input index buffer is about held once
+ * at any time, in blocks or in the grid.
+ */
+int MeshGrid::build_from_stream(PlyStream &stream, MBuf &src, Mesh &mesh,
+				ThreadPool &pool, bool deterministic)
+{
+	StreamCtx sc;
+	sc.mg = this;
+	sc.stream = &stream;
+	sc.src = &src;
+	sc.mesh = &mesh;
+	sc.positions = src.positions + mesh.vertex_offset;
+	sc.nml_remap = NULL;
+	pthread_mutex_init(&sc.mutex, NULL);
+	pthread_cond_init(&sc.cond, NULL);
+	sc.next_chunk = 0;
+	sc.next_append = 0;
+	sc.max_ahead = STREAM_CHUNKS_AHEAD * pool.size();
+	sc.appending = false;
+	sc.done = false;
+	sc.overflow = false;
+	sc.tri_count = 0;
+	sc.cell_table = new MortonTable();
+	sc.block_count = 0;
+
+	/* Normals are added as chunks are appended */
+	TArray<uint32_t> nml_remap;
+	if (!(src.vtx_attr & VtxAttr::NML)) {
+		printf("Computing normals.\n");
+		nml_remap.resize(mesh.vertex_count);
+		start_mesh_normals(mesh, src, nml_remap.data, pool);
+		sc.nml_remap = nml_remap.data;
+	}
+
+	pthread_t parser;
+	pthread_create(&parser, NULL, stream_parse_thread, &sc);
+	pool.run(bin_stream_job, &sc);
+	pthread_join(parser, NULL);
+
+	pthread_cond_destroy(&sc.cond);
+	pthread_mutex_destroy(&sc.mutex);
+	delete sc.cell_table;
+	sc.chunks.release();
+
+	int res = EXIT_SUCCESS;
+	if (stream.error || sc.overflow) {
+		fprintf(stderr, "Error: could not stream triangles.\n");
+		res = EXIT_FAILURE;
+	}
+	mesh.index_count = 3 * sc.tri_count;
+
+	if (res == EXIT_SUCCESS) {
+		if (sc.nml_remap) {
+			finish_mesh_normals(mesh, src, sc.nml_remap, pool);
+		}
+		nml_remap.release();
+		data.vtx_attr = src.vtx_attr | VtxAttr::MAP;
+
+		cell_offsets[0] = 0;
+		cell_counts[0] = 0;
+	}
+
+	uint32_t cell_count = sc.cells.size;
+	if (res == EXIT_SUCCESS && cell_count) {
+		/* Cells in Morton order, and where their triangles go */
+		TArray<uint64_t> cell_keys(cell_count);
+		TArray<uint32_t> order(cell_count);
+		for (uint32_t c = 0; c < cell_count; ++c) {
+			cell_keys[c] = sc.cells[c].key;
+			order[c] = c;
+		}
+		radix_sort_pairs(cell_keys.data, order.data, cell_count, pool);
+		TArray<uint32_t> cell_starts(cell_count + 1);
+		uint32_t start = 0;
+		for (uint32_t c = 0; c < cell_count; ++c) {
+			cell_starts[c] = start;
+			start += sc.cells[order[c]].tri_count;
+		}
+		cell_starts[cell_count] = start;
+
+		TArray<uint32_t> block_starts(sc.block_count);
+		sc.order = order.data;
+		sc.cell_starts = cell_starts.data;
+		sc.block_starts = block_starts.data;
+		pool.parallel_for(cell_count, stream_block_starts_task, &sc);
+		order.release();
+
+		data.reserve_indices(3 * sc.tri_count);
+		sc.indices = data.indices;
+		pool.parallel_for(sc.slabs.size, gather_stream_slab_task, &sc);
+		free_stream_blocks(&sc);
+		block_starts.release();
+
+		InitCtx ic;
+		ic.mg = this;
+		ic.src = &src;
+		ic.mesh = &mesh;
+		ic.tri_count = sc.tri_count;
+		ic.box = NULL;
+		init_level0_cells(ic, cell_keys, cell_starts, cell_count, pool);
+	}
+
+	free_stream_blocks(&sc);
+	src.clear();
+	if (res != EXIT_SUCCESS)
+		return (res);
+
+	build_levels(pool, deterministic);
+
+	return (EXIT_SUCCESS);
+}
+
+/**
+ * Adaptive subdivision. Level 0 cells [0, cell_count) being in Morton
+ * order, the level 0 cells below a cell of level L are the consecutive ones
+ * sharing their key >> 3L. Going down from the top level, the first
+ * ancestor holding at most cell_budget indices becomes the leaf for all of
+ * them : their triangles, consecutive too, are merged into it. Level 0
+ * cells above budget stay leaves, they cannot be split further.
+ *
+ * keys (one per cell) and cell_starts are rewritten for the leaves and
+ * cell_lods receives their level. Returns the number of leaves.
+ */
+uint32_t MeshGrid::merge_leaf_cells(uint64_t *keys, uint32_t *cell_starts,
+				    uint8_t *cell_lods, uint32_t cell_count)
+{
+	for (uint32_t level = levels - 1; level > 0; --level) {
+		uint32_t shift = 3 * level;
+		uint32_t c = 0;
+		while (c < cell_count) {
+			uint64_t group = keys[c] >> shift;
+			uint32_t c_end = c + 1;
+			while (c_end < cell_count &&
+			       (keys[c_end] >> shift) == group) {
+				c_end++;
+			}
+			/* Groups are either all decided higher up or not */
+			size_t idx_num =
+			    3 * (size_t)(cell_starts[c_end] - cell_starts[c]);
+			if (!cell_lods[c] && idx_num <= cell_budget) {
+				for (uint32_t k = c; k < c_end; ++k) {
+					cell_lods[k] = level;
+				}
+			}
+			c = c_end;
+		}
+	}
+
+	/* Merge cells with the same leaf */
+	uint32_t leaf_count = 0;
+	for (uint32_t c = 0; c < cell_count; ++c) {
+		uint32_t shift = 3 * cell_lods[c];
+		if (leaf_count && cell_lods[c] &&
+		    cell_lods[leaf_count - 1] == cell_lods[c] &&
+		    (keys[leaf_count - 1] >> shift) == (keys[c] >> shift))
+			continue;
+		keys[leaf_count] = keys[c];
+		cell_starts[leaf_count] = cell_starts[c];
+		cell_lods[leaf_count] = cell_lods[c];
+		leaf_count++;
+	}
+	cell_starts[leaf_count] = cell_starts[cell_count];
+
+	return leaf_count;
+}
+
+/* Stable counting sort of cells by level */
+void MeshGrid::sort_cells_by_level()
+{
+	uint32_t count = cells.size;
+	TArray<uint32_t> level_first(levels + 1);
+	for (uint32_t level = 0; level <= levels; ++level) {
+		level_first[level] = 0;
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		level_first[cell_coords[i].lod + 1]++;
+	}
+	for (uint32_t level = 0; level < levels; ++level) {
+		level_first[level + 1] += level_first[level];
+	}
+
+	TArray<CellCoord> coords(count);
+	TArray<Mesh> sorted(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t dst = level_first[cell_coords[i].lod]++;
+		coords[dst] = cell_coords[i];
+		sorted[dst] = cells[i];
+	}
+	memcpy(cell_coords.data, coords.data, count * sizeof(CellCoord));
+	memcpy(cells.data, sorted.data, count * sizeof(Mesh));
+}
+
+/* Box of the blocks holding the parents of the cells of a box : a block is
+ * rebuilt as a whole, hence so are all its cells. */
+static CellBox parent_block_box(const CellBox &box)
+{
+	CellBox pbox;
+	pbox.min = block_base_coord(parent_coord(box.min));
+	pbox.max = block_base_coord(parent_coord(box.max));
+	pbox.max.x += 1;
+	pbox.max.y += 1;
+	pbox.max.z += 1;
+	return pbox;
+}
+
+/* Kept cells hold their own copy of the vertices they share */
+static bool same_attributes(const MBuf &data, uint32_t a, uint32_t b)
+{
+	if ((data.vtx_attr & VtxAttr::NML) &&
+	    memcmp(&data.normals[a], &data.normals[b], sizeof(Vec3)))
+		return (false);
+	if ((data.vtx_attr & VtxAttr::UV0) &&
+	    memcmp(&data.uv[0][a], &data.uv[0][b], sizeof(Vec2)))
+		return (false);
+	if ((data.vtx_attr & VtxAttr::UV1) &&
+	    memcmp(&data.uv[1][a], &data.uv[1][b], sizeof(Vec2)))
+		return (false);
+	return (true);
+}
+
+/**
+ * Give the patch vertices lying on a kept level 0 cell around box the
+ * attributes of the kept vertex at their position. The edit may change the
+ * normals or uvs of the border vertices, which would leave a seam between
+ * patch and kept cells that the simplifier cannot handle. Positions held by
+ * several kept vertices are real seams and are left alone.
+ */
+static void snap_patch_border(MBuf &data, const Mesh &patch_vtx,
+			      const TArray<CellCoord> &coords,
+			      const TArray<Mesh> &cells, uint32_t first,
+			      uint32_t count, const CellBox &box)
+{
+	if (!(data.vtx_attr & (VtxAttr::NML | VtxAttr::UV0 | VtxAttr::UV1)))
+		return;
+
+	CellBox around = box;
+	around.min.x -= 1;
+	around.min.y -= 1;
+	around.min.z -= 1;
+	around.max.x += 1;
+	around.max.y += 1;
+	around.max.z += 1;
+
+	size_t border_vtx = 0;
+	for (uint32_t c = first; c < first + count; ++c) {
+		if (around.contains(coords[c]) && !box.contains(coords[c]))
+			border_vtx += cells[c].vertex_count;
+	}
+	if (!border_vtx)
+		return;
+
+	VertexTable table(border_vtx + 16, &data, VtxAttr::POS);
+	for (uint32_t c = first; c < first + count; ++c) {
+		if (!around.contains(coords[c]) || box.contains(coords[c]))
+			continue;
+		const Mesh &cell = cells[c];
+		for (uint32_t v = 0; v < cell.vertex_count; ++v) {
+			uint32_t idx = cell.vertex_offset + v;
+			uint32_t *kept = table.get_or_set(idx, idx);
+			if (kept && *kept != ~0u &&
+			    !same_attributes(data, *kept, idx))
+				*kept = ~0u;
+		}
+	}
+
+	for (uint32_t v = 0; v < patch_vtx.vertex_count; ++v) {
+		uint32_t idx = patch_vtx.vertex_offset + v;
+		uint32_t *kept = table.get(idx);
+		if (!kept || *kept == ~0u)
+			continue;
+		if (data.vtx_attr & VtxAttr::NML)
+			data.normals[idx] = data.normals[*kept];
+		if (data.vtx_attr & VtxAttr::UV0)
+			data.uv[0][idx] = data.uv[0][*kept];
+		if (data.vtx_attr & VtxAttr::UV1)
+			data.uv[1][idx] = data.uv[1][*kept];
+	}
+}
+
+/**
+ * Replace the level 0 cells overlapping region with the triangles of
+ * patch falling into them, then rebuild the blocks above them. patch must
+ * hold every triangle of the edited mesh whose barycenter lies in a cell
+ * overlapping region; triangles out of these cells are ignored, hence the
+ * whole edited mesh is a valid (but slower) patch.
+ *
+ * Cells and blocks out of the region are kept with their data. Since a
+ * block is simplified as a whole, the rebuilt region grows by at most one
+ * block per level. Replaced data is left unused in the buffers, until it
+ * makes more than a quarter of them and the buffers are compacted.
+ */
+int MeshGrid::update_region(const MBuf &patch, const Mesh &patch_mesh,
+			    const Aabb &region, ThreadPool &pool)
+{
+	if (!data.indices) {
+		fprintf(stderr,
+			"Error: mapped mesh grids cannot be updated.\n");
+		return (EXIT_FAILURE);
+	}
+	if (cell_budget) {
+		fprintf(stderr,
+			"Error: adaptive mesh grids cannot be updated.\n");
+		return (EXIT_FAILURE);
+	}
+	if ((patch.vtx_attr | VtxAttr::MAP) != data.vtx_attr) {
+		fprintf(stderr, "Error: patch vertex attributes differ from "
+				"the mesh grid ones.\n");
+		return (EXIT_FAILURE);
+	}
+
+	/* Dirty boxes, one per level */
+	float inv_step = 1.f / step;
+	TArray<CellBox> dirty_boxes(levels);
+	CellBox box{{{0, 0, 0, 0}}, {{0, 0, 0, 0}}};
+	point_to_cell_coord(box.min, region.min, base, inv_step);
+	point_to_cell_coord(box.max, region.max, base, inv_step);
+	dirty_boxes[0] = box;
+	for (uint32_t level = 1; level < levels; ++level) {
+		dirty_boxes[level] = parent_block_box(dirty_boxes[level - 1]);
+	}
+
+	/* New content of the edited level 0 cells */
+	MeshGrid patch_grid(base, step, 0, err_tol);
+	patch_grid.data.vtx_attr = data.vtx_attr;
+	patch_grid.init_from_mesh(patch, patch_mesh, pool, &box);
+
+	/* Keep the previous cells around, unchanged ones are reused */
+	uint32_t old_cell_count = cells.size;
+	TArray<CellCoord> old_coords(old_cell_count);
+	TArray<Mesh> old_cells(old_cell_count);
+	TArray<float> old_errors(old_cell_count);
+	TArray<uint32_t> old_offsets(levels);
+	TArray<uint32_t> old_counts(levels);
+	memcpy(old_coords.data, cell_coords.data,
+	       old_cell_count * sizeof(CellCoord));
+	memcpy(old_cells.data, cells.data, old_cell_count * sizeof(Mesh));
+	memcpy(old_errors.data, cell_errors.data,
+	       old_cell_count * sizeof(float));
+	memcpy(old_offsets.data, cell_offsets.data, levels * sizeof(uint32_t));
+	memcpy(old_counts.data, cell_counts.data, levels * sizeof(uint32_t));
+
+	/* Append patch data */
+	uint32_t patch_idx_num = patch_grid.next_index_offset;
+	uint32_t patch_vtx_num = patch_grid.next_vertex_offset;
+	if (patch_idx_num) {
+		data.reserve_indices(next_index_offset + patch_idx_num);
+		data.reserve_vertices(next_vertex_offset + patch_vtx_num);
+		copy_indices(data, next_index_offset, patch_grid.data, 0,
+			     patch_idx_num);
+		copy_vertices(data, next_vertex_offset, patch_grid.data, 0,
+			      patch_vtx_num);
+		Mesh patch_vtx{0, 0, next_vertex_offset, patch_vtx_num};
+		snap_patch_border(data, patch_vtx, old_coords, old_cells,
+				  old_offsets[0], old_counts[0], box);
+	}
 
-		uint32_t cell_idx;
-		uint32_t *p = cell_table.get(cell_coord);
-		if UNLIKELY (!p) {
-			cell_idx = cell_table.size();
-			cell_table.set_at(cell_coord, cell_idx);
-			cells.push_back(Mesh{0, 0, 0, 0});
-			cell_coords.push_back(cell_coord);
-			cell_errors.push_back(0.f);
-			cell_counts[0]++;
+	/* Merge kept and patch level 0 cells, in Morton order */
+	cell_coords.clear();
+	cells.clear();
+	cell_errors.clear();
+	uint32_t i = old_offsets[0];
+	uint32_t i_end = i + old_counts[0];
+	uint32_t j = 0;
+	uint32_t j_end = patch_grid.cells.size;
+	while (i < i_end || j < j_end) {
+		if (i < i_end && box.contains(old_coords[i])) {
+			i++;
+			continue;
+		}
+		bool take_old = (j == j_end);
+		if (!take_old && i < i_end) {
+			take_old = cell_morton_key(old_coords[i]) <
+				   cell_morton_key(patch_grid.cell_coords[j]);
+		}
+		if (take_old) {
+			cell_coords.push_back(old_coords[i]);
+			cells.push_back(old_cells[i]);
+			i++;
 		} else {
-			cell_idx = *p;
+			Mesh cell = patch_grid.cells[j];
+			cell.index_offset += next_index_offset;
+			cell.vertex_offset += next_vertex_offset;
+			cell_coords.push_back(patch_grid.cell_coords[j]);
+			cells.push_back(cell);
+			j++;
+		}
+		cell_errors.push_back(0.f);
+	}
+	cell_offsets[0] = 0;
+	cell_counts[0] = cells.size;
+	next_index_offset += patch_idx_num;
+	next_vertex_offset += patch_vtx_num;
+	patch_grid.data.clear();
+
+	/* Upper levels : cells out of the dirty boxes are the same as before,
+	 * with the same children, the others are rebuilt. */
+	MeshGridBuilder builder(*this, pool);
+	builder.init_cells_and_blocks();
+	for (uint32_t level = 1; level < levels; ++level) {
+		for (uint32_t k = 0; k < cell_counts[level]; ++k) {
+			uint32_t idx = cell_offsets[level] + k;
+			if (dirty_boxes[level].contains(cell_coords[idx]))
+				continue;
+			uint32_t old_idx =
+			    search_cell(old_coords.data, old_offsets[level],
+					old_counts[level], cell_coords[idx]);
+			assert(old_idx != ~0u);
+			cells[idx] = old_cells[old_idx];
+			cell_errors[idx] = old_errors[old_idx];
 		}
+	}
+	builder.mark_dirty_blocks(dirty_boxes.data);
+	builder.alloc_idx = MAX(patch_idx_num, 3u);
+	builder.alloc_vtx = MAX(patch_vtx_num, 3u);
+	builder.build();
+
+	compute_mean_relative_error();
+
+	size_t live_idx = 0;
+	for (uint32_t c = 0; c < cells.size; ++c) {
+		live_idx += cells[c].index_count;
+	}
+	if (4 * (next_index_offset - live_idx) > next_index_offset) {
+		compact_data();
+	}
+
+	return (EXIT_SUCCESS);
+}
+
+/* Copy the data of every cell, in cell order, to buffers of their size */
+void MeshGrid::compact_data()
+{
+	size_t idx_num = 0;
+	size_t vtx_num = 0;
+	for (uint32_t c = 0; c < cells.size; ++c) {
+		idx_num += cells[c].index_count;
+		vtx_num += cells[c].vertex_count;
+	}
+
+	MBuf kept;
+	kept.vtx_attr = data.vtx_attr;
+	if (idx_num) {
+		kept.reserve_indices(idx_num);
+		kept.reserve_vertices(vtx_num);
+	}
+	idx_num = 0;
+	vtx_num = 0;
+	for (uint32_t c = 0; c < cells.size; ++c) {
+		Mesh &cell = cells[c];
+		copy_indices(kept, idx_num, data, cell.index_offset,
+			     cell.index_count);
+		copy_vertices(kept, vtx_num, data, cell.vertex_offset,
+			      cell.vertex_count);
+		cell.index_offset = idx_num;
+		cell.vertex_offset = vtx_num;
+		idx_num += cell.index_count;
+		vtx_num += cell.vertex_count;
+	}
+	data.clear();
+	data = kept;
+	next_index_offset = idx_num;
+	next_vertex_offset = vtx_num;
+}
+
+/* Out of core build : triangles are binned to slabs of level 0 columns
+ * (along x) held in temporary files, two files per slab */
+#define OOC_MAX_SLABS 256
+
+struct OocSlab {
+	/* Source vertex indices, three per triangle */
+	FILE *tris;
+	/* Vertex records : source index followed by vertex attributes */
+	FILE *vtx;
+	size_t tri_count;
+	size_t vtx_count;
+	/* One past the last level 0 column of the slab */
+	int32_t x_end;
+};
 
-		cells[cell_idx].index_count += 3;
-		tri_idx_to_cell_idx[tri_idx] = cell_idx;
+enum OocCellState {
+	OOC_CELL_ABSENT,
+	OOC_CELL_RESIDENT,
+	OOC_CELL_SPILLED,
+};
+
+#define OOC_NO_PART 0xFFFF
+
+/**
+ * Distinct uses of vertices by parts (columns or slabs) of the grid. Most
+ * vertices are used by a single part, kept in firsts (one entry per vertex,
+ * OOC_NO_PART if unused), the other (vertex, part) pairs go to a table.
+ * Returns true on the first use of v by part.
+ */
+static inline bool ooc_first_use(uint16_t *firsts, MortonTable &others,
+				 uint32_t v, uint16_t part)
+{
+	if (firsts[v] == part)
+		return false;
+	if (firsts[v] == OOC_NO_PART) {
+		firsts[v] = part;
+		return true;
+	}
+
+	return (!others.get_or_set(((uint64_t)v << 16) | part, 0));
+}
+
+/* Triangles are read and binned by chunks of this many */
+#define OOC_CHUNK_TRIS STREAM_CHUNK_TRIS
+
+/**
+ * Triangles of an out of core build, read twice by chunks : from src, or
+ * from a PLY stream. Streamed triangles are copied to a temporary file by
+ * the first pass, and read back from it by the second one.
+ */
+struct OocInput {
+	PlyStream *stream;
+	FILE *copy;
+	/* Triangles of src, all triangles once the first pass is done */
+	const uint32_t *indices;
+	size_t tri_count;
+	size_t next_tri;
+	bool second_pass;
+	/* Chunk read from the stream or the copy */
+	uint32_t *buf;
+	bool error;
+};
+
+/* Next chunk of triangles, none at the end or on error */
+static size_t ooc_read_chunk(OocInput &in, const uint32_t **indices)
+{
+	size_t tri_num;
+	size_t tri_size = 3 * sizeof(uint32_t);
+
+	if (!in.stream) {
+		tri_num = MIN(in.tri_count - in.next_tri,
+			      (size_t)OOC_CHUNK_TRIS);
+		*indices = in.indices + 3 * in.next_tri;
+	} else if (!in.second_pass) {
+		tri_num = in.stream->read_triangles(in.buf, OOC_CHUNK_TRIS);
+		in.error |= in.stream->error;
+		in.error |= fwrite(in.buf, tri_size, tri_num, in.copy) !=
+			    tri_num;
+		*indices = in.buf;
+	} else {
+		tri_num = MIN(in.tri_count - in.next_tri,
+			      (size_t)OOC_CHUNK_TRIS);
+		in.error |= fread(in.buf, tri_size, tri_num, in.copy) !=
+			    tri_num;
+		*indices = in.buf;
+	}
+	in.next_tri += tri_num;
+	in.error |= 3 * in.next_tri > UINT32_MAX;
+
+	return (in.error ? 0 : tri_num);
+}
+
+struct OocCellsCtx {
+	const MeshGrid *mg;
+	const Vec3 *positions;
+	const uint32_t *indices;
+	size_t tri_count;
+	int32_t col_count;
+	/* Level 0 cell of every triangle of the chunk */
+	CellCoord *coords;
+	/* Distinct cells of every block of INIT_CHUNK_TRIS triangles, stored
+	 * from the offset of its first triangle, and their number. Not
+	 * gathered if block_cells is NULL. */
+	CellCoord *block_cells;
+	uint32_t *block_cell_counts;
+	/* Blocks with triangles out of the grid */
+	uint8_t *block_errors;
+	/* One table per thread */
+	CellTable **tables;
+};
+
+/* Same quantization as bin_triangles */
+static inline CellCoord triangle_cell(const Vec3 *positions,
+				      const uint32_t *tri, Vec3 base,
+				      float inv_step)
+{
+	Vec3 f = (triangle_barycenter(positions, tri) - base) * inv_step;
+	int16_t x = floorf(f.x);
+	int16_t y = floorf(f.y);
+	int16_t z = floorf(f.z);
+
+	return (CellCoord{{0, x, y, z}});
+}
+
+static void ooc_cells_task(void *ctx, uint32_t block, int thread_id)
+{
+	OocCellsCtx *oc = (OocCellsCtx *)ctx;
+	size_t begin = (size_t)block * INIT_CHUNK_TRIS;
+	size_t end = MIN(begin + INIT_CHUNK_TRIS, oc->tri_count);
+	float inv_step = 1.f / oc->mg->step;
+
+	bool error = false;
+	for (size_t t = begin; t < end; ++t) {
+		CellCoord coord = triangle_cell(oc->positions,
+						oc->indices + 3 * t,
+						oc->mg->base, inv_step);
+		error |= coord.x < 0 || coord.x >= oc->col_count;
+		oc->coords[t] = coord;
+	}
+	oc->block_errors[block] = error;
+	if (!oc->block_cells)
+		return;
+
+	/* Consecutive triangles often share their cell */
+	CellTable &table = *oc->tables[thread_id];
+	CellCoord last = CellCoordHasher::empty_key;
+	uint32_t count = 0;
+	for (size_t t = begin; t < end; ++t) {
+		CellCoord coord = oc->coords[t];
+		if (coord == last)
+			continue;
+		last = coord;
+		if (!table.get_or_set(coord, 0)) {
+			oc->block_cells[begin + count++] = coord;
+		}
+	}
+	oc->block_cell_counts[block] = count;
+	table.clear();
+}
+
+static bool write_vertex(FILE *f, const MBuf &src, uint32_t id, size_t v)
+{
+	bool ok = fwrite(&id, sizeof(id), 1, f) == 1;
+	ok &= fwrite(&src.positions[v], sizeof(Vec3), 1, f) == 1;
+	if (src.vtx_attr & VtxAttr::NML)
+		ok &= fwrite(&src.normals[v], sizeof(Vec3), 1, f) == 1;
+	if (src.vtx_attr & VtxAttr::UV0)
+		ok &= fwrite(&src.uv[0][v], sizeof(Vec2), 1, f) == 1;
+	if (src.vtx_attr & VtxAttr::UV1)
+		ok &= fwrite(&src.uv[1][v], sizeof(Vec2), 1, f) == 1;
+
+	return (ok);
+}
+
+/* Read a slab back as an indexed mesh, whose vertices are recorded once */
+static int load_slab(const OocSlab &slab, uint32_t vtx_attr, MBuf &buf,
+		     Mesh &mesh)
+{
+	buf.vtx_attr = vtx_attr;
+	mesh = Mesh{0, 0, 0, 0};
+	if (!slab.tri_count)
+		return (EXIT_SUCCESS);
+	buf.reserve_indices(3 * slab.tri_count);
+	buf.reserve_vertices(slab.vtx_count);
+
+	HashTable<uint32_t, uint32_t> local(slab.vtx_count);
+	uint32_t vtx_num = 0;
+	rewind(slab.vtx);
+	for (size_t i = 0; i < slab.vtx_count; ++i) {
+		uint32_t id;
+		bool ok = fread(&id, sizeof(id), 1, slab.vtx) == 1;
+		ok &= fread(&buf.positions[vtx_num], sizeof(Vec3), 1,
+			    slab.vtx) == 1;
+		if (vtx_attr & VtxAttr::NML)
+			ok &= fread(&buf.normals[vtx_num], sizeof(Vec3), 1,
+				    slab.vtx) == 1;
+		if (vtx_attr & VtxAttr::UV0)
+			ok &= fread(&buf.uv[0][vtx_num], sizeof(Vec2), 1,
+				    slab.vtx) == 1;
+		if (vtx_attr & VtxAttr::UV1)
+			ok &= fread(&buf.uv[1][vtx_num], sizeof(Vec2), 1,
+				    slab.vtx) == 1;
+		if (!ok)
+			return (EXIT_FAILURE);
+		assert(!local.get(id));
+		local.set_at(id, vtx_num++);
+	}
+
+	size_t idx_num = 3 * slab.tri_count;
+	rewind(slab.tris);
+	if (fread(buf.indices, sizeof(uint32_t), idx_num, slab.tris) !=
+	    idx_num)
+		return (EXIT_FAILURE);
+	for (size_t i = 0; i < idx_num; ++i) {
+		uint32_t *p = local.get(buf.indices[i]);
+		assert(p);
+		buf.indices[i] = *p;
+	}
+
+	mesh = Mesh{0, (uint32_t)idx_num, 0, vtx_num};
+
+	return (EXIT_SUCCESS);
+}
+
+/* Output streams of an out of core build, by section, and their sizes */
+struct OocSpill {
+	FILE *files[MGS_COUNT];
+	uint64_t idx_count;
+	uint64_t vtx_count;
+};
+
+/* Append the data of cell to the spill files, cell offsets then refer to
+ * the spilled streams */
+static int spill_cell(OocSpill &sp, const MBuf &data, Mesh &cell)
+{
+	FILE *const *spill = sp.files;
+	size_t idx_num = cell.index_count;
+	size_t vtx_num = cell.vertex_count;
+	size_t vo = cell.vertex_offset;
+	if (sp.idx_count + idx_num > UINT32_MAX ||
+	    sp.vtx_count + vtx_num > UINT32_MAX)
+		return (EXIT_FAILURE);
+
+	bool ok = fwrite(&data.indices[cell.index_offset], sizeof(uint32_t),
+			 idx_num, spill[MGS_INDICES]) == idx_num;
+	ok &= fwrite(&data.positions[vo], sizeof(Vec3), vtx_num,
+		     spill[MGS_POSITIONS]) == vtx_num;
+	if (spill[MGS_NORMALS])
+		ok &= fwrite(&data.normals[vo], sizeof(Vec3), vtx_num,
+			     spill[MGS_NORMALS]) == vtx_num;
+	if (spill[MGS_UV0])
+		ok &= fwrite(&data.uv[0][vo], sizeof(Vec2), vtx_num,
+			     spill[MGS_UV0]) == vtx_num;
+	if (spill[MGS_UV1])
+		ok &= fwrite(&data.uv[1][vo], sizeof(Vec2), vtx_num,
+			     spill[MGS_UV1]) == vtx_num;
+	if (spill[MGS_REMAP])
+		ok &= fwrite(&data.remap[vo], sizeof(uint32_t), vtx_num,
+			     spill[MGS_REMAP]) == vtx_num;
+
+	cell.index_offset = sp.idx_count;
+	cell.vertex_offset = sp.vtx_count;
+	sp.idx_count += idx_num;
+	sp.vtx_count += vtx_num;
+
+	return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/**
+ * Build the grid with bounded memory and write it to filename, for meshes
+ * whose grid does not fit in memory next to them. Triangles are those of
+ * src, or are read from stream if not NULL, src then holding vertices only
+ * (normals are computed on the way if it has none).
+ *
+ * Triangles are first binned to slabs of level 0 columns along x, in
+ * temporary files, along with one record of every vertex they use per
+ * slab, and the input mesh is released. Slabs are then loaded one after
+ * the other. After each slab, every block whose level 0 cells are all
+ * loaded is built, and cells whose parents are built are spilled to the
+ * output streams : only a front of about two slabs of level 0 data (plus
+ * the pending upper levels) stays in memory. Slabs are sized to hold about
+ * a quarter of mem_budget, from the triangles and distinct vertices of
+ * every column, measured by a first pass. A column larger than that makes
+ * a slab of its own, and slabs are enlarged if there would be more than
+ * OOC_MAX_SLABS of them.
+ *
+ * mem_budget does not cover the input until it is binned : the source
+ * vertices, the distinct vertex uses being counted (2 bytes per vertex,
+ * plus the uses of vertices shared by columns or slabs), normal remaps
+ * (4 bytes per vertex) if normals are computed, and src indices if
+ * triangles do not come from a stream.
+ *
+ * The topology, hence every cell, is the same as with build_from_mesh.
+ * Cells are spilled in an order that does not depend on scheduling. The
+ * grid is left without data, to be mapped from filename.
+ */
+int MeshGrid::build_out_of_core(MBuf &src, Mesh &mesh, ThreadPool &pool,
+				size_t mem_budget, const char *filename,
+				PlyStream *stream)
+{
+	if (cell_budget) {
+		fprintf(stderr, "Error: adaptive mesh grids cannot be built "
+				"out of core.\n");
+		return (EXIT_FAILURE);
+	}
+
+	int res = EXIT_SUCCESS;
+	OocInput in;
+	in.stream = stream;
+	in.copy = NULL;
+	in.indices = src.indices + mesh.index_offset;
+	in.tri_count = mesh.index_count / 3;
+	in.next_tri = 0;
+	in.second_pass = false;
+	in.error = false;
+	TArray<uint32_t> chunk_idx(stream ? 3 * OOC_CHUNK_TRIS : 0);
+	in.buf = chunk_idx.data;
+	if (stream && !(in.copy = tmpfile())) {
+		fprintf(stderr, "Error: cannot create temporary files.\n");
+		return (EXIT_FAILURE);
+	}
+
+	/* Normals of streamed triangles are added by the first pass */
+	TArray<uint32_t> nml_remap;
+	bool add_normals = !(src.vtx_attr & VtxAttr::NML);
+	if (add_normals) {
+		printf("Computing normals.\n");
+		nml_remap.resize(mesh.vertex_count);
+		start_mesh_normals(mesh, src, nml_remap.data, pool);
+	}
+	uint32_t src_vtx_attr = src.vtx_attr;
+	data.vtx_attr = src.vtx_attr | VtxAttr::MAP;
+	int32_t col_count = (1 << (levels - 1)) + 1;
+
+	/**
+	 * Level 0 cells, and triangle count of every level 0 column. Blocks of
+	 * a chunk find their cells in parallel, and only their distinct cells
+	 * go to the table, in triangle order.
+	 */
+	uint32_t chunk_blocks = OOC_CHUNK_TRIS / INIT_CHUNK_TRIS;
+	TArray<CellCoord> chunk_coords(OOC_CHUNK_TRIS);
+	TArray<CellCoord> block_cells(OOC_CHUNK_TRIS);
+	TArray<uint32_t> block_cell_counts(chunk_blocks);
+	TArray<uint8_t> block_errors(chunk_blocks);
+	OocCellsCtx oc;
+	oc.mg = this;
+	oc.positions = src.positions + mesh.vertex_offset;
+	oc.col_count = col_count;
+	oc.coords = chunk_coords.data;
+	oc.block_cells = block_cells.data;
+	oc.block_cell_counts = block_cell_counts.data;
+	oc.block_errors = block_errors.data;
+	oc.tables = (CellTable **)malloc(pool.size() * sizeof(CellTable *));
+	for (int t = 0; t < pool.size(); ++t) {
+		oc.tables[t] = new CellTable(1024);
+	}
+
+	TArray<size_t> col_tris(col_count);
+	TArray<size_t> col_vtx(col_count);
+	for (int32_t x = 0; x < col_count; ++x) {
+		col_tris[x] = 0;
+		col_vtx[x] = 0;
+	}
+	TArray<uint16_t> vtx_cols(mesh.vertex_count);
+	for (uint32_t v = 0; v < mesh.vertex_count; ++v) {
+		vtx_cols[v] = OOC_NO_PART;
+	}
+	/* Vertices shared by columns are the few along their borders */
+	MortonTable *col_uses = new MortonTable(mesh.vertex_count / 32);
+	TArray<CellCoord> coords(0);
+	CellTable cell_table(1024);
+	const uint32_t *indices;
+	size_t tri_num;
+	while (res == EXIT_SUCCESS && (tri_num = ooc_read_chunk(in, &indices))) {
+		uint32_t block_count =
+		    (tri_num + INIT_CHUNK_TRIS - 1) / INIT_CHUNK_TRIS;
+		oc.indices = indices;
+		oc.tri_count = tri_num;
+		pool.parallel_for(block_count, ooc_cells_task, &oc);
+		if (add_normals) {
+			add_mesh_normals(mesh, src, nml_remap.data, indices,
+					 3 * tri_num);
+		}
+
+		for (uint32_t b = 0; b < block_count; ++b) {
+			if (block_errors[b]) {
+				fprintf(stderr,
+					"Error: mesh out of the grid.\n");
+				res = EXIT_FAILURE;
+				break;
+			}
+			size_t begin = (size_t)b * INIT_CHUNK_TRIS;
+			size_t end = MIN(begin + INIT_CHUNK_TRIS, tri_num);
+			for (size_t t = begin; t < end; ++t) {
+				uint16_t x = chunk_coords[t].x;
+				col_tris[x]++;
+				for (uint32_t k = 0; k < 3; ++k) {
+					col_vtx[x] += ooc_first_use(
+					    vtx_cols.data, *col_uses,
+					    indices[3 * t + k], x);
+				}
+			}
+			for (uint32_t i = 0; i < block_cell_counts[b]; ++i) {
+				CellCoord coord = block_cells[begin + i];
+				if (!cell_table.get_or_set(coord, coords.size)) {
+					coords.push_back(coord);
+				}
+			}
+		}
+	}
+	cell_table.clear();
+	vtx_cols.release();
+	delete col_uses;
+	block_cells.release();
+	oc.block_cells = NULL;
+	for (int t = 0; t < pool.size(); ++t) {
+		delete oc.tables[t];
+	}
+	free(oc.tables);
+	if (in.error) {
+		fprintf(stderr, "Error: could not read triangles.\n");
+		res = EXIT_FAILURE;
+	}
+	size_t tri_count = in.next_tri;
+	mesh.index_count = 3 * tri_count;
+	if (add_normals && res == EXIT_SUCCESS) {
+		finish_mesh_normals(mesh, src, nml_remap.data, pool);
+	}
+	nml_remap.release();
+	if (res != EXIT_SUCCESS) {
+		if (in.copy)
+			fclose(in.copy);
+		return (res);
+	}
+
+	/* Cut columns into slabs. Vertices shared by columns of a slab are
+	 * counted by each, which errs on the safe side. Two consecutive slabs
+	 * hold more than slab_bytes, which bounds the number of slabs. */
+	size_t vtx_size = sizeof(uint32_t) + sizeof(Vec3);
+	vtx_size += (src_vtx_attr & VtxAttr::NML) ? sizeof(Vec3) : 0;
+	vtx_size += (src_vtx_attr & VtxAttr::UV0) ? sizeof(Vec2) : 0;
+	vtx_size += (src_vtx_attr & VtxAttr::UV1) ? sizeof(Vec2) : 0;
+	size_t total_bytes = 0;
+	for (int32_t x = 0; x < col_count; ++x) {
+		col_tris[x] = col_tris[x] * 3 * sizeof(uint32_t) +
+			      col_vtx[x] * vtx_size;
+		total_bytes += col_tris[x];
+	}
+	col_vtx.release();
+	size_t slab_bytes = mem_budget / 4;
+	slab_bytes = MAX(slab_bytes, 2 * total_bytes / OOC_MAX_SLABS + 1);
+
+	TArray<uint16_t> col_slabs(col_count);
+	TArray<OocSlab> slabs(0);
+	size_t slab_acc = 0;
+	for (int32_t x = 0; x < col_count; ++x) {
+		if (!slabs.size ||
+		    (slab_acc && slab_acc + col_tris[x] > slab_bytes)) {
+			slabs.push_back(OocSlab{NULL, NULL, 0, 0, 0});
+			slab_acc = 0;
+		}
+		slab_acc += col_tris[x];
+		col_slabs[x] = slabs.size - 1;
+		slabs[slabs.size - 1].x_end = x + 1;
+	}
+	col_tris.release();
+
+	bool files_ok = true;
+	for (uint32_t s = 0; s < slabs.size; ++s) {
+		slabs[s].tris = tmpfile();
+		slabs[s].vtx = tmpfile();
+		files_ok &= slabs[s].tris && slabs[s].vtx;
+	}
+	OocSpill spill = {{NULL}, 0, 0};
+	for (int s = MGS_INDICES; s < MGS_COUNT; ++s) {
+		bool absent =
+		    (s == MGS_NORMALS && !(data.vtx_attr & VtxAttr::NML)) ||
+		    (s == MGS_UV0 && !(data.vtx_attr & VtxAttr::UV0)) ||
+		    (s == MGS_UV1 && !(data.vtx_attr & VtxAttr::UV1));
+		if (absent)
+			continue;
+		spill.files[s] = tmpfile();
+		files_ok &= spill.files[s] != NULL;
+	}
+	if (!files_ok) {
+		fprintf(stderr, "Error: cannot create temporary files.\n");
+		res = EXIT_FAILURE;
+	}
+
+	/* Bin triangles, and the vertices they use, to their slab */
+	in.tri_count = tri_count;
+	in.next_tri = 0;
+	in.second_pass = true;
+	if (in.copy && (fflush(in.copy) || fseek(in.copy, 0, SEEK_SET))) {
+		in.error = true;
+	}
+	TArray<uint16_t> vtx_slabs(mesh.vertex_count);
+	for (uint32_t v = 0; v < mesh.vertex_count; ++v) {
+		vtx_slabs[v] = OOC_NO_PART;
+	}
+	MortonTable *slab_uses = new MortonTable(mesh.vertex_count / 32);
+	bool written = true;
+	while (res == EXIT_SUCCESS && written &&
+	       (tri_num = ooc_read_chunk(in, &indices))) {
+		uint32_t block_count =
+		    (tri_num + INIT_CHUNK_TRIS - 1) / INIT_CHUNK_TRIS;
+		oc.indices = indices;
+		oc.tri_count = tri_num;
+		pool.parallel_for(block_count, ooc_cells_task, &oc);
+
+		for (size_t t = 0; t < tri_num && written; ++t) {
+			uint16_t s = col_slabs[chunk_coords[t].x];
+			OocSlab &slab = slabs[s];
+			written &= fwrite(&indices[3 * t], sizeof(uint32_t), 3,
+					  slab.tris) == 3;
+			slab.tri_count++;
+			for (uint32_t k = 0; k < 3; ++k) {
+				uint32_t v = indices[3 * t + k];
+				if (!ooc_first_use(vtx_slabs.data, *slab_uses,
+						   v, s))
+					continue;
+				written &= write_vertex(slab.vtx, src, v,
+							mesh.vertex_offset + v);
+				slab.vtx_count++;
+			}
+		}
+	}
+	vtx_slabs.release();
+	delete slab_uses;
+	if (in.copy)
+		fclose(in.copy);
+	if (res == EXIT_SUCCESS && (in.error || in.next_tri != tri_count)) {
+		fprintf(stderr, "Error: could not read triangles.\n");
+		res = EXIT_FAILURE;
+	}
+	for (uint32_t s = 0; s < slabs.size && res == EXIT_SUCCESS; ++s) {
+		written &= !fflush(slabs[s].tris) && !fflush(slabs[s].vtx);
+	}
+	if (res == EXIT_SUCCESS && !written) {
+		fprintf(stderr, "Error: failed writing slabs.\n");
+		res = EXIT_FAILURE;
 	}
 
-	/* Compute index offsets and total index count */
+	/* The input mesh lives in the slabs now */
+	src.clear();
 
-	size_t total_index_count = 0;
-
-	for (size_t cell_idx = 0; cell_idx < cells.size; ++cell_idx) {
-		cells[cell_idx].index_offset = total_index_count;
-		total_index_count += cells[cell_idx].index_count;
+	/* Whole topology, level 0 cells in Morton order and the rest */
+	uint32_t cell_count = coords.size;
+	TArray<uint64_t> keys(cell_count);
+	TArray<uint32_t> order(cell_count);
+	for (uint32_t i = 0; i < cell_count; ++i) {
+		keys[i] = cell_morton_key(coords[i]);
+		order[i] = i;
 	}
-
-	assert(total_index_count == mesh.index_count);
-
-	/* Reserve indices */
-	data.reserve_indices(total_index_count);
-
-	/* Reset cells index_count to zero momentarily */
-	for (size_t cell_idx = 0; cell_idx < cells.size; ++cell_idx) {
-		cells[cell_idx].index_count = 0;
+	radix_sort_pairs(keys.data, order.data, cell_count, pool);
+	cells.resize(cell_count);
+	cell_coords.resize(cell_count);
+	cell_errors.resize(cell_count);
+	for (uint32_t i = 0; i < cell_count; ++i) {
+		cell_coords[i] = coords[order[i]];
+		cells[i] = Mesh{0, 0, 0, 0};
+		cell_errors[i] = 0.f;
+	}
+	cell_offsets[0] = 0;
+	cell_counts[0] = cell_count;
+	coords.clear();
+	keys.clear();
+	order.clear();
+
+	MeshGridBuilder builder(*this, pool);
+	builder.init_cells_and_blocks();
+
+	/* A block can be built once every level 0 cell below its children
+	 * is loaded, that is once slabs are loaded up to its x_end. Blocks
+	 * come by level, after the blocks they depend on. */
+	TArray<int32_t> cell_x_end(cells.size);
+	for (uint32_t i = 0; i < cell_count; ++i) {
+		cell_x_end[i] = cell_coords[i].x + 1;
+	}
+	TArray<int32_t> block_x_end(builder.blocks.size);
+	for (uint32_t b = 0; b < builder.blocks.size; ++b) {
+		const BlockCells &bc = builder.block_cells[b];
+		int32_t x_end = 0;
+		for (uint32_t i = 0; i < 8; ++i) {
+			uint32_t pidx = bc.idx[i];
+			if (pidx == ~0u)
+				continue;
+			uint32_t c = cell_first_child[pidx];
+			uint32_t c_end = c + get_child_count(pidx);
+			for (; c < c_end; ++c) {
+				x_end = MAX(x_end, cell_x_end[c]);
+			}
+		}
+		block_x_end[b] = x_end;
+		for (uint32_t i = 0; i < 8; ++i) {
+			if (bc.idx[i] != ~0u)
+				cell_x_end[bc.idx[i]] = x_end;
+		}
 	}
+	cell_x_end.clear();
 
-	/* Reorder indices according to cells (and re-establish index counts) */
-	for (size_t tri_idx = 0; tri_idx < tri_count; ++tri_idx) {
-		Mesh &cell = cells[tri_idx_to_cell_idx[tri_idx]];
+	TArray<uint8_t> cell_state(cells.size);
+	for (uint32_t i = 0; i < cells.size; ++i) {
+		cell_state[i] = OOC_CELL_ABSENT;
+	}
+	TArray<uint8_t> built(builder.blocks.size);
+	for (uint32_t b = 0; b < builder.blocks.size; ++b) {
+		built[b] = 0;
+	}
+	size_t peak_idx = 0;
+	size_t peak_vtx = 0;
+
+	for (uint32_t s = 0; s < slabs.size && res == EXIT_SUCCESS; ++s) {
+		/* Level 0 cells of the slab */
+		MBuf slab_buf;
+		Mesh slab_mesh;
+		if (load_slab(slabs[s], src_vtx_attr, slab_buf, slab_mesh)) {
+			fprintf(stderr, "Error: failed reading slabs.\n");
+			res = EXIT_FAILURE;
+			break;
+		}
+		fclose(slabs[s].tris);
+		fclose(slabs[s].vtx);
+		slabs[s].tris = NULL;
+		slabs[s].vtx = NULL;
+
+		MeshGrid slab_grid(base, step, 0, err_tol);
+		slab_grid.data.vtx_attr = data.vtx_attr;
+		slab_grid.init_from_mesh(slab_buf, slab_mesh, pool);
+		slab_buf.clear();
+
+		uint32_t slab_idx_num = slab_grid.next_index_offset;
+		uint32_t slab_vtx_num = slab_grid.next_vertex_offset;
+		if (slab_idx_num) {
+			data.reserve_indices(next_index_offset + slab_idx_num);
+			data.reserve_vertices(next_vertex_offset +
+					      slab_vtx_num);
+			copy_indices(data, next_index_offset, slab_grid.data,
+				     0, slab_idx_num);
+			copy_vertices(data, next_vertex_offset,
+				      slab_grid.data, 0, slab_vtx_num);
+		}
+		for (uint32_t j = 0; j < slab_grid.cells.size; ++j) {
+			uint32_t idx = search_cell(cell_coords.data, 0,
+						   cell_count,
+						   slab_grid.cell_coords[j]);
+			assert(idx != ~0u);
+			Mesh cell = slab_grid.cells[j];
+			cell.index_offset += next_index_offset;
+			cell.vertex_offset += next_vertex_offset;
+			cells[idx] = cell;
+			cell_state[idx] = OOC_CELL_RESIDENT;
+		}
+		next_index_offset += slab_idx_num;
+		next_vertex_offset += slab_vtx_num;
+		slab_grid.data.clear();
+
+		/* Build the blocks the slab completes, their cells join
+		 * the resident ones */
+		builder.dirty_count = 0;
+		for (uint32_t b = 0; b < builder.blocks.size; ++b) {
+			builder.dirty[b] =
+			    !built[b] && block_x_end[b] <= slabs[s].x_end;
+			builder.dirty_count += builder.dirty[b];
+		}
+		builder.alloc_idx = MAX(slab_idx_num, 3u);
+		builder.alloc_vtx = MAX(slab_vtx_num, 3u);
+		builder.build();
+		for (uint32_t b = 0; b < builder.blocks.size; ++b) {
+			if (!builder.dirty[b])
+				continue;
+			built[b] = 1;
+			for (uint32_t i = 0; i < 8; ++i) {
+				if (builder.block_cells[b].idx[i] != ~0u)
+					cell_state[builder.block_cells[b]
+						       .idx[i]] =
+					    OOC_CELL_RESIDENT;
+			}
+		}
+		peak_idx = MAX(peak_idx, (size_t)next_index_offset);
+		peak_vtx = MAX(peak_vtx, (size_t)next_vertex_offset);
 
-		size_t dst_offset = cell.index_offset + cell.index_count;
-		size_t src_offset = mesh.index_offset + 3 * tri_idx;
-		uint32_t *dst_idx = data.indices + dst_offset;
-		uint32_t *src_idx = src.indices + src_offset;
-		memcpy(dst_idx, src_idx, 3 * sizeof(uint32_t));
+		/* Children of the new cells are final */
+		for (uint32_t b = 0; b < builder.blocks.size; ++b) {
+			if (!builder.dirty[b])
+				continue;
+			const BlockCells &bc = builder.block_cells[b];
+			for (uint32_t i = 0; i < 8; ++i) {
+				uint32_t pidx = bc.idx[i];
+				if (pidx == ~0u)
+					continue;
+				uint32_t c = cell_first_child[pidx];
+				uint32_t c_end = c + get_child_count(pidx);
+				for (; c < c_end; ++c) {
+					assert(cell_state[c] ==
+					       OOC_CELL_RESIDENT);
+					res |= spill_cell(spill, data,
+							  cells[c]);
+					cell_state[c] = OOC_CELL_SPILLED;
+				}
+			}
+		}
+		for (uint32_t i = 0; levels == 1 && i < cell_count; ++i) {
+			if (cell_state[i] != OOC_CELL_RESIDENT)
+				continue;
+			res |= spill_cell(spill, data, cells[i]);
+			cell_state[i] = OOC_CELL_SPILLED;
+		}
 
-		cell.index_count += 3;
+		/* Keep resident data only */
+		MBuf kept;
+		kept.vtx_attr = data.vtx_attr;
+		size_t kept_idx = 0;
+		size_t kept_vtx = 0;
+		for (uint32_t i = 0; i < cells.size; ++i) {
+			if (cell_state[i] != OOC_CELL_RESIDENT)
+				continue;
+			kept_idx += cells[i].index_count;
+			kept_vtx += cells[i].vertex_count;
+		}
+		if (kept_idx) {
+			kept.reserve_indices(kept_idx);
+			kept.reserve_vertices(kept_vtx);
+		}
+		kept_idx = 0;
+		kept_vtx = 0;
+		for (uint32_t i = 0; i < cells.size; ++i) {
+			if (cell_state[i] != OOC_CELL_RESIDENT)
+				continue;
+			Mesh &cell = cells[i];
+			copy_indices(kept, kept_idx, data, cell.index_offset,
+				     cell.index_count);
+			copy_vertices(kept, kept_vtx, data,
+				      cell.vertex_offset, cell.vertex_count);
+			cell.index_offset = kept_idx;
+			cell.vertex_offset = kept_vtx;
+			kept_idx += cell.index_count;
+			kept_vtx += cell.vertex_count;
+		}
+		data.clear();
+		data = kept;
+		next_index_offset = kept_idx;
+		next_vertex_offset = kept_vtx;
 	}
 
-	/* Clean-up */
-	tri_idx_to_cell_idx.clear();
+	/* Top level cells are left */
+	for (uint32_t i = 0; i < cells.size && res == EXIT_SUCCESS; ++i) {
+		if (cell_state[i] != OOC_CELL_RESIDENT)
+			continue;
+		res |= spill_cell(spill, data, cells[i]);
+		cell_state[i] = OOC_CELL_SPILLED;
+	}
+	data.clear();
 
-	/* Reserve vertices (total number is unknown at this point) */
-	size_t vertex_count_guess = mesh.vertex_count + mesh.vertex_count / 4;
-	data.reserve_vertices(vertex_count_guess);
+	for (uint32_t s = 0; s < slabs.size; ++s) {
+		if (slabs[s].tris)
+			fclose(slabs[s].tris);
+		if (slabs[s].vtx)
+			fclose(slabs[s].vtx);
+	}
 
-	/**
-	 * Compute max index_count in cells, this yields also an upper bound
-	 * on max vertex_count per cell
-	 */
-	size_t max_index_count = 0;
-	for (size_t cell_idx = 0; cell_idx < cells.size; ++cell_idx) {
-		if (cells[cell_idx].index_count > max_index_count) {
-			max_index_count = cells[cell_idx].index_count;
+	if (res == EXIT_SUCCESS) {
+		for (uint32_t b = 0; b < builder.blocks.size; ++b) {
+			assert(built[b]);
 		}
+		next_index_offset = spill.idx_count;
+		next_vertex_offset = spill.vtx_count;
+		compute_mean_relative_error();
+		printf("Out of core build : %zu slabs, at most %zu indices and "
+		       "%zu vertices in memory\n",
+		       slabs.size, peak_idx, peak_vtx);
+		printf("Mean relative error : %f\n", mean_relative_error);
+		res = save_mesh_grid(filename, *this, spill.files);
+	} else {
+		fprintf(stderr, "Error: out of core build failed.\n");
 	}
 
-	HashTable<uint32_t, uint32_t> idx_remap(max_index_count);
-	size_t total_vertex_count = 0;
-	for (size_t cell_idx = 0; cell_idx < cells.size; ++cell_idx) {
-		Mesh &cell = cells[cell_idx];
-		cell.vertex_offset = total_vertex_count;
-
-		data.reserve_vertices(total_vertex_count + cell.index_count);
-
-		assert(cell.vertex_count == 0);
-
-		uint32_t *cell_indices = data.indices + cell.index_offset;
-
-		for (size_t i = 0; i < cell.index_count; ++i) {
-			uint32_t old_idx = cell_indices[i];
-			uint32_t new_idx;
-			uint32_t *p = idx_remap.get(old_idx);
-			if (!p) {
-				new_idx = cell.vertex_count;
-				idx_remap.set_at(old_idx, new_idx);
-				size_t idx_s = mesh.vertex_offset + old_idx;
-				size_t idx_d = total_vertex_count;
-				copy_vertices(data, idx_d, src, idx_s, 1);
-				cell.vertex_count++;
-				total_vertex_count++;
-			} else {
-				new_idx = *p;
-			}
-			cell_indices[i] = new_idx;
-		}
-		/* Clear idx_remap for use with next cell */
-		idx_remap.clear();
+	for (int s = MGS_INDICES; s < MGS_COUNT; ++s) {
+		if (spill.files[s])
+			fclose(spill.files[s]);
 	}
 
-	next_index_offset = total_index_count;
-	next_vertex_offset = total_vertex_count;
+	return (res);
 }
 
-void MeshGridBuilder::build_block(CellCoord bcoord)
+template <uint32_t vtx_attr>
+void MeshGridBuilder::build_block(uint32_t block_idx, int thread_id)
 {
+	CellCoord bcoord = blocks[block_idx];
+	const BlockCells &bc = block_cells[block_idx];
+
+	/* Every temporary below, simplifier included, lives in the arena */
+	Arena &arena = arenas[thread_id];
+	arena.reset();
+	bind_meshopt_arena(&arena);
 
 	Mesh *children[8][8];
 
@@ -413,30 +2770,18 @@ void MeshGridBuilder::build_block(CellCoord bcoord)
 	uint32_t max_idx_count = 1;
 	uint32_t max_vtx_count = 1;
 
-	/* Count children for each parent cell in the block */
-	for (uint32_t i = 0; i < 8; ++i) {
-		CellCoord pcoord = bcoord;
-		pcoord.x += (i >> 0) & 1;
-		pcoord.y += (i >> 1) & 1;
-		pcoord.z += (i >> 2) & 1;
-		child_count[i] = mg.get_children(pcoord, children[i]);
-	}
-
-	/* Compute max children error of all parents in block, shall
-	 * be used to saturate parent errors */
+	/* Count children for each parent cell in the block. Compute max
+	 * children error of all parents in block, shall be used to saturate
+	 * parent errors */
 	float saturated_err = 0;
 	for (uint32_t i = 0; i < 8; ++i) {
-		CellCoord pcoord = bcoord;
-		pcoord.x += (i >> 0) & 1;
-		pcoord.y += (i >> 1) & 1;
-		pcoord.z += (i >> 2) & 1;
-		for (int i = 0; i < 8; ++i) {
-			CellCoord ccoord = child_coord(pcoord, i);
-			uint32_t *p = mg.cell_table.get(ccoord);
-			if (p) {
-				saturated_err =
-				    MAX(mg.cell_errors[*p], saturated_err);
-			}
+		uint32_t pidx = bc.idx[i];
+		child_count[i] = (pidx != ~0u) ? mg.get_child_count(pidx) : 0;
+		for (uint32_t j = 0; j < child_count[i]; ++j) {
+			uint32_t cidx = mg.cell_first_child[pidx] + j;
+			children[i][j] = &mg.cells[cidx];
+			saturated_err =
+			    MAX(mg.cell_errors[cidx], saturated_err);
 		}
 	}
 
@@ -461,15 +2806,17 @@ void MeshGridBuilder::build_block(CellCoord bcoord)
 	}
 
 	/* Prepare tmp structures for simplification */
+	assert(mg.data.vtx_attr == vtx_attr);
 	MBuf blk_data;
-	blk_data.vtx_attr = mg.data.vtx_attr;
+	blk_data.vtx_attr = vtx_attr;
+	blk_data.arena = &arena;
 	blk_data.reserve_indices(total_idx_count + 3);
 	blk_data.reserve_vertices(total_vtx_count + 1);
 
-	VertexTable blk_table(total_vtx_count + 16, &blk_data,
-			      blk_data.vtx_attr);
+	TVertexTable<vtx_attr> blk_table(total_vtx_count + 16, &blk_data,
+					 &arena);
 
-	TArray<uint32_t> blk_remap(total_vtx_count);
+	TArray<uint32_t> blk_remap(total_vtx_count, &arena);
 	for (uint32_t l = 0; l < total_vtx_count; ++l) {
 		blk_remap[l] = ~0u;
 	}
@@ -479,14 +2826,16 @@ void MeshGridBuilder::build_block(CellCoord bcoord)
 	/* Join meshes */
 
 	uint32_t *remap = &blk_remap[0];
+	enter_data(thread_id);
 	for (uint32_t i = 0; i < 8; i++) {
 		for (uint32_t j = 0; j < child_count[i]; ++j) {
-			join_mesh_from_vertices(blk_mesh, blk_data,
-						*children[i][j], mg.data,
-						blk_table, remap);
+			join_mesh_from_vertices<vtx_attr>(
+			    blk_mesh, blk_data, *children[i][j], mg.data,
+			    blk_table, remap);
 			remap += children[i][j]->vertex_count;
 		}
 	}
+	leave_data(thread_id);
 
 	for (uint32_t k = 0; k < total_vtx_count; k++) {
 		assert(blk_remap[k] < blk_mesh.vertex_count);
@@ -494,8 +2843,8 @@ void MeshGridBuilder::build_block(CellCoord bcoord)
 
 	/* Simplify group */
 
-	TArray<uint32_t> simp_remap(blk_mesh.vertex_count);
-	TArray<uint32_t> trash(blk_mesh.index_count);
+	TArray<uint32_t> simp_remap(blk_mesh.vertex_count, &arena);
+	TArray<uint32_t> trash(blk_mesh.index_count, &arena);
 	float extent = mg.step * (1 << bcoord.lod);
 	float target_err = mg.err_tol * extent;
 	float simplification_err;
@@ -533,15 +2882,16 @@ void MeshGridBuilder::build_block(CellCoord bcoord)
 	/* Split each parent cell mesh from the block and copy it back
 	 * to the mesh grid buffer data. */
 
-	/* A second temp MBuf is allocated to spend less time inside mutex. */
+	/* A second temp MBuf is allocated to spend less time inside locks. */
 	MBuf pdata;
-	pdata.vtx_attr = mg.data.vtx_attr;
+	pdata.vtx_attr = vtx_attr;
+	pdata.arena = &arena;
 	pdata.reserve_indices(max_idx_count);
 	pdata.reserve_vertices(max_vtx_count + 1);
 	/* We recycle blk_table for pdata */
 	blk_table.set_mesh_data(&pdata);
 
-	TArray<uint32_t> split_remap(blk_mesh.vertex_count);
+	TArray<uint32_t> split_remap(blk_mesh.vertex_count, &arena);
 
 	for (uint32_t i = 0; i < 8; i++) {
 		/* Go forward if this parent cell has no child */
@@ -559,7 +2909,7 @@ void MeshGridBuilder::build_block(CellCoord bcoord)
 		/* Perform the split : */
 
 		/* 1) Copy relevant vertices and fill split_remap */
-		pmesh.vertex_count = copy_unique_vertices(
+		pmesh.vertex_count = copy_unique_vertices<vtx_attr>(
 		    pdata, 0, blk_data, &blk_remap[vtx_offset[i]], vtx_count[i],
 		    blk_table, &split_remap[0]);
 
@@ -588,7 +2938,17 @@ void MeshGridBuilder::build_block(CellCoord bcoord)
 		}
 		pmesh.index_count = p_idx_count;
 
-		/* 3) Record children cells parent map */
+		/* 3) Reserve room for the parent cell in mesh grid buffers,
+		 *    its slot in cells was assigned before the build. */
+		uint32_t cell_idx = bc.idx[i];
+		reserve_data(pmesh.index_count, pmesh.vertex_count,
+			     pmesh.index_offset, pmesh.vertex_offset);
+		mg.cells[cell_idx] = pmesh;
+		mg.cell_errors[cell_idx] = saturated_err;
+
+		enter_data(thread_id);
+
+		/* 4) Record children cells parent map */
 		uint32_t *src_idx = &blk_remap[vtx_offset[i]];
 		for (uint32_t j = 0; j < child_count[i]; ++j) {
 			const Mesh *cmesh = children[i][j];
@@ -601,34 +2961,18 @@ void MeshGridBuilder::build_block(CellCoord bcoord)
 			src_idx += cmesh->vertex_count;
 		}
 
-		/* Write parent cell to mesh grid (protected by mutex) */
-		CellCoord pcoord = bcoord;
-		pcoord.x += (i >> 0) & 1;
-		pcoord.y += (i >> 1) & 1;
-		pcoord.z += (i >> 2) & 1;
-		pthread_mutex_lock(&block_mutex);
-		{
-			pmesh.index_offset = mg.next_index_offset;
-			pmesh.vertex_offset = mg.next_vertex_offset;
-			uint32_t cell_idx = mg.cell_table.size();
-			mg.cell_table.set_at(pcoord, cell_idx);
-			mg.cells.push_back(pmesh);
-			mg.cell_coords.push_back(pcoord);
-			mg.cell_errors.push_back(saturated_err);
-			mg.cell_counts[pcoord.lod]++;
-			mg.next_index_offset += pmesh.index_count;
-			mg.next_vertex_offset += pmesh.vertex_count;
-		}
-		pthread_mutex_unlock(&block_mutex);
-
+		/* 5) Write parent cell to mesh grid */
 		copy_indices(mg.data, pmesh.index_offset, pdata, 0,
 			     pmesh.index_count, 0);
 
 		copy_vertices(mg.data, pmesh.vertex_offset, pdata, 0,
 			      pmesh.vertex_count, 0);
+
+		leave_data(thread_id);
 	}
 	blk_data.clear();
 	pdata.clear();
+	bind_meshopt_arena(NULL);
 }
 
 void MeshGridBuilder::build_parent_cell(CellCoord pcoord)
@@ -715,7 +3059,7 @@ void MeshGridBuilder::build_parent_cell(CellCoord pcoord)
 	tmp_data.clear();
 }
 
-enum Visibility MeshGrid::get_visibility(const float *pvm, CellCoord coord)
+Aabb MeshGrid::get_cell_bounds(CellCoord coord) const
 {
 	Aabb bbox;
 	bbox.min.x = base.x + coord.x * step * (1 << coord.lod);
@@ -725,21 +3069,49 @@ enum Visibility MeshGrid::get_visibility(const float *pvm, CellCoord coord)
 	bbox.max.y = bbox.min.y + step * (1 << coord.lod);
 	bbox.max.z = bbox.min.z + step * (1 << coord.lod);
 
-	return (visibility(bbox, pvm));
+	return (bbox);
 }
 
-struct Candidate {
-	uint32_t idx;
-	uint32_t parent_idx;
-	bool check_visibility;
-};
+enum Visibility MeshGrid::get_visibility(const Frustum &frustum,
+					 CellCoord coord) const
+{
+	return (visibility(get_cell_bounds(coord), frustum));
+}
 
-bool MeshGrid::cell_is_acceptable(const Vec3 &vp, uint32_t idx,
-				  bool continuous_lod, float error_multiplier)
+/* Cells whose bounds are laid out for a bulk visibility test at once */
+#define VISIBILITY_BATCH 64
+
+/* Visibility of the count cells from first on, such as the children of a
+ * cell, the whole batch being classified in a few SIMD passes */
+void MeshGrid::get_visibility(const Frustum &frustum, uint32_t first,
+			      uint32_t count, uint8_t *vis) const
 {
+	float bounds[6][VISIBILITY_BATCH];
+	AabbArrays boxes = {bounds[0], bounds[1], bounds[2],
+			    bounds[3], bounds[4], bounds[5]};
+
+	for (uint32_t i = 0; i < count; i += VISIBILITY_BATCH) {
+		uint32_t n = MIN(VISIBILITY_BATCH, count - i);
+		for (uint32_t j = 0; j < n; ++j) {
+			Aabb bbox = get_cell_bounds(cell_coords[first + i + j]);
+			bounds[0][j] = bbox.min.x;
+			bounds[1][j] = bbox.min.y;
+			bounds[2][j] = bbox.min.z;
+			bounds[3][j] = bbox.max.x;
+			bounds[4][j] = bbox.max.y;
+			bounds[5][j] = bbox.max.z;
+		}
+		visibility(boxes, n, frustum, vis + i);
+	}
+}
 
+/* Distance from the view point to the cell, in cell sizes, and in kappa
+ * the least distance at which the cell is acceptable, times 2 / sqrt(3) */
+float MeshGrid::cell_lod_distance(const Vec3 &vp, uint32_t idx,
+				  bool continuous_lod, float error_multiplier,
+				  float &kappa)
+{
 	CellCoord coord = cell_coords[idx];
-	float kappa;
 
 	// printf("Ratio : %f\n", cell_errors[idx] / mean_relative_error);
 
@@ -758,66 +3130,803 @@ bool MeshGrid::cell_is_acceptable(const Vec3 &vp, uint32_t idx,
 		kappa = error_multiplier * cell_errors[idx];
 	}
 
-	return (2 * norm(diff) / sqrt(3.f) > kappa);
+	return (norm(diff));
 }
 
+bool MeshGrid::cell_is_acceptable(const Vec3 &vp, uint32_t idx,
+				  bool continuous_lod, float error_multiplier)
+{
+	float kappa;
+	float dist = cell_lod_distance(vp, idx, continuous_lod,
+				       error_multiplier, kappa);
+
+	return (2 * dist / sqrt(3.f) > kappa);
+}
+
+/* How far the view point can move without changing whether the cell is
+ * acceptable */
+float MeshGrid::cell_acceptance_margin(const Vec3 &vp, uint32_t idx,
+				       bool continuous_lod,
+				       float error_multiplier)
+{
+	float kappa;
+	float dist = cell_lod_distance(vp, idx, continuous_lod,
+				       error_multiplier, kappa);
+	float size = step * (1 << cell_coords[idx].lod);
+
+	return (fabsf(dist - kappa * sqrt(3.f) / 2) * size);
+}
+
+/* Candidates given to a task of the parallel selection, and least number
+ * of candidates of a level worth waking the pool for */
+#define SELECT_CHUNK 256
+#define SELECT_PARALLEL_MIN 4096
+
+void SelectionContext::reserve(const MeshGrid &mg)
+{
+	to_visit.reserve(mg.cells.size);
+	to_draw.reserve(mg.cells.size);
+	parents.reserve(mg.cells.size);
+	fates.reserve(mg.cells.size);
+	chunk_offsets.reserve(2 * (mg.cells.size / SELECT_CHUNK + 1));
+	refine_heap.reserve(mg.cells.size);
+}
+
+void SelectionContext::clear()
+{
+	to_visit.clear();
+	to_draw.clear();
+	parents.clear();
+	fates.clear();
+	chunk_offsets.clear();
+	refine_heap.clear();
+	/* The outputs no longer match the cut */
+	cut_valid = false;
+}
+
+/* Fates of a candidate cell */
+enum {
+	SELECT_CULLED,
+	SELECT_DRAWN,
+	/* Children are to be visited */
+	SELECT_REFINED,
+};
+
+/* Decides the fate of a candidate, whose visibility is known already.
+ * Only reads the grid, hence it can be called from several threads at
+ * once. */
+uint8_t MeshGrid::select_cell(const Candidate &candi, const Vec3 &vp,
+			      float error_multiplier, bool continuous_lod)
+{
+	/* Frustum */
+	if (candi.vis == Visibility::None)
+		return (SELECT_CULLED);
+
+	/* No refinement possible */
+	if (!cell_child_mask[candi.idx])
+		return (SELECT_DRAWN);
+
+	/* Sufficiently far or sufficiently low error */
+	if (cell_is_acceptable(vp, candi.idx, continuous_lod,
+			       error_multiplier))
+		return (SELECT_DRAWN);
+
+	/* None of the previous -> refine */
+	return (SELECT_REFINED);
+}
+
+/**
+ * Visibility of the children of a cell, all tested at once unless they
+ * are known to be in the frustum : with no frustum, or a parent fully in.
+ */
+static void child_visibility(const MeshGrid &mg, const Frustum *frustum,
+			     uint32_t idx, uint8_t vis, uint8_t *child_vis)
+{
+	uint32_t first_child = mg.cell_first_child[idx];
+	uint32_t child_count = mg.get_child_count(idx);
+	if (frustum && vis != Visibility::Full) {
+		mg.get_visibility(*frustum, first_child, child_count,
+				  child_vis);
+	} else {
+		memset(child_vis, Visibility::Full, child_count);
+	}
+}
+
+/* Appends a candidate to the selection or its children to the traversal,
+ * according to its fate */
+static void apply_fate(const MeshGrid &mg, SelectionContext &sel,
+		       const Frustum *frustum, const Candidate &candi,
+		       uint8_t fate)
+{
+	if (fate == SELECT_CULLED)
+		return;
+
+	if (fate == SELECT_DRAWN) {
+		sel.to_draw.push_back(candi.idx);
+		sel.parents.push_back(candi.parent_idx);
+		return;
+	}
+
+	uint8_t child_vis[8];
+	child_visibility(mg, frustum, candi.idx, candi.vis, child_vis);
+	uint32_t first_child = mg.cell_first_child[candi.idx];
+	uint32_t child_count = mg.get_child_count(candi.idx);
+	for (uint32_t i = 0; i < child_count; ++i) {
+		sel.to_visit.push_back(
+		    {first_child + i, candi.idx, child_vis[i]});
+	}
+}
+
+static void load_top_level(const MeshGrid &mg, SelectionContext &sel,
+			   const Frustum *frustum)
+{
+	/* Load max level cell(s), tested against the frustum at once in
+	 * the room of the fates */
+	uint32_t top = mg.levels - 1;
+	uint32_t first = mg.cell_offsets[top];
+	uint32_t count = mg.cell_counts[top];
+	sel.fates.resize(count);
+	if (frustum) {
+		mg.get_visibility(*frustum, first, count, sel.fates.data);
+	} else {
+		memset(sel.fates.data, Visibility::Full, count);
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		Candidate candi = {first + i, first + i, sel.fates[i]};
+		sel.to_visit.push_back(candi);
+	}
+}
+
+/* Selected cells go to sel.to_draw and sel.parents, which are cleared
+ * first */
 void MeshGrid::select_cells_from_view_point(const Vec3 &vp,
 					    float error_multiplier,
 					    bool continuous_lod,
 					    bool frustum_cull, const float *pvm,
-					    TArray<uint32_t> &to_draw,
-					    TArray<uint32_t> &parents)
+					    SelectionContext &sel)
 {
+	Frustum frustum;
+	if (frustum_cull) {
+		frustum = frustum_from_matrix(pvm);
+	}
+	const Frustum *planes = frustum_cull ? &frustum : nullptr;
 
-	/* TODO avoid malloc in hot rendering loop */
-	TArray<Candidate> to_visit;
+	sel.reserve(*this);
+	sel.clear();
+	load_top_level(*this, sel, planes);
 
-	/* Load max level cell(s) */
-	for (uint32_t i = 0; i < cell_counts[levels - 1]; i++) {
-		uint32_t idx = cell_offsets[levels - 1] + i;
-		Candidate candi = {idx, idx, 1};
-		to_visit.push_back(candi);
+	size_t visited = 0;
+	while (visited < sel.to_visit.size) {
+		Candidate candi = sel.to_visit[visited++];
+		uint8_t fate = select_cell(candi, vp, error_multiplier,
+					   continuous_lod);
+		apply_fate(*this, sel, planes, candi, fate);
 	}
 
-	size_t visited = 0;
+	sel.max_visited = MAX(sel.max_visited, sel.to_visit.size);
+	sel.max_drawn = MAX(sel.max_drawn, sel.to_draw.size);
+}
 
-	while (visited < to_visit.size) {
-		Candidate candi = to_visit[visited++];
-		CellCoord coord = cell_coords[candi.idx];
+struct SelectCtx {
+	MeshGrid *mg;
+	const Vec3 *vp;
+	float error_multiplier;
+	bool continuous_lod;
+	const Frustum *frustum;
+	/* Level being visited */
+	const Candidate *candidates;
+	uint8_t *fates;
+	uint32_t count;
+	/* Number of, then offset to, the cells to draw and to visit next of
+	 * each chunk of candidates */
+	uint32_t *draw_offsets;
+	uint32_t *visit_offsets;
+	/* Outputs */
+	uint32_t *to_draw;
+	uint32_t *parents;
+	Candidate *to_visit;
+};
 
-		/* Frustum */
-		enum Visibility vis = Visibility::Full;
-		if (frustum_cull && candi.check_visibility) {
-			vis = get_visibility(pvm, coord);
-			if (vis == Visibility::None)
-				continue;
+static void select_cells_task(void *ctx, uint32_t chunk, int thread_id)
+{
+	(void)thread_id;
+	SelectCtx *sc = (SelectCtx *)ctx;
+	MeshGrid *mg = sc->mg;
+
+	uint32_t begin = chunk * SELECT_CHUNK;
+	uint32_t end = MIN(begin + SELECT_CHUNK, sc->count);
+	uint32_t draws = 0;
+	uint32_t visits = 0;
+	for (uint32_t i = begin; i < end; ++i) {
+		const Candidate &candi = sc->candidates[i];
+		uint8_t fate = mg->select_cell(
+		    candi, *sc->vp, sc->error_multiplier, sc->continuous_lod);
+		sc->fates[i] = fate;
+		if (fate == SELECT_DRAWN) {
+			draws++;
+		} else if (fate != SELECT_CULLED) {
+			visits += mg->get_child_count(candi.idx);
 		}
+	}
+	sc->draw_offsets[chunk] = draws;
+	sc->visit_offsets[chunk] = visits;
+}
 
-		/* No refinement possible */
-		if (coord.lod == 0) {
-			to_draw.push_back(candi.idx);
-			parents.push_back(candi.parent_idx);
+/* Writes the outcome of a chunk of candidates at its offsets, as
+ * apply_fate would have */
+static void emit_cells_task(void *ctx, uint32_t chunk, int thread_id)
+{
+	(void)thread_id;
+	SelectCtx *sc = (SelectCtx *)ctx;
+	MeshGrid *mg = sc->mg;
+
+	uint32_t begin = chunk * SELECT_CHUNK;
+	uint32_t end = MIN(begin + SELECT_CHUNK, sc->count);
+	uint32_t *to_draw = sc->to_draw + sc->draw_offsets[chunk];
+	uint32_t *parents = sc->parents + sc->draw_offsets[chunk];
+	Candidate *to_visit = sc->to_visit + sc->visit_offsets[chunk];
+	for (uint32_t i = begin; i < end; ++i) {
+		const Candidate &candi = sc->candidates[i];
+		uint8_t fate = sc->fates[i];
+		if (fate == SELECT_CULLED)
+			continue;
+		if (fate == SELECT_DRAWN) {
+			*to_draw++ = candi.idx;
+			*parents++ = candi.parent_idx;
 			continue;
 		}
+		uint8_t child_vis[8];
+		child_visibility(*mg, sc->frustum, candi.idx, candi.vis,
+				 child_vis);
+		uint32_t first_child = mg->cell_first_child[candi.idx];
+		uint32_t child_count = mg->get_child_count(candi.idx);
+		for (uint32_t c = 0; c < child_count; ++c) {
+			*to_visit++ = {first_child + c, candi.idx,
+				       child_vis[c]};
+		}
+	}
+}
+
+static void run_chunks(ThreadPool &pool, uint32_t chunks, ThreadTask task,
+		       SelectCtx *ctx)
+{
+	if (chunks > 1) {
+		pool.parallel_for(chunks, task, ctx);
+	} else if (chunks) {
+		task(ctx, 0, 0);
+	}
+}
+
+/**
+ * Same as the serial selection, with the same result in the same order.
+ *
+ * The traversal goes level by level, small levels being visited serially.
+ * The candidates of a large level are split in chunks, whose fates are
+ * decided in parallel. A prefix sum over chunks then gives where each
+ * chunk writes its cells to draw and to visit next, in the order of the
+ * serial traversal, and chunks write them in parallel.
+ */
+void MeshGrid::select_cells_from_view_point(const Vec3 &vp,
+					    float error_multiplier,
+					    bool continuous_lod,
+					    bool frustum_cull, const float *pvm,
+					    SelectionContext &sel,
+					    ThreadPool &pool)
+{
+	if (pool.size() == 1) {
+		select_cells_from_view_point(vp, error_multiplier,
+					     continuous_lod, frustum_cull, pvm,
+					     sel);
+		return;
+	}
 
-		/* Sufficiently far or sufficiently low error */
-		if (cell_is_acceptable(vp, candi.idx, continuous_lod,
-				       error_multiplier)) {
-			to_draw.push_back(candi.idx);
-			parents.push_back(candi.parent_idx);
+	Frustum frustum;
+	if (frustum_cull) {
+		frustum = frustum_from_matrix(pvm);
+	}
+	const Frustum *planes = frustum_cull ? &frustum : nullptr;
+
+	sel.reserve(*this);
+	sel.clear();
+	load_top_level(*this, sel, planes);
+
+	SelectCtx ctx = {};
+	ctx.mg = this;
+	ctx.vp = &vp;
+	ctx.error_multiplier = error_multiplier;
+	ctx.continuous_lod = continuous_lod;
+	ctx.frustum = planes;
+
+	size_t begin = 0;
+	while (begin < sel.to_visit.size) {
+		size_t end = sel.to_visit.size;
+		uint32_t count = end - begin;
+
+		if (count < SELECT_PARALLEL_MIN) {
+			for (size_t i = begin; i < end; ++i) {
+				Candidate candi = sel.to_visit[i];
+				uint8_t fate = select_cell(
+				    candi, vp, error_multiplier,
+				    continuous_lod);
+				apply_fate(*this, sel, planes, candi, fate);
+			}
+			begin = end;
 			continue;
 		}
 
-		/* None of the previous -> refine */
-		bool check_vis = vis != Visibility::Full;
-		for (int i = 0; i < 8; ++i) {
-			CellCoord ccoord = child_coord(coord, i);
-			uint32_t *p = cell_table.get(ccoord);
-			if (p) {
-				to_visit.push_back({*p, candi.idx, check_vis});
+		uint32_t chunks = (count + SELECT_CHUNK - 1) / SELECT_CHUNK;
+		sel.fates.resize(count);
+		sel.chunk_offsets.resize(2 * chunks);
+		ctx.candidates = sel.to_visit.data + begin;
+		ctx.fates = sel.fates.data;
+		ctx.count = count;
+		ctx.draw_offsets = sel.chunk_offsets.data;
+		ctx.visit_offsets = sel.chunk_offsets.data + chunks;
+		run_chunks(pool, chunks, select_cells_task, &ctx);
+
+		/* Exclusive prefix sums */
+		uint32_t draws = sel.to_draw.size;
+		uint32_t visits = sel.to_visit.size;
+		for (uint32_t c = 0; c < chunks; ++c) {
+			uint32_t d = ctx.draw_offsets[c];
+			uint32_t v = ctx.visit_offsets[c];
+			ctx.draw_offsets[c] = draws;
+			ctx.visit_offsets[c] = visits;
+			draws += d;
+			visits += v;
+		}
+
+		/* Arrays are reserved for all cells, hence neither the level
+		 * nor the outputs move */
+		ctx.to_draw = sel.to_draw.data;
+		ctx.parents = sel.parents.data;
+		ctx.to_visit = sel.to_visit.data;
+		run_chunks(pool, chunks, emit_cells_task, &ctx);
+		sel.to_draw.resize(draws);
+		sel.parents.resize(draws);
+		sel.to_visit.resize(visits);
+		begin = end;
+	}
+
+	sel.max_visited = MAX(sel.max_visited, sel.to_visit.size);
+	sel.max_drawn = MAX(sel.max_drawn, sel.to_draw.size);
+}
+
+/* Epochs are kept in the high bits of the decision stamps */
+#define CUT_MAX_EPOCH (1u << 30)
+/* Visibility of an ancestor laid out in the path but not decided yet */
+#define CUT_UNDECIDED 0xff
+
+struct UpdateCtx {
+	const Vec3 *vp;
+	float error_multiplier;
+	bool continuous_lod;
+	bool frustum_cull;
+	Frustum frustum;
+	/* Distance from the view point to the reference view point */
+	float drift;
+	/* Allowance for rounding errors in acceptance margins */
+	float slack;
+	/* Acceptabilities looked up, and found out of date, this frame */
+	size_t lod_lookups;
+	size_t lod_expired;
+};
+
+/* Starts over from the top level cells, forgetting all decisions */
+static void reset_cut(const MeshGrid &mg, SelectionContext &sel)
+{
+	sel.decisions.resize(mg.cells.size);
+	for (uint32_t i = 0; i < mg.cells.size; ++i) {
+		sel.decisions[i] = {0.f, 0, 0, i};
+	}
+	for (uint32_t i = 0; i < mg.cells.size; ++i) {
+		uint32_t first_child = mg.cell_first_child[i];
+		uint32_t child_count = mg.get_child_count(i);
+		for (uint32_t c = 0; c < child_count; ++c) {
+			sel.decisions[first_child + c].parent = i;
+		}
+	}
+	sel.path.resize(mg.levels);
+
+	TArray<uint32_t> &cut = sel.cuts[sel.cut_side];
+	cut.clear();
+	uint32_t top = mg.levels - 1;
+	for (uint32_t i = 0; i < mg.cell_counts[top]; i++) {
+		cut.push_back(mg.cell_offsets[top] + i);
+	}
+
+	sel.lod_epoch = 1;
+	sel.vis_epoch = 1;
+	sel.rebase = false;
+	sel.cut_valid = true;
+}
+
+/**
+ * Whether the cell is refined, as select_cell would tell, and its
+ * visibility given the one of its parent. Decisions of earlier frames are
+ * reused as long as they hold.
+ */
+static bool cut_refines(MeshGrid &mg, SelectionContext &sel, UpdateCtx &uc,
+			uint32_t idx, uint8_t parent_vis, uint8_t &vis)
+{
+	CellDecision &d = sel.decisions[idx];
+
+	vis = Visibility::Full;
+	if (uc.frustum_cull && parent_vis != Visibility::Full) {
+		if ((d.vis_stamp >> 2) == sel.vis_epoch) {
+			vis = d.vis_stamp & 3;
+		} else {
+			vis = mg.get_visibility(uc.frustum,
+						mg.cell_coords[idx]);
+			d.vis_stamp = (sel.vis_epoch << 2) | vis;
+			sel.tested++;
+		}
+		if (vis == Visibility::None)
+			return (false);
+	}
+
+	if (!mg.cell_child_mask[idx])
+		return (false);
+
+	uc.lod_lookups++;
+	bool current = (d.lod_stamp >> 1) == sel.lod_epoch;
+	if (!current || uc.drift >= d.radius) {
+		uc.lod_expired += current;
+		bool acceptable = mg.cell_is_acceptable(
+		    *uc.vp, idx, uc.continuous_lod, uc.error_multiplier);
+		float margin = mg.cell_acceptance_margin(
+		    *uc.vp, idx, uc.continuous_lod, uc.error_multiplier);
+		/* Radius around the reference view point */
+		d.radius = margin - uc.slack - uc.drift;
+		d.lod_stamp = (sel.lod_epoch << 1) | acceptable;
+		sel.tested++;
+	}
+	sel.min_radius = MIN(sel.min_radius, d.radius);
+
+	return (!(d.lod_stamp & 1));
+}
+
+static void emit_cut_cell(SelectionContext &sel, uint32_t idx, uint8_t vis)
+{
+	sel.cuts[!sel.cut_side].push_back(idx);
+	if (vis != Visibility::None) {
+		sel.to_draw.push_back(idx);
+		sel.parents.push_back(sel.decisions[idx].parent);
+	}
+}
+
+/* Children are decided when popped, their candidates hold the visibility
+ * of their parent */
+static void push_children(const MeshGrid &mg, SelectionContext &sel,
+			  uint32_t idx, uint8_t vis)
+{
+	/* Reversed, to pop them in order */
+	uint32_t first_child = mg.cell_first_child[idx];
+	uint32_t child_count = mg.get_child_count(idx);
+	for (uint32_t c = child_count; c-- > 0;) {
+		sel.to_visit.push_back({first_child + c, idx, vis});
+	}
+}
+
+/* Replaces a refined cell by the cut of its subtree, depth first */
+static void split_cut_cell(MeshGrid &mg, SelectionContext &sel,
+			   UpdateCtx &uc, uint32_t idx, uint8_t vis)
+{
+	sel.to_visit.clear();
+	push_children(mg, sel, idx, vis);
+	while (sel.to_visit.size) {
+		Candidate candi = *sel.to_visit.pop_back();
+		uint8_t child_vis;
+		if (cut_refines(mg, sel, uc, candi.idx, candi.vis,
+				child_vis)) {
+			push_children(mg, sel, candi.idx, child_vis);
+		} else {
+			emit_cut_cell(sel, candi.idx, child_vis);
+		}
+	}
+}
+
+/**
+ * Brings a cell of the last cut up to date : it stays, is merged into the
+ * first ancestor that is no longer refined, or is split. Ancestors are
+ * decided once per frame, on the way to the first cut cell under them,
+ * and kept in sel.path.
+ */
+static void update_cut_cell(MeshGrid &mg, SelectionContext &sel,
+			    UpdateCtx &uc, uint32_t idx)
+{
+	/* Climb to the first ancestor already decided this frame, laying
+	 * the others out in the path */
+	uint32_t lod = mg.cell_coords[idx].lod;
+	uint32_t l = lod;
+	uint32_t x = idx;
+	uint8_t vis = Visibility::Partial;
+	for (;;) {
+		uint32_t p = sel.decisions[x].parent;
+		if (p == x)
+			break;
+		CutPathEntry &pe = sel.path[l + 1];
+		if (pe.idx == p && pe.vis != CUT_UNDECIDED) {
+			/* Merged into p, which is already in the cut */
+			if (!pe.refined)
+				return;
+			vis = pe.vis;
+			break;
+		}
+		pe.idx = p;
+		pe.vis = CUT_UNDECIDED;
+		x = p;
+		l++;
+	}
+
+	/* Decide the ancestors top down */
+	for (; l > lod; --l) {
+		CutPathEntry &pe = sel.path[l];
+		uint8_t parent_vis = vis;
+		pe.refined = cut_refines(mg, sel, uc, pe.idx, parent_vis, vis);
+		pe.vis = vis;
+		if (!pe.refined) {
+			emit_cut_cell(sel, pe.idx, vis);
+			return;
+		}
+	}
+
+	uint8_t parent_vis = vis;
+	if (cut_refines(mg, sel, uc, idx, parent_vis, vis)) {
+		split_cut_cell(mg, sel, uc, idx, vis);
+	} else {
+		emit_cut_cell(sel, idx, vis);
+	}
+}
+
+/**
+ * Same selection as select_cells_from_view_point, in depth first order,
+ * but updated from the cut of the previous call rather than from the top
+ * level. Cells of the last cut are kept, merged or split, and the only
+ * cells tested are the ones whose acceptability may have changed since
+ * the view point moved, plus the visibility of the cut and its ancestors
+ * when the projection changed. The result of the previous call is kept
+ * as is if neither changed enough to matter.
+ *
+ * The context must be used for this grid only, and reset with
+ * sel.clear() when the grid changes.
+ */
+void MeshGrid::update_cells_from_view_point(const Vec3 &vp,
+					    float error_multiplier,
+					    bool continuous_lod,
+					    bool frustum_cull, const float *pvm,
+					    SelectionContext &sel)
+{
+	sel.reserve(*this);
+	sel.cuts[0].reserve(cells.size);
+	sel.cuts[1].reserve(cells.size);
+
+	bool reset = !sel.cut_valid || sel.decisions.size != cells.size ||
+		     sel.cut_error_multiplier != error_multiplier ||
+		     sel.cut_continuous_lod != continuous_lod ||
+		     sel.cut_frustum_cull != frustum_cull ||
+		     MAX(sel.lod_epoch, sel.vis_epoch) + 1 >= CUT_MAX_EPOCH;
+	bool force = reset || sel.rebase;
+	if (reset) {
+		reset_cut(*this, sel);
+		sel.cut_error_multiplier = error_multiplier;
+		sel.cut_continuous_lod = continuous_lod;
+		sel.cut_frustum_cull = frustum_cull;
+	} else if (sel.rebase) {
+		/* Most acceptabilities went out of date, decide them again
+		 * around the current view point */
+		sel.lod_epoch++;
+		sel.rebase = false;
+	}
+	if (force) {
+		sel.ref_vp = vp;
+	}
+
+	bool pvm_changed = false;
+	if (frustum_cull) {
+		pvm_changed = force || memcmp(sel.ref_pvm, pvm,
+					      sizeof(sel.ref_pvm));
+		if (pvm_changed) {
+			sel.vis_epoch++;
+			memcpy(sel.ref_pvm, pvm, sizeof(sel.ref_pvm));
+		}
+	}
+
+	UpdateCtx uc = {};
+	uc.vp = &vp;
+	uc.error_multiplier = error_multiplier;
+	uc.continuous_lod = continuous_lod;
+	uc.frustum_cull = frustum_cull;
+	if (frustum_cull) {
+		uc.frustum = frustum_from_matrix(pvm);
+	}
+	uc.drift = norm(vp - sel.ref_vp);
+	uc.slack = 1e-5f * (norm(vp - base) + step * (1 << (levels - 1)));
+
+	/* Nothing the cut depends on changed */
+	if (!force && !pvm_changed && uc.drift < sel.min_radius) {
+		sel.tested = 0;
+		return;
+	}
+
+	TArray<uint32_t> &cut = sel.cuts[sel.cut_side];
+	sel.cuts[!sel.cut_side].clear();
+	sel.to_draw.clear();
+	sel.parents.clear();
+	for (uint32_t l = 0; l < levels; ++l) {
+		sel.path[l].idx = ~0u;
+	}
+	sel.min_radius = INFINITY;
+	sel.tested = 0;
+
+	for (size_t i = 0; i < cut.size; ++i) {
+		update_cut_cell(*this, sel, uc, cut[i]);
+	}
+	sel.cut_side = !sel.cut_side;
+	sel.rebase = 2 * uc.lod_expired > uc.lod_lookups;
+
+	sel.max_visited = MAX(sel.max_visited, sel.cuts[sel.cut_side].size);
+	sel.max_drawn = MAX(sel.max_drawn, sel.to_draw.size);
+}
+
+/* Higher priority first, then lower index for a deterministic order */
+static inline bool refine_before(const RefineCandidate &a,
+				 const RefineCandidate &b)
+{
+	return (a.priority > b.priority ||
+		(a.priority == b.priority && a.idx < b.idx));
+}
+
+static void heap_push(TArray<RefineCandidate> &heap, RefineCandidate rc)
+{
+	size_t i = heap.size;
+	heap.push_back(rc);
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (!refine_before(rc, heap[parent]))
+			break;
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = rc;
+}
+
+static void heap_pop(TArray<RefineCandidate> &heap)
+{
+	RefineCandidate last = *heap.pop_back();
+	size_t size = heap.size;
+	if (!size)
+		return;
+
+	size_t i = 0;
+	for (;;) {
+		size_t child = 2 * i + 1;
+		if (child >= size)
+			break;
+		if (child + 1 < size &&
+		    refine_before(heap[child + 1], heap[child]))
+			child++;
+		if (!refine_before(heap[child], last))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+}
+
+/**
+ * Projected error of a cell : its error, relative to its size, over its
+ * distance to the view point in cell sizes. Cells around the view point
+ * come first.
+ */
+static float projected_error(MeshGrid &mg, const Vec3 &vp, uint32_t idx)
+{
+	float ratio = mg.cell_view_ratio_dinf(vp, mg.cell_coords[idx]);
+	return (mg.cell_errors[idx] / MAX(ratio, 1e-3f));
+}
+
+/* Draws a visible cell, or queues it for refinement if it can be */
+static void offer_cell(MeshGrid &mg, SelectionContext &sel, const Vec3 &vp,
+		       uint32_t idx, uint32_t parent_idx, uint8_t vis)
+{
+	if (!mg.cell_child_mask[idx]) {
+		sel.to_draw.push_back(idx);
+		sel.parents.push_back(parent_idx);
+		return;
+	}
+	RefineCandidate rc = {projected_error(mg, vp, idx), idx, parent_idx,
+			      vis};
+	heap_push(sel.refine_heap, rc);
+}
+
+/**
+ * Selection under a budget of triangles and vertices drawn, a zero budget
+ * meaning no limit. Starting from the top level, which is drawn whatever
+ * the budget, the visible cell of highest projected error is refined as
+ * long as its visible children fit in the budget. Hence the work done
+ * only depends on the budget, not on the view point, and the error is
+ * spread evenly over the view.
+ */
+void MeshGrid::select_cells_with_budget(const Vec3 &vp, uint32_t tri_budget,
+					uint32_t vtx_budget, bool frustum_cull,
+					const float *pvm,
+					SelectionContext &sel)
+{
+	Frustum frustum;
+	if (frustum_cull) {
+		frustum = frustum_from_matrix(pvm);
+	}
+	const Frustum *planes = frustum_cull ? &frustum : nullptr;
+
+	sel.reserve(*this);
+	sel.clear();
+
+	uint64_t max_tris = tri_budget ? tri_budget : UINT64_MAX;
+	uint64_t max_vtx = vtx_budget ? vtx_budget : UINT64_MAX;
+	uint64_t tris = 0;
+	uint64_t vtx = 0;
+	size_t visited = 0;
+
+	uint32_t top = levels - 1;
+	for (uint32_t i = 0; i < cell_counts[top]; i++) {
+		uint32_t idx = cell_offsets[top] + i;
+		enum Visibility vis = Visibility::Full;
+		visited++;
+		if (frustum_cull) {
+			vis = get_visibility(frustum, cell_coords[idx]);
+			if (vis == Visibility::None)
+				continue;
+		}
+		tris += cells[idx].index_count / 3;
+		vtx += cells[idx].vertex_count;
+		offer_cell(*this, sel, vp, idx, idx, vis);
+	}
+
+	TArray<RefineCandidate> &heap = sel.refine_heap;
+	while (heap.size) {
+		RefineCandidate rc = heap[0];
+		uint32_t first_child = cell_first_child[rc.idx];
+		uint32_t child_count = get_child_count(rc.idx);
+
+		/* Cost of the visible children */
+		uint8_t child_vis[8];
+		child_visibility(*this, planes, rc.idx, rc.vis, child_vis);
+		visited += child_count;
+		uint64_t child_tris = 0;
+		uint64_t child_vtx = 0;
+		for (uint32_t c = 0; c < child_count; ++c) {
+			uint32_t idx = first_child + c;
+			if (child_vis[c] == Visibility::None)
+				continue;
+			child_tris += cells[idx].index_count / 3;
+			child_vtx += cells[idx].vertex_count;
+		}
+
+		uint64_t new_tris = tris - cells[rc.idx].index_count / 3 +
+				    child_tris;
+		uint64_t new_vtx = vtx - cells[rc.idx].vertex_count + child_vtx;
+		if (new_tris > max_tris || new_vtx > max_vtx)
+			break;
+
+		heap_pop(heap);
+		tris = new_tris;
+		vtx = new_vtx;
+		for (uint32_t c = 0; c < child_count; ++c) {
+			if (child_vis[c] != Visibility::None) {
+				offer_cell(*this, sel, vp, first_child + c,
+					   rc.idx, child_vis[c]);
 			}
 		}
 	}
+
+	/* Cells left unrefined */
+	for (size_t i = 0; i < heap.size; ++i) {
+		sel.to_draw.push_back(heap[i].idx);
+		sel.parents.push_back(heap[i].parent_idx);
+	}
+
+	sel.max_visited = MAX(sel.max_visited, visited);
+	sel.max_drawn = MAX(sel.max_drawn, sel.to_draw.size);
 }
 
 /* Ratio between the distance from the view_point to the cell (i.e.
@@ -861,6 +3970,9 @@ void MeshGrid::compute_mean_relative_error()
 	uint32_t count = 0;
 	for (uint32_t l = 1; l < levels; ++l) {
 		for (uint32_t i = 0; i < cell_counts[l]; ++i) {
+			/* Leaves are not simplified */
+			if (!cell_child_mask[cell_offsets[l] + i])
+				continue;
 			error += cell_errors[cell_offsets[l] + i];
 			/*printf("Error at level %d : %f (%d tri)\n", l,
 			       cell_errors[cell_offsets[l] + i],
@@ -869,6 +3981,7 @@ void MeshGrid::compute_mean_relative_error()
 		}
 	}
 	/* Take the mean */
-	error /= count;
+	if (count)
+		error /= count;
 	mean_relative_error = error;
 }
@@ -0,0 +1,452 @@
+#include "mesh_grid_io.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "math_utils.h"
+#include "mesh.h"
+#include "mesh_grid.h"
+
+static inline uint64_t align_up(uint64_t x)
+{
+	const uint64_t mask = MESH_GRID_FILE_ALIGN - 1;
+	return (x + mask) & ~mask;
+}
+
+static int write_padding(FILE *f, uint64_t from, uint64_t to)
+{
+	static const char zeros[MESH_GRID_FILE_ALIGN] = {0};
+
+	assert(to >= from && to - from < MESH_GRID_FILE_ALIGN);
+
+	size_t len = to - from;
+	return (fwrite(zeros, 1, len, f) == len) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Copy size bytes from the start of src to f */
+static int copy_file(FILE *f, FILE *src, uint64_t size)
+{
+	char buf[1 << 16];
+
+	if (fseek(src, 0, SEEK_SET) != 0)
+		return (EXIT_FAILURE);
+	while (size) {
+		size_t len = MIN(size, sizeof(buf));
+		if (fread(buf, 1, len, src) != len ||
+		    fwrite(buf, 1, len, f) != len)
+			return (EXIT_FAILURE);
+		size -= len;
+	}
+
+	return (EXIT_SUCCESS);
+}
+
+int save_mesh_grid(const char *filename, const MeshGrid &mg,
+		   FILE *const *spill)
+{
+	const MBuf &data = mg.data;
+	size_t cell_count = mg.cells.size;
+	size_t idx_count = mg.next_index_offset;
+	size_t vtx_count = mg.next_vertex_offset;
+
+	/* Gather sections content */
+	const void *content[MGS_COUNT];
+	size_t sizes[MGS_COUNT];
+
+	content[MGS_CELL_COORDS] = mg.cell_coords.data;
+	sizes[MGS_CELL_COORDS] = cell_count * sizeof(CellCoord);
+	content[MGS_CELLS] = mg.cells.data;
+	sizes[MGS_CELLS] = cell_count * sizeof(Mesh);
+	content[MGS_CELL_ERRORS] = mg.cell_errors.data;
+	sizes[MGS_CELL_ERRORS] = cell_count * sizeof(float);
+	content[MGS_CELL_OFFSETS] = mg.cell_offsets.data;
+	sizes[MGS_CELL_OFFSETS] = mg.levels * sizeof(uint32_t);
+	content[MGS_CELL_COUNTS] = mg.cell_counts.data;
+	sizes[MGS_CELL_COUNTS] = mg.levels * sizeof(uint32_t);
+	content[MGS_INDICES] = data.indices;
+	sizes[MGS_INDICES] = idx_count * sizeof(uint32_t);
+	content[MGS_POSITIONS] = data.positions;
+	sizes[MGS_POSITIONS] = vtx_count * sizeof(Vec3);
+	content[MGS_NORMALS] = data.normals;
+	sizes[MGS_NORMALS] =
+	    (data.vtx_attr & VtxAttr::NML) ? vtx_count * sizeof(Vec3) : 0;
+	content[MGS_UV0] = data.uv[0];
+	sizes[MGS_UV0] =
+	    (data.vtx_attr & VtxAttr::UV0) ? vtx_count * sizeof(Vec2) : 0;
+	content[MGS_UV1] = data.uv[1];
+	sizes[MGS_UV1] =
+	    (data.vtx_attr & VtxAttr::UV1) ? vtx_count * sizeof(Vec2) : 0;
+	content[MGS_REMAP] = data.remap;
+	sizes[MGS_REMAP] =
+	    (data.vtx_attr & VtxAttr::MAP) ? vtx_count * sizeof(uint32_t) : 0;
+
+	/* Fill header and lay out sections on page boundaries */
+	MeshGridFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MESH_GRID_FILE_MAGIC, sizeof(header.magic));
+	header.version = MESH_GRID_FILE_VERSION;
+	header.vtx_attr = data.vtx_attr;
+	header.base[0] = mg.base.x;
+	header.base[1] = mg.base.y;
+	header.base[2] = mg.base.z;
+	header.step = mg.step;
+	header.levels = mg.levels;
+	header.err_tol = mg.err_tol;
+	header.mean_relative_error = mg.mean_relative_error;
+	header.cell_budget = mg.cell_budget;
+	header.cell_count = cell_count;
+	header.index_count = idx_count;
+	header.vertex_count = vtx_count;
+
+	uint64_t offset = align_up(sizeof(header));
+	for (int s = 0; s < MGS_COUNT; ++s) {
+		header.sections[s].offset = offset;
+		header.sections[s].size = sizes[s];
+		offset = align_up(offset + sizes[s]);
+	}
+
+	/* Write */
+	FILE *f = fopen(filename, "wb");
+	if (!f) {
+		fprintf(stderr, "Error: cannot open %s for writing.\n",
+			filename);
+		return (EXIT_FAILURE);
+	}
+
+	int res = EXIT_SUCCESS;
+	uint64_t pos = 0;
+	if (fwrite(&header, sizeof(header), 1, f) != 1) {
+		res = EXIT_FAILURE;
+	}
+	pos += sizeof(header);
+
+	for (int s = 0; s < MGS_COUNT && res == EXIT_SUCCESS; ++s) {
+		res = write_padding(f, pos, header.sections[s].offset);
+		pos = header.sections[s].offset;
+		if (res == EXIT_SUCCESS && sizes[s]) {
+			if (spill && s >= MGS_INDICES) {
+				res = copy_file(f, spill[s], sizes[s]);
+			} else if (fwrite(content[s], 1, sizes[s], f) !=
+				   sizes[s]) {
+				res = EXIT_FAILURE;
+			}
+		}
+		pos += sizes[s];
+	}
+	/* Pad the tail so that the file size is a multiple of the alignment */
+	if (res == EXIT_SUCCESS) {
+		res = write_padding(f, pos, align_up(pos));
+	}
+
+	if (fclose(f) != 0) {
+		res = EXIT_FAILURE;
+	}
+	if (res != EXIT_SUCCESS) {
+		fprintf(stderr, "Error: failed writing %s.\n", filename);
+	}
+
+	return (res);
+}
+
+const void *MeshGridFile::section(MeshGridSection s) const
+{
+	assert(header && s < MGS_COUNT);
+
+	if (!header->sections[s].size)
+		return nullptr;
+
+	return ((const char *)addr + header->sections[s].offset);
+}
+
+size_t MeshGridFile::section_size(MeshGridSection s) const
+{
+	assert(header && s < MGS_COUNT);
+
+	return (header->sections[s].size);
+}
+
+static bool header_is_valid(const MeshGridFileHeader *h, size_t file_size)
+{
+	if (memcmp(h->magic, MESH_GRID_FILE_MAGIC, sizeof(h->magic)) != 0) {
+		fprintf(stderr, "Error: not a Myosotis mesh grid file.\n");
+		return false;
+	}
+	if (h->version != MESH_GRID_FILE_VERSION) {
+		fprintf(stderr, "Error: unsupported mesh grid version %u.\n",
+			h->version);
+		return false;
+	}
+	if (h->levels == 0 || h->levels > 16) {
+		return false;
+	}
+	/* Offsets into the streams are 32 bits */
+	if (h->index_count > UINT32_MAX || h->vertex_count > UINT32_MAX) {
+		fprintf(stderr, "Error: corrupted mesh grid file.\n");
+		return false;
+	}
+
+	size_t expected[MGS_COUNT];
+	size_t vtx_count = h->vertex_count;
+	expected[MGS_CELL_COORDS] = h->cell_count * sizeof(CellCoord);
+	expected[MGS_CELLS] = h->cell_count * sizeof(Mesh);
+	expected[MGS_CELL_ERRORS] = h->cell_count * sizeof(float);
+	expected[MGS_CELL_OFFSETS] = h->levels * sizeof(uint32_t);
+	expected[MGS_CELL_COUNTS] = h->levels * sizeof(uint32_t);
+	expected[MGS_INDICES] = h->index_count * sizeof(uint32_t);
+	expected[MGS_POSITIONS] = vtx_count * sizeof(Vec3);
+	expected[MGS_NORMALS] =
+	    (h->vtx_attr & VtxAttr::NML) ? vtx_count * sizeof(Vec3) : 0;
+	expected[MGS_UV0] =
+	    (h->vtx_attr & VtxAttr::UV0) ? vtx_count * sizeof(Vec2) : 0;
+	expected[MGS_UV1] =
+	    (h->vtx_attr & VtxAttr::UV1) ? vtx_count * sizeof(Vec2) : 0;
+	expected[MGS_REMAP] =
+	    (h->vtx_attr & VtxAttr::MAP) ? vtx_count * sizeof(uint32_t) : 0;
+
+	for (int s = 0; s < MGS_COUNT; ++s) {
+		const MeshGridFileSection &sec = h->sections[s];
+		if (sec.size != expected[s] ||
+		    sec.offset % MESH_GRID_FILE_ALIGN != 0 ||
+		    sec.offset > file_size ||
+		    sec.size > file_size - sec.offset) {
+			fprintf(stderr, "Error: corrupted mesh grid file.\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Levels must partition the cells, bottom level first, and cells must
+ * reference whole triangles within the index and vertex streams. Cells of
+ * a level must be of that level and in strictly increasing Morton order,
+ * and the levels must form a tree, as MeshGrid::init_cell_index expects.
+ * The sections have been checked against the file size already. Only cells
+ * are read, not the streams they reference.
+ */
+static bool cells_are_valid(const MeshGridFileHeader *h, const char *addr)
+{
+	const uint32_t *offsets =
+	    (const uint32_t *)(addr + h->sections[MGS_CELL_OFFSETS].offset);
+	const uint32_t *counts =
+	    (const uint32_t *)(addr + h->sections[MGS_CELL_COUNTS].offset);
+	const Mesh *cells =
+	    (const Mesh *)(addr + h->sections[MGS_CELLS].offset);
+	const CellCoord *coords =
+	    (const CellCoord *)(addr + h->sections[MGS_CELL_COORDS].offset);
+
+	uint64_t next = 0;
+	for (uint32_t level = 0; level < h->levels; ++level) {
+		if (offsets[level] != next) {
+			fprintf(stderr, "Error: corrupted mesh grid file, "
+					"bad level %u.\n", level);
+			return false;
+		}
+		next += counts[level];
+	}
+	if (next != h->cell_count) {
+		fprintf(stderr, "Error: corrupted mesh grid file, "
+				"levels hold %lu cells out of %u.\n",
+			(unsigned long)next, h->cell_count);
+		return false;
+	}
+
+	for (uint32_t level = 0; level < h->levels; ++level) {
+		uint32_t first = offsets[level];
+		for (uint32_t i = first; i < first + counts[level]; ++i) {
+			if (coords[i].lod != (int16_t)level ||
+			    (i > first && cell_morton_key(coords[i]) <=
+					      cell_morton_key(coords[i - 1]))) {
+				fprintf(stderr, "Error: corrupted mesh grid "
+						"file, bad coordinates of cell "
+						"%u.\n",
+					i);
+				return false;
+			}
+		}
+	}
+
+	/* Walk each level alongside the level below, as init_cell_index.
+	 * Leaf cells may be found above level 0 in adaptive grids only. */
+	for (uint32_t level = 1; level < h->levels; ++level) {
+		uint32_t c = offsets[level - 1];
+		uint32_t c_end = c + counts[level - 1];
+		for (uint32_t i = 0; i < counts[level]; ++i) {
+			uint32_t p = offsets[level] + i;
+			uint32_t c_first = c;
+			while (c < c_end &&
+			       parent_coord(coords[c]) == coords[p]) {
+				c++;
+			}
+			if (c == c_first && !h->cell_budget) {
+				fprintf(stderr, "Error: corrupted mesh grid "
+						"file, cell %u has no "
+						"children.\n",
+					p);
+				return false;
+			}
+		}
+		if (c != c_end) {
+			fprintf(stderr, "Error: corrupted mesh grid file, "
+					"cell %u has no parent.\n",
+				c);
+			return false;
+		}
+	}
+
+	for (uint32_t i = 0; i < h->cell_count; ++i) {
+		const Mesh &cell = cells[i];
+		if (cell.index_count % 3 != 0 ||
+		    (uint64_t)cell.index_offset + cell.index_count >
+			h->index_count ||
+		    (uint64_t)cell.vertex_offset + cell.vertex_count >
+			h->vertex_count) {
+			fprintf(stderr, "Error: corrupted mesh grid file, "
+					"bad cell %u.\n", i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool remap_is_valid(const uint32_t *remap, const Mesh &cell,
+			   uint32_t target_count)
+{
+	for (uint32_t k = 0; k < cell.vertex_count; ++k) {
+		if (remap[cell.vertex_offset + k] >= target_count)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Indices of every cell must stay within the cell vertices, and the remap
+ * of its vertices within the vertices of its parent (its own at the top
+ * level). This reads the whole index and remap streams, hence is only done
+ * on demand, once cells_are_valid holds.
+ */
+static bool streams_are_valid(const MeshGridFileHeader *h, const char *addr)
+{
+	const uint32_t *offsets =
+	    (const uint32_t *)(addr + h->sections[MGS_CELL_OFFSETS].offset);
+	const uint32_t *counts =
+	    (const uint32_t *)(addr + h->sections[MGS_CELL_COUNTS].offset);
+	const Mesh *cells =
+	    (const Mesh *)(addr + h->sections[MGS_CELLS].offset);
+	const CellCoord *coords =
+	    (const CellCoord *)(addr + h->sections[MGS_CELL_COORDS].offset);
+	const uint32_t *indices =
+	    (const uint32_t *)(addr + h->sections[MGS_INDICES].offset);
+	const uint32_t *remap =
+	    (const uint32_t *)(addr + h->sections[MGS_REMAP].offset);
+
+	for (uint32_t i = 0; i < h->cell_count; ++i) {
+		const Mesh &cell = cells[i];
+		for (uint32_t k = 0; k < cell.index_count; ++k) {
+			if (indices[cell.index_offset + k] >=
+			    cell.vertex_count) {
+				fprintf(stderr, "Error: corrupted mesh grid "
+						"file, bad index in cell %u.\n",
+					i);
+				return false;
+			}
+		}
+	}
+	if (!(h->vtx_attr & VtxAttr::MAP))
+		return true;
+
+	uint32_t top = h->levels - 1;
+	for (uint32_t i = 0; i < counts[top]; ++i) {
+		const Mesh &cell = cells[offsets[top] + i];
+		if (!remap_is_valid(remap, cell, cell.vertex_count)) {
+			fprintf(stderr, "Error: corrupted mesh grid file, "
+					"bad remap in cell %u.\n",
+				offsets[top] + i);
+			return false;
+		}
+	}
+	for (uint32_t level = 1; level < h->levels; ++level) {
+		uint32_t c = offsets[level - 1];
+		uint32_t c_end = c + counts[level - 1];
+		for (uint32_t i = 0; i < counts[level]; ++i) {
+			uint32_t p = offsets[level] + i;
+			for (; c < c_end && parent_coord(coords[c]) == coords[p];
+			     ++c) {
+				if (!remap_is_valid(remap, cells[c],
+						    cells[p].vertex_count)) {
+					fprintf(stderr,
+						"Error: corrupted mesh grid "
+						"file, bad remap in cell "
+						"%u.\n",
+						c);
+					return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+int open_mesh_grid_file(const char *filename, MeshGridFile &file,
+			bool verify)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return (EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+	    (size_t)st.st_size < sizeof(MeshGridFileHeader)) {
+		close(fd);
+		return (EXIT_FAILURE);
+	}
+
+	size_t size = st.st_size;
+	void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		close(fd);
+		return (EXIT_FAILURE);
+	}
+
+	const MeshGridFileHeader *header = (const MeshGridFileHeader *)addr;
+	if (!header_is_valid(header, size) ||
+	    !cells_are_valid(header, (const char *)addr) ||
+	    (verify && !streams_are_valid(header, (const char *)addr))) {
+		munmap(addr, size);
+		close(fd);
+		return (EXIT_FAILURE);
+	}
+
+	file.fd = fd;
+	file.addr = addr;
+	file.size = size;
+	file.header = header;
+
+	return (EXIT_SUCCESS);
+}
+
+void close_mesh_grid_file(MeshGridFile &file)
+{
+	if (file.addr) {
+		munmap(file.addr, file.size);
+	}
+	if (file.fd >= 0) {
+		close(file.fd);
+	}
+	file.fd = -1;
+	file.addr = nullptr;
+	file.size = 0;
+	file.header = nullptr;
+}
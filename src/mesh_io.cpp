@@ -1,7 +1,14 @@
 #ifdef DEBUG
 	#include <stdio.h>
 #endif
+#include <ctype.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define FAST_OBJ_IMPLEMENTATION 1
 #include "fast_obj/fast_obj.h"
@@ -10,10 +17,13 @@
 #include "miniply/miniply.h"
 
 #include "array.h"
+#include "group_hash_table.h"
 #include "hash.h"
-#include "hash_table.h"
+#include "math_utils.h"
 #include "mesh.h"
 #include "mesh_io.h"
+#include "sys_utils.h"
+#include "thread_pool.h"
 #include "vec2.h"
 #include "vec3.h"
 
@@ -28,7 +38,8 @@ struct ObjVertexHasher {
 	bool is_empty(fastObjIndex key) const;
 	bool is_equal(fastObjIndex key1, fastObjIndex key2) const;
 };
-typedef HashTable<fastObjIndex, uint32_t, ObjVertexHasher> ObjVertexTable;
+typedef GroupHashTable<fastObjIndex, uint32_t, ObjVertexHasher, true>
+    ObjVertexTable;
 
 inline size_t ObjVertexHasher::hash(fastObjIndex key) const
 {
@@ -160,6 +171,579 @@ int load_obj(const char *filename, MBuf &data, Mesh &mesh)
 	return (res);
 }
 
+/* Parallel OBJ loading splits the file in chunks of about this many bytes,
+ * on line boundaries */
+#define OBJ_CHUNK_SIZE (1 << 22)
+/* Face vertices are welded by blocks of this many */
+#define OBJ_WELD_BLOCK (1 << 16)
+
+struct ObjChunk {
+	const char *begin;
+	const char *end;
+	/* Attributes, faces (of 3 vertices or more) and face vertices of the
+	 * chunk, turned into offsets from the start of the file */
+	size_t v;
+	size_t vt;
+	size_t vn;
+	size_t faces;
+	size_t face_vtx;
+	bool has_normals;
+	bool has_uv;
+	bool error;
+};
+
+struct ObjLoadCtx {
+	ObjChunk *chunks;
+	uint32_t chunk_count;
+	/* Attributes, with a default one at index 0 as in fast_obj */
+	float *positions;
+	float *texcoords;
+	float *normals;
+	size_t v_count;
+	size_t vt_count;
+	size_t vn_count;
+	/* Faces as vertex counts, and their vertices */
+	uint32_t *face_sizes;
+	fastObjIndex *face_vtx;
+	size_t face_vtx_count;
+	/* Face vertices of every shard in order, then the vertex index of
+	 * every face vertex */
+	uint32_t *vtx_ids;
+	/* Face vertices of every weld block and shard, then the offset of
+	 * these in vtx_ids, block major */
+	size_t *shard_counts;
+	/* First face vertex of every shard in vtx_ids, and the end */
+	size_t *shard_firsts;
+	/* Hash shard of every face vertex, then the first face vertex equal
+	 * to it */
+	uint32_t *reps;
+	/* New vertices per weld block, then their first index */
+	size_t *block_firsts;
+	uint32_t block_count;
+	int num_threads;
+	ObjVertexHasher hasher;
+	MBuf *data;
+};
+
+/* Skip the keyword of the line at p, as parse_buffer in fast_obj : type is
+ * 'v', 't', 'n' or 'f' for vertices, texcoords, normals and faces, 0 for
+ * anything else */
+static const char *obj_line_type(const char *p, int &type)
+{
+	p = skip_whitespace(p);
+	type = 0;
+	if (p[0] == 'v') {
+		if (p[1] == ' ' || p[1] == '\t') {
+			type = 'v';
+		} else if (p[1] == 't' || p[1] == 'n') {
+			type = p[1];
+		}
+	} else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+		type = 'f';
+	}
+
+	return (type ? p + 2 : p);
+}
+
+/**
+ * Vertices of the face at p, as parse_face in fast_obj. v, vt and vn count
+ * the attributes before the face, for relative indices. Vertices of faces
+ * of 3 vertices or more are written to out if not NULL. Returns their
+ * number, -1 if malformed.
+ */
+static int obj_face(const char *p, size_t v, size_t vt, size_t vn,
+		    fastObjIndex *out)
+{
+	fastObjIndex first[2];
+	int count = 0;
+
+	p = skip_whitespace(p);
+	while (!is_newline(*p)) {
+		const char *start = p;
+		int iv = 0;
+		int it = 0;
+		int in = 0;
+
+		p = parse_int(p, &iv);
+		if (*p == '/') {
+			p++;
+			if (*p != '/')
+				p = parse_int(p, &it);
+			if (*p == '/') {
+				p++;
+				p = parse_int(p, &in);
+			}
+		}
+		if (p == start)
+			return (-1);
+
+		if (out) {
+			/* Output is only known to be large enough from the
+			 * third vertex on */
+			fastObjIndex &vtx =
+			    (count < 2) ? first[count] : out[count];
+			vtx.p = (iv < 0) ? (fastObjUInt)(v + 1 + iv) : iv;
+			vtx.t = (it < 0) ? (fastObjUInt)(vt + 1 + it) : it;
+			vtx.n = (in < 0) ? (fastObjUInt)(vn + 1 + in) : in;
+			if (count == 2) {
+				out[0] = first[0];
+				out[1] = first[1];
+			}
+		}
+		count++;
+		p = skip_whitespace(p);
+	}
+
+	return (count);
+}
+
+static void obj_count_task(void *ctx, uint32_t c, int thread_id)
+{
+	(void)thread_id;
+
+	ObjLoadCtx *oc = (ObjLoadCtx *)ctx;
+	ObjChunk &chunk = oc->chunks[c];
+	const char *p = chunk.begin;
+
+	while (p < chunk.end) {
+		int type;
+		p = obj_line_type(p, type);
+		if (type == 'v') {
+			chunk.v++;
+		} else if (type == 't') {
+			chunk.vt++;
+		} else if (type == 'n') {
+			chunk.vn++;
+		} else if (type == 'f') {
+			int n = obj_face(p, 0, 0, 0, NULL);
+			if (n < 0) {
+				chunk.error = true;
+			} else if (n >= 3) {
+				chunk.faces++;
+				chunk.face_vtx += n;
+			}
+		}
+		p = skip_line(p);
+	}
+}
+
+static const char *obj_floats(const char *p, float *dst, int num)
+{
+	for (int i = 0; i < num; ++i) {
+		p = parse_float(p, dst + i);
+	}
+
+	return (p);
+}
+
+static void obj_parse_task(void *ctx, uint32_t c, int thread_id)
+{
+	(void)thread_id;
+
+	ObjLoadCtx *oc = (ObjLoadCtx *)ctx;
+	ObjChunk &chunk = oc->chunks[c];
+	size_t v = chunk.v;
+	size_t vt = chunk.vt;
+	size_t vn = chunk.vn;
+	size_t face = chunk.faces;
+	size_t fv = chunk.face_vtx;
+	const char *p = chunk.begin;
+
+	while (p < chunk.end) {
+		int type;
+		p = obj_line_type(p, type);
+		if (type == 'v') {
+			p = obj_floats(p, oc->positions + 3 * (1 + v++), 3);
+		} else if (type == 't') {
+			p = obj_floats(p, oc->texcoords + 2 * (1 + vt++), 2);
+		} else if (type == 'n') {
+			p = obj_floats(p, oc->normals + 3 * (1 + vn++), 3);
+		} else if (type == 'f') {
+			/* Faces are known to be well formed at this point */
+			fastObjIndex *vtx = oc->face_vtx + fv;
+			int n = obj_face(p, v, vt, vn, vtx);
+			if (n >= 3) {
+				for (int i = 0; i < n; ++i) {
+					chunk.error |=
+					    (!vtx[i].p ||
+					     vtx[i].p > oc->v_count ||
+					     vtx[i].t > oc->vt_count ||
+					     vtx[i].n > oc->vn_count);
+					chunk.has_uv |= (vtx[i].t != 0);
+					chunk.has_normals |= (vtx[i].n != 0);
+				}
+				oc->face_sizes[face++] = n;
+				fv += n;
+			}
+		}
+		p = skip_line(p);
+	}
+}
+
+static inline void weld_block_bounds(const ObjLoadCtx *oc, uint32_t b,
+				     size_t &begin, size_t &end)
+{
+	begin = (size_t)b * OBJ_WELD_BLOCK;
+	end = MIN(begin + OBJ_WELD_BLOCK, oc->face_vtx_count);
+}
+
+static void obj_hash_task(void *ctx, uint32_t b, int thread_id)
+{
+	(void)thread_id;
+
+	ObjLoadCtx *oc = (ObjLoadCtx *)ctx;
+	size_t begin, end;
+	weld_block_bounds(oc, b, begin, end);
+
+	size_t *counts = oc->shard_counts + (size_t)b * oc->num_threads;
+	for (int s = 0; s < oc->num_threads; ++s) {
+		counts[s] = 0;
+	}
+	for (size_t i = begin; i < end; ++i) {
+		uint32_t mixed =
+		    oc->hasher.hash(oc->face_vtx[i]) * 2654435761u;
+		uint32_t shard = ((uint64_t)mixed * oc->num_threads) >> 32;
+		oc->reps[i] = shard;
+		counts[shard]++;
+	}
+}
+
+/* Face vertices of a block go to their shard list, in order */
+static void obj_shard_task(void *ctx, uint32_t b, int thread_id)
+{
+	(void)thread_id;
+
+	ObjLoadCtx *oc = (ObjLoadCtx *)ctx;
+	size_t begin, end;
+	weld_block_bounds(oc, b, begin, end);
+
+	size_t *offsets = oc->shard_counts + (size_t)b * oc->num_threads;
+	for (size_t i = begin; i < end; ++i) {
+		oc->vtx_ids[offsets[oc->reps[i]]++] = i;
+	}
+}
+
+/**
+ * Every thread welds the face vertices whose hash falls in its shard, in
+ * order, so that equal ones meet in the same table and the first of them
+ * is known whatever the number of threads.
+ */
+static void obj_weld_job(void *ctx, int thread_id)
+{
+	ObjLoadCtx *oc = (ObjLoadCtx *)ctx;
+	size_t first = oc->shard_firsts[thread_id];
+	size_t last = oc->shard_firsts[thread_id + 1];
+	size_t expected = (last - first) / 6;
+	ObjVertexTable vertices(expected + expected / 2, oc->hasher);
+
+	for (size_t k = first; k < last; ++k) {
+		uint32_t i = oc->vtx_ids[k];
+		uint32_t *rep = vertices.get_or_set(oc->face_vtx[i], i);
+		oc->reps[i] = rep ? *rep : i;
+	}
+}
+
+static void obj_count_vertices_task(void *ctx, uint32_t b, int thread_id)
+{
+	(void)thread_id;
+
+	ObjLoadCtx *oc = (ObjLoadCtx *)ctx;
+	size_t begin, end;
+	weld_block_bounds(oc, b, begin, end);
+
+	size_t count = 0;
+	for (size_t i = begin; i < end; ++i) {
+		count += (oc->reps[i] == i);
+	}
+	oc->block_firsts[b] = count;
+}
+
+/* Vertices are numbered in order of first use, as in load_obj */
+static void obj_copy_vertices_task(void *ctx, uint32_t b, int thread_id)
+{
+	(void)thread_id;
+
+	ObjLoadCtx *oc = (ObjLoadCtx *)ctx;
+	MBuf &data = *oc->data;
+	size_t begin, end;
+	weld_block_bounds(oc, b, begin, end);
+
+	uint32_t vtx_idx = oc->block_firsts[b];
+	for (size_t i = begin; i < end; ++i) {
+		if (oc->reps[i] != i)
+			continue;
+		const fastObjIndex &pnt = oc->face_vtx[i];
+		memcpy(data.positions + vtx_idx, oc->positions + 3 * pnt.p,
+		       3 * sizeof(float));
+		if (data.vtx_attr & VtxAttr::NML) {
+			memcpy(data.normals + vtx_idx, oc->normals + 3 * pnt.n,
+			       3 * sizeof(float));
+		}
+		if (data.vtx_attr & VtxAttr::UV0) {
+			memcpy(data.uv[0] + vtx_idx,
+			       oc->texcoords + 2 * pnt.t, 2 * sizeof(float));
+		}
+		oc->vtx_ids[i] = vtx_idx++;
+	}
+}
+
+static void obj_resolve_task(void *ctx, uint32_t b, int thread_id)
+{
+	(void)thread_id;
+
+	ObjLoadCtx *oc = (ObjLoadCtx *)ctx;
+	size_t begin, end;
+	weld_block_bounds(oc, b, begin, end);
+
+	for (size_t i = begin; i < end; ++i) {
+		oc->vtx_ids[i] = oc->vtx_ids[oc->reps[i]];
+	}
+}
+
+/* Faces are split into fans, as in load_obj */
+static void obj_triangulate_task(void *ctx, uint32_t c, int thread_id)
+{
+	(void)thread_id;
+
+	ObjLoadCtx *oc = (ObjLoadCtx *)ctx;
+	const ObjChunk &chunk = oc->chunks[c];
+	const ObjChunk &next = oc->chunks[c + 1];
+	uint32_t *indices = oc->data->indices;
+
+	size_t fv = chunk.face_vtx;
+	size_t idx = 3 * (chunk.face_vtx - 2 * chunk.faces);
+	for (size_t face = chunk.faces; face < next.faces; ++face) {
+		const uint32_t *ids = oc->vtx_ids + fv;
+		for (uint32_t j = 2; j < oc->face_sizes[face]; ++j) {
+			indices[idx++] = ids[0];
+			indices[idx++] = ids[j - 1];
+			indices[idx++] = ids[j];
+		}
+		fv += oc->face_sizes[face];
+	}
+}
+
+static inline void exclusive_scan(size_t &count, size_t &sum)
+{
+	size_t n = count;
+	count = sum;
+	sum += n;
+}
+
+/* Split [begin, end), which ends with a newline, in chunks of whole lines */
+static void obj_split_chunks(ObjLoadCtx &oc, const char *begin,
+			     const char *end)
+{
+	size_t size = end - begin;
+	uint32_t count = MAX(size / OBJ_CHUNK_SIZE, (size_t)1);
+
+	const char *p = begin;
+	for (uint32_t c = 0; c < count && p < end; ++c) {
+		const char *q = begin + size * (c + 1) / count;
+		if (q <= p) {
+			q = p + 1;
+		}
+		q = (const char *)memchr(q - 1, '\n', end - (q - 1)) + 1;
+		ObjChunk &chunk = oc.chunks[oc.chunk_count++];
+		memset(&chunk, 0, sizeof(chunk));
+		chunk.begin = p;
+		chunk.end = q;
+		p = q;
+	}
+}
+
+/**
+ * Same result as load_obj, with the work shared by the threads of pool.
+ * The file is mapped and split in chunks of lines. A first pass counts the
+ * attributes and faces of every chunk, so that a second one parses them in
+ * place. Face vertices are then sorted to lists by hash shard, welded one
+ * shard per thread, and numbered in order of first use.
+ */
+int load_obj(const char *filename, MBuf &data, Mesh &mesh, ThreadPool &pool)
+{
+	/* Counting and welding by shards only pay off with several threads */
+	if (pool.size() == 1)
+		return (load_obj(filename, data, mesh));
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return (EXIT_FAILURE);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return (EXIT_FAILURE);
+	}
+	size_t size = st.st_size;
+	void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return (EXIT_FAILURE);
+
+	/* Parsing relies on lines ending with a newline : a last line
+	 * without one is parsed from a copy */
+	const char *text = (const char *)addr;
+	const char *body_end = text + size;
+	while (body_end > text && body_end[-1] != '\n') {
+		body_end--;
+	}
+	size_t tail_len = text + size - body_end;
+	char *tail = NULL;
+
+	ObjLoadCtx oc;
+	oc.chunk_count = 0;
+	oc.num_threads = pool.size();
+	oc.data = &data;
+	MALLOC_NUM(oc.chunks, (body_end - text) / OBJ_CHUNK_SIZE + 3);
+	obj_split_chunks(oc, text, body_end);
+	if (tail_len) {
+		MALLOC_NUM(tail, tail_len + 1);
+		memcpy(tail, body_end, tail_len);
+		tail[tail_len] = '\n';
+		ObjChunk &chunk = oc.chunks[oc.chunk_count++];
+		memset(&chunk, 0, sizeof(chunk));
+		chunk.begin = tail;
+		chunk.end = tail + tail_len + 1;
+	}
+
+	/* Count, then turn counts into offsets, an extra chunk holding the
+	 * totals */
+	pool.parallel_for(oc.chunk_count, obj_count_task, &oc);
+	ObjChunk &total = oc.chunks[oc.chunk_count];
+	memset(&total, 0, sizeof(total));
+	for (uint32_t c = 0; c < oc.chunk_count; ++c) {
+		ObjChunk &chunk = oc.chunks[c];
+		total.error |= chunk.error;
+		exclusive_scan(chunk.v, total.v);
+		exclusive_scan(chunk.vt, total.vt);
+		exclusive_scan(chunk.vn, total.vn);
+		exclusive_scan(chunk.faces, total.faces);
+		exclusive_scan(chunk.face_vtx, total.face_vtx);
+	}
+
+	int res = EXIT_SUCCESS;
+	size_t index_count = 3 * (total.face_vtx - 2 * total.faces);
+	if (total.error || !total.faces || index_count > UINT32_MAX) {
+		fprintf(stderr, "Error: malformed or too large OBJ file.\n");
+		res = EXIT_FAILURE;
+	}
+
+	oc.positions = NULL;
+	oc.texcoords = NULL;
+	oc.normals = NULL;
+	oc.face_sizes = NULL;
+	oc.face_vtx = NULL;
+	oc.vtx_ids = NULL;
+	oc.reps = NULL;
+	oc.shard_counts = NULL;
+	oc.shard_firsts = NULL;
+	oc.block_firsts = NULL;
+	if (res == EXIT_SUCCESS) {
+		oc.v_count = total.v;
+		oc.vt_count = total.vt;
+		oc.vn_count = total.vn;
+		oc.face_vtx_count = total.face_vtx;
+		MALLOC_NUM(oc.positions, 3 * (oc.v_count + 1));
+		MALLOC_NUM(oc.texcoords, 2 * (oc.vt_count + 1));
+		MALLOC_NUM(oc.normals, 3 * (oc.vn_count + 1));
+		MALLOC_NUM(oc.face_sizes, total.faces);
+		MALLOC_NUM(oc.face_vtx, oc.face_vtx_count);
+		memset(oc.positions, 0, 3 * sizeof(float));
+		memset(oc.texcoords, 0, 2 * sizeof(float));
+		oc.normals[0] = 0.f;
+		oc.normals[1] = 0.f;
+		oc.normals[2] = 1.f;
+
+		pool.parallel_for(oc.chunk_count, obj_parse_task, &oc);
+
+		bool has_normals = false;
+		bool has_uv = false;
+		bool error = false;
+		for (uint32_t c = 0; c < oc.chunk_count; ++c) {
+			error |= oc.chunks[c].error;
+			has_normals |= oc.chunks[c].has_normals;
+			has_uv |= oc.chunks[c].has_uv;
+		}
+		if (error) {
+			fprintf(stderr, "Error: OBJ index out of range.\n");
+			res = EXIT_FAILURE;
+		}
+
+		data.clear();
+		data.vtx_attr = VtxAttr::P;
+		data.vtx_attr |= has_normals ? VtxAttr::NML : 0;
+		data.vtx_attr |= has_uv ? VtxAttr::UV0 : 0;
+		oc.hasher = ObjVertexHasher{has_normals, has_uv,
+					    (const Vec3 *)oc.positions,
+					    (const Vec3 *)oc.normals,
+					    (const Vec2 *)oc.texcoords};
+	}
+
+	if (res == EXIT_SUCCESS) {
+		oc.block_count = (oc.face_vtx_count + OBJ_WELD_BLOCK - 1) /
+				 OBJ_WELD_BLOCK;
+		MALLOC_NUM(oc.vtx_ids, oc.face_vtx_count);
+		MALLOC_NUM(oc.reps, oc.face_vtx_count);
+		MALLOC_NUM(oc.block_firsts, oc.block_count);
+		MALLOC_NUM(oc.shard_counts,
+			   (size_t)oc.block_count * oc.num_threads);
+		MALLOC_NUM(oc.shard_firsts, oc.num_threads + 1);
+
+		/* Shard lists are laid out shard after shard, blocks in
+		 * order within a shard */
+		pool.parallel_for(oc.block_count, obj_hash_task, &oc);
+		size_t offset = 0;
+		for (int s = 0; s < oc.num_threads; ++s) {
+			oc.shard_firsts[s] = offset;
+			for (uint32_t b = 0; b < oc.block_count; ++b) {
+				exclusive_scan(
+				    oc.shard_counts[(size_t)b * oc.num_threads +
+						    s],
+				    offset);
+			}
+		}
+		oc.shard_firsts[oc.num_threads] = offset;
+		pool.parallel_for(oc.block_count, obj_shard_task, &oc);
+		pool.run(obj_weld_job, &oc);
+		pool.parallel_for(oc.block_count, obj_count_vertices_task,
+				  &oc);
+		size_t vertex_count = 0;
+		for (uint32_t b = 0; b < oc.block_count; ++b) {
+			size_t n = oc.block_firsts[b];
+			oc.block_firsts[b] = vertex_count;
+			vertex_count += n;
+		}
+
+		data.reserve_vertices(vertex_count);
+		pool.parallel_for(oc.block_count, obj_copy_vertices_task,
+				  &oc);
+		pool.parallel_for(oc.block_count, obj_resolve_task, &oc);
+		data.reserve_indices(index_count);
+		pool.parallel_for(oc.chunk_count, obj_triangulate_task, &oc);
+
+		mesh.index_offset = 0;
+		mesh.vertex_offset = 0;
+		mesh.index_count = index_count;
+		mesh.vertex_count = vertex_count;
+	}
+
+	free(oc.block_firsts);
+	free(oc.shard_firsts);
+	free(oc.shard_counts);
+	free(oc.reps);
+	free(oc.vtx_ids);
+	free(oc.face_vtx);
+	free(oc.face_sizes);
+	free(oc.normals);
+	free(oc.texcoords);
+	free(oc.positions);
+	free(oc.chunks);
+	free(tail);
+	munmap(addr, size);
+
+	return (res);
+}
+
 int load_ply(const char *filename, MBuf &data, Mesh &mesh)
 {
 	using namespace miniply;
@@ -245,3 +829,792 @@ int load_ply(const char *filename, MBuf &data, Mesh &mesh)
 
 	return (EXIT_SUCCESS);
 }
+
+enum PlyFormat {
+	PLY_ASCII,
+	PLY_BINARY_LE,
+	PLY_BINARY_BE,
+};
+
+enum PlyType {
+	PLY_INT8,
+	PLY_UINT8,
+	PLY_INT16,
+	PLY_UINT16,
+	PLY_INT32,
+	PLY_UINT32,
+	PLY_FLOAT32,
+	PLY_FLOAT64,
+	PLY_NONE,
+};
+
+static const uint32_t ply_type_sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+
+#define PLY_BUF_SIZE (1 << 20)
+
+/* Larger faces are deemed corrupt */
+#define PLY_MAX_POLYGON 4096
+
+static int ply_parse_type(const char *name)
+{
+	static const char *names[] = {
+	    "char",  "uchar",  "short", "ushort", "int",   "uint",
+	    "float", "double", "int8",  "uint8",  "int16", "uint16",
+	    "int32", "uint32", "float32", "float64"};
+
+	for (int i = 0; i < 16; ++i) {
+		if (strcmp(name, names[i]) == 0)
+			return (i % PLY_NONE);
+	}
+
+	return (-1);
+}
+
+int PlyStream::parse_header()
+{
+	char line[256];
+	char tok[4][PLY_NAME_LEN];
+	bool got_format = false;
+	bool got_faces = false;
+
+	if (!fgets(line, sizeof(line), file) || strncmp(line, "ply", 3) != 0)
+		return (EXIT_FAILURE);
+
+	while (fgets(line, sizeof(line), file)) {
+		int n = sscanf(line, "%31s %31s %31s %31s", tok[0], tok[1],
+			       tok[2], tok[3]);
+		if (n < 1)
+			continue;
+		if (strcmp(tok[0], "end_header") == 0) {
+			if (!got_format || !got_faces)
+				return (EXIT_FAILURE);
+			return (EXIT_SUCCESS);
+		}
+		if (strcmp(tok[0], "format") == 0 && n >= 2) {
+			if (strcmp(tok[1], "ascii") == 0) {
+				format = PLY_ASCII;
+			} else if (strcmp(tok[1], "binary_little_endian") ==
+				   0) {
+				format = PLY_BINARY_LE;
+			} else if (strcmp(tok[1], "binary_big_endian") == 0) {
+				format = PLY_BINARY_BE;
+			} else {
+				return (EXIT_FAILURE);
+			}
+			got_format = true;
+		} else if (strcmp(tok[0], "element") == 0 && n >= 3) {
+			if (element_count == PLY_MAX_ELEMENTS)
+				return (EXIT_FAILURE);
+			PlyElement &elem = elements[element_count++];
+			memcpy(elem.name, tok[1], PLY_NAME_LEN);
+			elem.count = strtoull(tok[2], NULL, 10);
+			elem.prop_count = 0;
+		} else if (strcmp(tok[0], "property") == 0 && n >= 3) {
+			if (!element_count)
+				return (EXIT_FAILURE);
+			PlyElement &elem = elements[element_count - 1];
+			if (elem.prop_count == PLY_MAX_PROPERTIES)
+				return (EXIT_FAILURE);
+			PlyProperty &prop = elem.props[elem.prop_count++];
+			int type;
+			int count_type = PLY_NONE;
+			if (strcmp(tok[1], "list") == 0) {
+				if (n < 4)
+					return (EXIT_FAILURE);
+				count_type = ply_parse_type(tok[2]);
+				type = ply_parse_type(tok[3]);
+				/* The name is the fifth token */
+				if (sscanf(line, "%*s %*s %*s %*s %31s",
+					   prop.name) != 1)
+					return (EXIT_FAILURE);
+			} else {
+				type = ply_parse_type(tok[1]);
+				memcpy(prop.name, tok[2], PLY_NAME_LEN);
+			}
+			if (type < 0 || count_type < 0)
+				return (EXIT_FAILURE);
+			prop.type = type;
+			prop.count_type = count_type;
+			bool is_index =
+			    count_type != PLY_NONE &&
+			    (strcmp(prop.name, "vertex_indices") == 0 ||
+			     strcmp(prop.name, "vertex_index") == 0);
+			if (strcmp(elem.name, "face") == 0 && is_index) {
+				face_elem = element_count - 1;
+				index_prop = elem.prop_count - 1;
+				got_faces = true;
+			}
+		}
+		/* comment, obj_info and the like are ignored */
+	}
+
+	return (EXIT_FAILURE);
+}
+
+/* Make at least num bytes available at buf_pos, returns false when the
+ * file ends before. The buffer is kept null terminated. */
+bool PlyStream::fill(size_t num)
+{
+	if (LIKELY(buf_end - buf_pos >= num))
+		return true;
+
+	memmove(buf, buf + buf_pos, buf_end - buf_pos);
+	buf_end -= buf_pos;
+	buf_pos = 0;
+	buf_end += fread(buf + buf_end, 1, PLY_BUF_SIZE - buf_end, file);
+	buf[buf_end] = '\0';
+
+	return (buf_end - buf_pos >= num);
+}
+
+bool PlyStream::read_value(uint8_t type, double &value)
+{
+	if (format == PLY_ASCII) {
+		for (;;) {
+			if (!fill(1))
+				return false;
+			if (!isspace((unsigned char)buf[buf_pos]))
+				break;
+			buf_pos++;
+		}
+		/* Numbers are shorter than that, the file may end before */
+		fill(64);
+		char *end;
+		value = strtod(buf + buf_pos, &end);
+		if (end == buf + buf_pos)
+			return false;
+		buf_pos = end - buf;
+		return true;
+	}
+
+	uint32_t size = ply_type_sizes[type];
+	uint8_t raw[8];
+	if (!fill(size))
+		return false;
+	memcpy(raw, buf + buf_pos, size);
+	buf_pos += size;
+	if (format == PLY_BINARY_BE) {
+		for (uint32_t i = 0; i < size / 2; ++i) {
+			uint8_t tmp = raw[i];
+			raw[i] = raw[size - 1 - i];
+			raw[size - 1 - i] = tmp;
+		}
+	}
+
+	switch (type) {
+	case PLY_INT8: {
+		int8_t v;
+		memcpy(&v, raw, sizeof(v));
+		value = v;
+		break;
+	}
+	case PLY_UINT8:
+		value = raw[0];
+		break;
+	case PLY_INT16: {
+		int16_t v;
+		memcpy(&v, raw, sizeof(v));
+		value = v;
+		break;
+	}
+	case PLY_UINT16: {
+		uint16_t v;
+		memcpy(&v, raw, sizeof(v));
+		value = v;
+		break;
+	}
+	case PLY_INT32: {
+		int32_t v;
+		memcpy(&v, raw, sizeof(v));
+		value = v;
+		break;
+	}
+	case PLY_UINT32: {
+		uint32_t v;
+		memcpy(&v, raw, sizeof(v));
+		value = v;
+		break;
+	}
+	case PLY_FLOAT32: {
+		float v;
+		memcpy(&v, raw, sizeof(v));
+		value = v;
+		break;
+	}
+	default: {
+		double v;
+		memcpy(&v, raw, sizeof(v));
+		value = v;
+		break;
+	}
+	}
+
+	return true;
+}
+
+bool PlyStream::skip_property(const PlyProperty &prop)
+{
+	double value;
+	uint32_t count = 1;
+
+	if (prop.count_type != PLY_NONE) {
+		if (!read_value(prop.count_type, value))
+			return false;
+		count = value;
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		if (!read_value(prop.type, value))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Slot of every vertex property in a row of positions, normals and uvs
+ * (x y z nx ny nz u v), -1 for others. Returns the mask of slots found.
+ */
+static uint32_t ply_vertex_slots(const PlyElement &elem, int *slots)
+{
+	static const char *names[] = {"x", "y",  "z",  "nx",
+				      "ny", "nz", "u", "v"};
+	static const char *alt_names[] = {"", "", "", "", "", "", "s", "t"};
+
+	uint32_t found = 0;
+	for (uint32_t p = 0; p < elem.prop_count; ++p) {
+		slots[p] = -1;
+		if (elem.props[p].count_type != PLY_NONE)
+			continue;
+		for (int k = 0; k < 8; ++k) {
+			if (strcmp(elem.props[p].name, names[k]) == 0 ||
+			    strcmp(elem.props[p].name, alt_names[k]) == 0) {
+				slots[p] = k;
+				found |= 1 << k;
+			}
+		}
+	}
+
+	return (found);
+}
+
+/* Rows made of scalars only have a fixed size, zero is returned otherwise */
+static size_t ply_row_size(const PlyElement &elem)
+{
+	size_t size = 0;
+	for (uint32_t p = 0; p < elem.prop_count; ++p) {
+		if (elem.props[p].count_type != PLY_NONE)
+			return (0);
+		size += ply_type_sizes[elem.props[p].type];
+	}
+
+	return (size);
+}
+
+/**
+ * Offset of x y z nx ny nz u v in binary vertex rows of scalars, false
+ * unless these are all floats.
+ */
+static bool ply_float_slot_offsets(const PlyElement &elem, const int *slots,
+				   uint32_t *offsets)
+{
+	uint32_t row_offset = 0;
+	for (uint32_t p = 0; p < elem.prop_count; ++p) {
+		uint8_t type = elem.props[p].type;
+		if (elem.props[p].count_type != PLY_NONE ||
+		    (slots[p] >= 0 && type != PLY_FLOAT32))
+			return false;
+		if (slots[p] >= 0)
+			offsets[slots[p]] = row_offset;
+		row_offset += ply_type_sizes[type];
+	}
+
+	return true;
+}
+
+/* Vertices [begin, end) of data from binary little endian rows */
+static void ply_copy_vertex_rows(MBuf &data, size_t begin, size_t end,
+				 const uint8_t *row, size_t stride,
+				 const uint32_t *off)
+{
+	/* Tightly packed positions need no deinterleaving */
+	if (stride == sizeof(Vec3) && data.vtx_attr == VtxAttr::P &&
+	    off[0] == 0 && off[1] == 4 && off[2] == 8) {
+		memcpy(data.positions + begin, row,
+		       (end - begin) * sizeof(Vec3));
+		return;
+	}
+
+	for (size_t i = begin; i < end; ++i, row += stride) {
+		float *pos = &data.positions[i].x;
+		memcpy(pos + 0, row + off[0], sizeof(float));
+		memcpy(pos + 1, row + off[1], sizeof(float));
+		memcpy(pos + 2, row + off[2], sizeof(float));
+		if (data.vtx_attr & VtxAttr::NML) {
+			float *nml = &data.normals[i].x;
+			memcpy(nml + 0, row + off[3], sizeof(float));
+			memcpy(nml + 1, row + off[4], sizeof(float));
+			memcpy(nml + 2, row + off[5], sizeof(float));
+		}
+		if (data.vtx_attr & VtxAttr::UV0) {
+			float *uv = &data.uv[0][i].x;
+			memcpy(uv + 0, row + off[6], sizeof(float));
+			memcpy(uv + 1, row + off[7], sizeof(float));
+		}
+	}
+}
+
+/* Skip num bytes of a binary file */
+bool PlyStream::skip_bytes(size_t num)
+{
+	while (buf_end - buf_pos < num) {
+		num -= buf_end - buf_pos;
+		buf_pos = buf_end;
+		if (!fill(1))
+			return false;
+	}
+	buf_pos += num;
+
+	return true;
+}
+
+int PlyStream::read_vertices(const PlyElement &elem, MBuf &data, Mesh &mesh)
+{
+	int slots[PLY_MAX_PROPERTIES];
+	uint32_t found = ply_vertex_slots(elem, slots);
+	if ((found & 0x7) != 0x7) {
+		fprintf(stderr, "Error: missing vertex positions.\n");
+		return (EXIT_FAILURE);
+	}
+
+	data.vtx_attr = VtxAttr::P;
+	data.vtx_attr |= ((found & 0x38) == 0x38) ? VtxAttr::NML : 0;
+	data.vtx_attr |= ((found & 0xC0) == 0xC0) ? VtxAttr::UV0 : 0;
+	data.reserve_vertices(MAX(elem.count, (size_t)1));
+
+	/* Binary little endian rows of floats are copied as they are, by as
+	 * many as the buffer holds */
+	uint32_t offsets[8];
+	size_t row_size = ply_row_size(elem);
+	bool fast = format == PLY_BINARY_LE && row_size &&
+		    ply_float_slot_offsets(elem, slots, offsets);
+	size_t batch = PLY_BUF_SIZE / MAX(row_size, (size_t)1);
+	for (size_t r = 0; fast && r < elem.count; r += batch) {
+		size_t n = MIN(elem.count - r, batch);
+		if (!fill(n * row_size))
+			return (EXIT_FAILURE);
+		ply_copy_vertex_rows(data, r, r + n,
+				     (const uint8_t *)buf + buf_pos, row_size,
+				     offsets);
+		buf_pos += n * row_size;
+	}
+
+	float row[8] = {0};
+	for (size_t r = 0; !fast && r < elem.count; ++r) {
+		for (uint32_t p = 0; p < elem.prop_count; ++p) {
+			const PlyProperty &prop = elem.props[p];
+			double value;
+			if (slots[p] < 0) {
+				if (!skip_property(prop))
+					return (EXIT_FAILURE);
+			} else if (read_value(prop.type, value)) {
+				row[slots[p]] = value;
+			} else {
+				return (EXIT_FAILURE);
+			}
+		}
+		data.positions[r] = Vec3(row[0], row[1], row[2]);
+		if (data.vtx_attr & VtxAttr::NML)
+			data.normals[r] = Vec3(row[3], row[4], row[5]);
+		if (data.vtx_attr & VtxAttr::UV0)
+			data.uv[0][r] = Vec2(row[6], row[7]);
+	}
+
+	vertex_count = elem.count;
+	positions = data.positions;
+	mesh.vertex_offset = 0;
+	mesh.vertex_count = elem.count;
+
+	return (EXIT_SUCCESS);
+}
+
+int PlyStream::skip_element(const PlyElement &elem)
+{
+	size_t row_size = ply_row_size(elem);
+	if (format != PLY_ASCII && row_size)
+		return (skip_bytes(elem.count * row_size) ? EXIT_SUCCESS
+							   : EXIT_FAILURE);
+
+	for (size_t r = 0; r < elem.count; ++r) {
+		for (uint32_t p = 0; p < elem.prop_count; ++p) {
+			if (!skip_property(elem.props[p]))
+				return (EXIT_FAILURE);
+		}
+	}
+
+	return (EXIT_SUCCESS);
+}
+
+int PlyStream::open(const char *filename, MBuf &data, Mesh &mesh)
+{
+	file = fopen(filename, "rb");
+	if (!file)
+		return (EXIT_FAILURE);
+	if (parse_header()) {
+		fprintf(stderr, "Error: unsupported PLY header.\n");
+		close();
+		return (EXIT_FAILURE);
+	}
+	MALLOC_NUM(buf, PLY_BUF_SIZE + 1);
+	buf_pos = 0;
+	buf_end = 0;
+	buf[0] = '\0';
+
+	/* Load vertices, skip other elements up to faces */
+	bool got_verts = false;
+	for (uint32_t e = 0; e < face_elem; ++e) {
+		int res;
+		if (strcmp(elements[e].name, "vertex") == 0) {
+			res = read_vertices(elements[e], data, mesh);
+			got_verts = true;
+		} else {
+			res = skip_element(elements[e]);
+		}
+		if (res != EXIT_SUCCESS) {
+			close();
+			return (EXIT_FAILURE);
+		}
+	}
+	if (!got_verts) {
+		fprintf(stderr, "Error: PLY faces before vertices.\n");
+		close();
+		return (EXIT_FAILURE);
+	}
+
+	face_count = elements[face_elem].count;
+	faces_left = face_count;
+	init_fast_faces();
+	mesh.index_offset = 0;
+	mesh.index_count = 0;
+
+	return (EXIT_SUCCESS);
+}
+
+/**
+ * Binary little endian faces whose properties, but the vertex index list
+ * of 32 bits integers, are scalars : triangles are then copied straight
+ * from the buffer, without going through read_value.
+ */
+void PlyStream::init_fast_faces()
+{
+	const PlyElement &elem = elements[face_elem];
+	const PlyProperty &index = elem.props[index_prop];
+
+	fast_faces = format == PLY_BINARY_LE &&
+		     index.count_type != PLY_FLOAT32 &&
+		     index.count_type != PLY_FLOAT64 &&
+		     (index.type == PLY_INT32 || index.type == PLY_UINT32);
+	face_head = 0;
+	face_tail = 0;
+	for (uint32_t p = 0; p < elem.prop_count; ++p) {
+		const PlyProperty &prop = elem.props[p];
+		if (p == index_prop)
+			continue;
+		if (prop.count_type != PLY_NONE)
+			fast_faces = false;
+		if (p < index_prop) {
+			face_head += ply_type_sizes[prop.type];
+		} else {
+			face_tail += ply_type_sizes[prop.type];
+		}
+	}
+}
+
+/**
+ * Copy the face at buf_pos to tri if it is a triangle with valid indices,
+ * returns false for anything else, which is left to read_face.
+ */
+bool PlyStream::read_fast_triangle(uint32_t *tri)
+{
+	uint32_t count_size = ply_type_sizes[elements[face_elem]
+						 .props[index_prop]
+						 .count_type];
+	size_t row_size = face_head + count_size + 3 * sizeof(uint32_t) +
+			  face_tail;
+	if (!fill(row_size))
+		return false;
+
+	/* Little endian : the low byte of the count comes first */
+	const char *row = buf + buf_pos;
+	uint32_t count = 0;
+	memcpy(&count, row + face_head, count_size);
+	if (count != 3)
+		return false;
+	memcpy(tri, row + face_head + count_size, 3 * sizeof(uint32_t));
+	if (tri[0] >= vertex_count || tri[1] >= vertex_count ||
+	    tri[2] >= vertex_count)
+		return false;
+	buf_pos += row_size;
+
+	return true;
+}
+
+int PlyStream::read_face(const PlyElement &elem)
+{
+	for (uint32_t p = 0; p < elem.prop_count; ++p) {
+		const PlyProperty &prop = elem.props[p];
+		if (p != index_prop) {
+			if (!skip_property(prop))
+				return (EXIT_FAILURE);
+			continue;
+		}
+		double value;
+		if (!read_value(prop.count_type, value) || value < 3 ||
+		    value > PLY_MAX_POLYGON || value != floor(value))
+			return (EXIT_FAILURE);
+		poly.resize(value);
+		for (size_t i = 0; i < poly.size; ++i) {
+			if (!read_value(prop.type, value) || value < 0 ||
+			    value >= vertex_count)
+				return (EXIT_FAILURE);
+			poly[i] = value;
+		}
+	}
+
+	/* Split as load_ply does, with the same triangles in the same order
+	 * whichever way the file is read */
+	poly_tris.resize(3 * (poly.size - 2));
+	miniply::triangulate_polygon(poly.size, (const float *)positions,
+				     vertex_count, (const int *)poly.data,
+				     (int *)poly_tris.data);
+	poly_next = 0;
+
+	return (EXIT_SUCCESS);
+}
+
+/* Read at most max_tris triangles, fewer only at the end of faces or on
+ * error */
+size_t PlyStream::read_triangles(uint32_t *indices, size_t max_tris)
+{
+	const PlyElement &elem = elements[face_elem];
+	size_t tri_num = 0;
+
+	while (tri_num < max_tris) {
+		if (poly_next < poly_tris.size) {
+			memcpy(indices + 3 * tri_num, &poly_tris[poly_next],
+			       3 * sizeof(uint32_t));
+			poly_next += 3;
+			tri_num++;
+			continue;
+		}
+		if (!faces_left || error)
+			break;
+		faces_left--;
+		if (fast_faces && read_fast_triangle(indices + 3 * tri_num)) {
+			tri_num++;
+			continue;
+		}
+		if (read_face(elem)) {
+			fprintf(stderr, "Error: malformed PLY face.\n");
+			poly_tris.resize(0);
+			error = true;
+		}
+	}
+
+	return (tri_num);
+}
+
+void PlyStream::close()
+{
+	if (file)
+		fclose(file);
+	file = nullptr;
+	MEMFREE(buf);
+	poly.clear();
+	poly_tris.clear();
+}
+
+/* Mapped PLY rows are converted by blocks of this many */
+#define PLY_MAP_BLOCK (1 << 16)
+
+struct PlyMapCtx {
+	/* Vertex rows, and the offset of x y z nx ny nz u v in a row */
+	const uint8_t *vertices;
+	size_t vertex_stride;
+	uint32_t slot_offsets[8];
+	size_t vertex_count;
+	/* Face rows, and the offset of the vertex count of a face */
+	const uint8_t *faces;
+	size_t face_stride;
+	size_t count_offset;
+	uint8_t count_type;
+	size_t face_count;
+	MBuf *data;
+	/* Faces that are not triangles or out of range indices, per block */
+	uint8_t *block_errors;
+};
+
+static void ply_map_vertices_task(void *ctx, uint32_t b, int thread_id)
+{
+	(void)thread_id;
+
+	PlyMapCtx *pm = (PlyMapCtx *)ctx;
+	size_t begin = (size_t)b * PLY_MAP_BLOCK;
+	size_t end = MIN(begin + PLY_MAP_BLOCK, pm->vertex_count);
+
+	ply_copy_vertex_rows(*pm->data, begin, end,
+			     pm->vertices + begin * pm->vertex_stride,
+			     pm->vertex_stride, pm->slot_offsets);
+}
+
+static void ply_map_faces_task(void *ctx, uint32_t b, int thread_id)
+{
+	(void)thread_id;
+
+	PlyMapCtx *pm = (PlyMapCtx *)ctx;
+	uint32_t *indices = pm->data->indices;
+	size_t begin = (size_t)b * PLY_MAP_BLOCK;
+	size_t end = MIN(begin + PLY_MAP_BLOCK, pm->face_count);
+	const uint8_t *row =
+	    pm->faces + begin * pm->face_stride + pm->count_offset;
+	uint32_t count_size = ply_type_sizes[pm->count_type];
+
+	bool error = false;
+	for (size_t f = begin; f < end; ++f, row += pm->face_stride) {
+		/* Little endian : the low byte of the count comes first */
+		uint32_t count = 0;
+		memcpy(&count, row, count_size);
+		error |= (count != 3);
+
+		uint32_t *tri = indices + 3 * f;
+		memcpy(tri, row + count_size, 3 * sizeof(uint32_t));
+		error |= (tri[0] >= pm->vertex_count ||
+			  tri[1] >= pm->vertex_count ||
+			  tri[2] >= pm->vertex_count);
+	}
+	pm->block_errors[b] = error;
+}
+
+/**
+ * Fast path of load_ply for the common layout of binary little endian
+ * files : vertices of float properties, then faces that are all triangles
+ * of 32 bits indices, with only fixed size elements in between. The file is
+ * mapped and rows are converted in parallel straight from the mapping. Any
+ * other file goes through load_ply.
+ */
+int load_ply(const char *filename, MBuf &data, Mesh &mesh, ThreadPool &pool)
+{
+	PlyStream header;
+	header.file = fopen(filename, "rb");
+	if (!header.file)
+		return (EXIT_FAILURE);
+	int res = header.parse_header();
+	long data_offset = ftell(header.file);
+	header.close();
+	if (res || header.format != PLY_BINARY_LE)
+		return (load_ply(filename, data, mesh));
+
+	/* Locate vertices and faces */
+	PlyMapCtx pm;
+	const PlyElement &face_elem = header.elements[header.face_elem];
+	const PlyElement *vertex_elem = NULL;
+	size_t vertex_offset = 0;
+	size_t offset = data_offset;
+	for (uint32_t e = 0; e < header.face_elem; ++e) {
+		const PlyElement &elem = header.elements[e];
+		size_t row_size = ply_row_size(elem);
+		if (!row_size)
+			return (load_ply(filename, data, mesh));
+		if (strcmp(elem.name, "vertex") == 0) {
+			vertex_elem = &elem;
+			vertex_offset = offset;
+			pm.vertex_stride = row_size;
+		}
+		offset += elem.count * row_size;
+	}
+	if (!vertex_elem || !vertex_elem->count || !face_elem.count ||
+	    vertex_elem->count > UINT32_MAX ||
+	    face_elem.count > UINT32_MAX / 3)
+		return (load_ply(filename, data, mesh));
+
+	int slots[PLY_MAX_PROPERTIES];
+	uint32_t found = ply_vertex_slots(*vertex_elem, slots);
+	if (!ply_float_slot_offsets(*vertex_elem, slots, pm.slot_offsets) ||
+	    (found & 0x7) != 0x7)
+		return (load_ply(filename, data, mesh));
+
+	pm.face_stride = 0;
+	for (uint32_t p = 0; p < face_elem.prop_count; ++p) {
+		const PlyProperty &prop = face_elem.props[p];
+		if (p == header.index_prop) {
+			if (prop.count_type == PLY_FLOAT32 ||
+			    prop.count_type == PLY_FLOAT64 ||
+			    (prop.type != PLY_INT32 && prop.type != PLY_UINT32))
+				return (load_ply(filename, data, mesh));
+			pm.count_offset = pm.face_stride;
+			pm.count_type = prop.count_type;
+			pm.face_stride += ply_type_sizes[prop.count_type] +
+					  3 * sizeof(uint32_t);
+		} else if (prop.count_type != PLY_NONE) {
+			return (load_ply(filename, data, mesh));
+		} else {
+			pm.face_stride += ply_type_sizes[prop.type];
+		}
+	}
+
+	/* Map the file, which must be long enough for triangles only */
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return (EXIT_FAILURE);
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+	    (size_t)st.st_size < offset + face_elem.count * pm.face_stride) {
+		close(fd);
+		return (load_ply(filename, data, mesh));
+	}
+	size_t size = st.st_size;
+	void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return (EXIT_FAILURE);
+
+	pm.vertices = (const uint8_t *)addr + vertex_offset;
+	pm.vertex_count = vertex_elem->count;
+	pm.faces = (const uint8_t *)addr + offset;
+	pm.face_count = face_elem.count;
+	pm.data = &data;
+
+	data.clear();
+	data.vtx_attr = VtxAttr::P;
+	data.vtx_attr |= ((found & 0x38) == 0x38) ? VtxAttr::NML : 0;
+	data.vtx_attr |= ((found & 0xC0) == 0xC0) ? VtxAttr::UV0 : 0;
+	data.reserve_vertices(pm.vertex_count);
+	data.reserve_indices(3 * pm.face_count);
+
+	uint32_t vertex_blocks =
+	    (pm.vertex_count + PLY_MAP_BLOCK - 1) / PLY_MAP_BLOCK;
+	uint32_t face_blocks =
+	    (pm.face_count + PLY_MAP_BLOCK - 1) / PLY_MAP_BLOCK;
+	MALLOC_NUM(pm.block_errors, face_blocks);
+	pool.parallel_for(vertex_blocks, ply_map_vertices_task, &pm);
+	pool.parallel_for(face_blocks, ply_map_faces_task, &pm);
+	munmap(addr, size);
+
+	bool error = false;
+	for (uint32_t b = 0; b < face_blocks; ++b) {
+		error |= pm.block_errors[b];
+	}
+	free(pm.block_errors);
+	/* Polygons need the general path, that splits them */
+	if (error) {
+		data.clear();
+		data.vtx_attr = VtxAttr::P;
+		return (load_ply(filename, data, mesh));
+	}
+
+	mesh.vertex_offset = 0;
+	mesh.vertex_count = pm.vertex_count;
+	mesh.index_offset = 0;
+	mesh.index_count = 3 * pm.face_count;
+
+	return (EXIT_SUCCESS);
+}
@@ -9,7 +9,9 @@
 #include "aabb.h"
 #include "array.h"
 #include "geometry.h"
+#include "math_utils.h"
 #include "mesh.h"
+#include "thread_pool.h"
 #include "vec3.h"
 #include "vertex_remap.h"
 #include "vertex_table.h"
@@ -39,7 +41,8 @@ Aabb compute_mesh_bounds(const Mesh &mesh, const MBuf &data)
 	return (compute_mesh_bounds(positions, vertex_count));
 }
 
-void compute_mesh_normals(const Mesh &mesh, MBuf &data)
+/* Normals set to zero for mesh vertices, allocated if missing */
+static Vec3 *clear_mesh_normals(const Mesh &mesh, MBuf &data)
 {
 	if (!(data.vtx_attr & VtxAttr::NML)) {
 
@@ -48,20 +51,19 @@ void compute_mesh_normals(const Mesh &mesh, MBuf &data)
 		data.vtx_attr |= VtxAttr::NML;
 	}
 
-	uint32_t *indices = data.indices + mesh.index_offset;
-	const Vec3 *positions = data.positions + mesh.vertex_offset;
 	Vec3 *normals = data.normals + mesh.vertex_offset;
-
-	/* Init normals to zero */
 	for (size_t i = 0; i < mesh.vertex_count; ++i) {
 		normals[i] = Vec3::Zero;
 	}
 
-	TArray<uint32_t> remap(mesh.vertex_count);
-	build_position_remap(mesh, data, &remap[0]);
-	// build_vertex_remap_old(mesh, data, VtxAttr::P, &remap[0]);
+	return (normals);
+}
 
-	for (size_t i = 0; i < mesh.index_count; i += 3) {
+static void accumulate_normals(const uint32_t *indices, size_t index_count,
+			       const Vec3 *positions, const uint32_t *remap,
+			       Vec3 *normals)
+{
+	for (size_t i = 0; i < index_count; i += 3) {
 		const Vec3 v1 = positions[indices[i + 0]];
 		const Vec3 v2 = positions[indices[i + 1]];
 		const Vec3 v3 = positions[indices[i + 2]];
@@ -74,9 +76,13 @@ void compute_mesh_normals(const Mesh &mesh, MBuf &data)
 		normals[remap[indices[i + 1]]] += n;
 		normals[remap[indices[i + 2]]] += n;
 	}
+}
 
-	/* Normalize remap targets and copy them to remap sources */
-	for (size_t i = 0; i < mesh.vertex_count; ++i) {
+/* Normalize remap targets and copy them to remap sources */
+static void normalize_normals(const uint32_t *remap, size_t vertex_count,
+			      Vec3 *normals)
+{
+	for (size_t i = 0; i < vertex_count; ++i) {
 		if (remap[i] == i) {
 			normals[i] = normalized(normals[i]);
 		} else {
@@ -86,6 +92,311 @@ void compute_mesh_normals(const Mesh &mesh, MBuf &data)
 	}
 }
 
+void compute_mesh_normals(const Mesh &mesh, MBuf &data)
+{
+	Vec3 *normals = clear_mesh_normals(mesh, data);
+	const uint32_t *indices = data.indices + mesh.index_offset;
+	const Vec3 *positions = data.positions + mesh.vertex_offset;
+
+	TArray<uint32_t> remap(mesh.vertex_count);
+	build_position_remap(mesh, data, &remap[0]);
+	// build_vertex_remap_old(mesh, data, VtxAttr::P, &remap[0]);
+
+	accumulate_normals(indices, mesh.index_count, positions, &remap[0],
+			   normals);
+	normalize_normals(&remap[0], mesh.vertex_count, normals);
+}
+
+/**
+ * Parallel compute_mesh_normals, with the same result bit for bit. Remap
+ * targets are split in shards of consecutive vertices, each owned by one
+ * task, which adds the normals of their corners in triangle order as the
+ * serial loop does. Corners are sorted by shard (a stable counting sort)
+ * for that purpose, batch of triangles by batch to bound temporaries.
+ */
+
+/* Triangles per batch, and per block of the counting sort */
+#define NORMALS_BATCH_TRIS (1 << 22)
+#define NORMALS_BLOCK_TRIS (1 << 14)
+/* Vertices per block of the other passes */
+#define NORMALS_VTX_BLOCK (1 << 16)
+#define NORMALS_MAX_SHARDS 256
+
+struct NormalsCtx {
+	const Vec3 *positions;
+	const uint32_t *remap;
+	Vec3 *normals;
+	size_t vertex_count;
+	uint32_t *const *idx_chunks;
+	size_t chunk_tris;
+	/* Current batch of triangles, and its blocks */
+	size_t batch_begin;
+	size_t batch_end;
+	uint32_t block_count;
+	/* Remap targets [s << shard_shift, (s + 1) << shard_shift) make
+	 * shard s */
+	uint32_t shard_shift;
+	uint32_t shard_count;
+	/* Corners per shard and block, then their offsets, shard major */
+	size_t *offsets;
+	/* Normals of batch triangles, and corners sorted by shard as a
+	 * triangle of the batch and a remap target */
+	Vec3 *face_normals;
+	uint32_t *corner_tris;
+	uint32_t *corner_targets;
+};
+
+static void block_tris(const NormalsCtx *nc, uint32_t b, size_t &begin,
+		       size_t &end)
+{
+	begin = nc->batch_begin + (size_t)b * NORMALS_BLOCK_TRIS;
+	end = MIN(begin + NORMALS_BLOCK_TRIS, nc->batch_end);
+}
+
+static void block_vertices(const NormalsCtx *nc, uint32_t b, size_t &begin,
+			   size_t &end)
+{
+	begin = (size_t)b * NORMALS_VTX_BLOCK;
+	end = MIN(begin + NORMALS_VTX_BLOCK, nc->vertex_count);
+}
+
+/* Indices of triangle t, left receiving the number of triangles from t on
+ * in its chunk */
+static inline const uint32_t *tri_indices(const NormalsCtx *nc, size_t t,
+					  size_t &left)
+{
+	left = nc->chunk_tris - t % nc->chunk_tris;
+	return (nc->idx_chunks[t / nc->chunk_tris] +
+		3 * (t % nc->chunk_tris));
+}
+
+static void face_normals_task(void *ctx, uint32_t b, int thread_id)
+{
+	(void)thread_id;
+
+	NormalsCtx *nc = (NormalsCtx *)ctx;
+	size_t begin, end;
+	block_tris(nc, b, begin, end);
+
+	size_t counts[NORMALS_MAX_SHARDS] = {0};
+	size_t left;
+	const uint32_t *tri = tri_indices(nc, begin, left);
+	for (size_t t = begin; t < end; ++t, tri += 3, --left) {
+		if (!left)
+			tri = tri_indices(nc, t, left);
+
+		const Vec3 v1 = nc->positions[tri[0]];
+		const Vec3 v2 = nc->positions[tri[1]];
+		const Vec3 v3 = nc->positions[tri[2]];
+
+		/* Weight normals by triangle area */
+		nc->face_normals[t - nc->batch_begin] = cross(v2 - v1, v3 - v1);
+		for (int k = 0; k < 3; ++k) {
+			counts[nc->remap[tri[k]] >> nc->shard_shift]++;
+		}
+	}
+
+	for (uint32_t s = 0; s < nc->shard_count; ++s) {
+		nc->offsets[(size_t)s * nc->block_count + b] = counts[s];
+	}
+}
+
+static void scatter_corners_task(void *ctx, uint32_t b, int thread_id)
+{
+	(void)thread_id;
+
+	NormalsCtx *nc = (NormalsCtx *)ctx;
+	size_t begin, end;
+	block_tris(nc, b, begin, end);
+
+	size_t offsets[NORMALS_MAX_SHARDS];
+	for (uint32_t s = 0; s < nc->shard_count; ++s) {
+		offsets[s] = nc->offsets[(size_t)s * nc->block_count + b];
+	}
+
+	size_t left;
+	const uint32_t *tri = tri_indices(nc, begin, left);
+	for (size_t t = begin; t < end; ++t, tri += 3, --left) {
+		if (!left)
+			tri = tri_indices(nc, t, left);
+
+		for (int k = 0; k < 3; ++k) {
+			uint32_t target = nc->remap[tri[k]];
+			size_t pos = offsets[target >> nc->shard_shift]++;
+			nc->corner_tris[pos] = t - nc->batch_begin;
+			nc->corner_targets[pos] = target;
+		}
+	}
+}
+
+static void accumulate_shard_task(void *ctx, uint32_t s, int thread_id)
+{
+	(void)thread_id;
+
+	NormalsCtx *nc = (NormalsCtx *)ctx;
+	size_t begin = nc->offsets[(size_t)s * nc->block_count];
+	size_t end = (s + 1 < nc->shard_count)
+			 ? nc->offsets[(size_t)(s + 1) * nc->block_count]
+			 : 3 * (nc->batch_end - nc->batch_begin);
+
+	for (size_t i = begin; i < end; ++i) {
+		nc->normals[nc->corner_targets[i]] +=
+		    nc->face_normals[nc->corner_tris[i]];
+	}
+}
+
+static void normalize_targets_task(void *ctx, uint32_t b, int thread_id)
+{
+	(void)thread_id;
+
+	NormalsCtx *nc = (NormalsCtx *)ctx;
+	size_t begin, end;
+	block_vertices(nc, b, begin, end);
+
+	for (size_t i = begin; i < end; ++i) {
+		if (nc->remap[i] == i) {
+			nc->normals[i] = normalized(nc->normals[i]);
+		}
+	}
+}
+
+static void copy_to_sources_task(void *ctx, uint32_t b, int thread_id)
+{
+	(void)thread_id;
+
+	NormalsCtx *nc = (NormalsCtx *)ctx;
+	size_t begin, end;
+	block_vertices(nc, b, begin, end);
+
+	for (size_t i = begin; i < end; ++i) {
+		if (nc->remap[i] != i) {
+			nc->normals[i] = nc->normals[nc->remap[i]];
+		}
+	}
+}
+
+void compute_mesh_normals(const Mesh &mesh, MBuf &data,
+			  uint32_t *const *idx_chunks, size_t chunk_tris,
+			  ThreadPool &pool)
+{
+	Vec3 *normals = clear_mesh_normals(mesh, data);
+	const Vec3 *positions = data.positions + mesh.vertex_offset;
+	TArray<uint32_t> remap(mesh.vertex_count);
+
+	/* Sorting corners only pays off with several threads */
+	if (pool.size() == 1) {
+		build_position_remap(mesh, data, &remap[0]);
+		size_t chunk_idx_count = 3 * chunk_tris;
+		for (size_t c = 0; c * chunk_idx_count < mesh.index_count;
+		     ++c) {
+			size_t idx_num =
+			    MIN(mesh.index_count - c * chunk_idx_count,
+				chunk_idx_count);
+			accumulate_normals(idx_chunks[c], idx_num, positions,
+					   &remap[0], normals);
+		}
+		normalize_normals(&remap[0], mesh.vertex_count, normals);
+		return;
+	}
+
+	NormalsCtx nc;
+	nc.positions = positions;
+	nc.normals = normals;
+	nc.vertex_count = mesh.vertex_count;
+	nc.idx_chunks = idx_chunks;
+	nc.chunk_tris = chunk_tris;
+
+	build_vertex_remap<VtxAttr::POS>(mesh, data, &remap[0], pool);
+	nc.remap = &remap[0];
+
+	/* About 4 shards per thread */
+	uint32_t max_shards = MIN(4 * pool.size(), NORMALS_MAX_SHARDS);
+	nc.shard_shift = 0;
+	while ((nc.vertex_count >> nc.shard_shift) >= max_shards) {
+		nc.shard_shift++;
+	}
+	nc.shard_count = (nc.vertex_count >> nc.shard_shift) + 1;
+
+	uint32_t vtx_blocks =
+	    (mesh.vertex_count + NORMALS_VTX_BLOCK - 1) / NORMALS_VTX_BLOCK;
+
+	size_t tri_count = mesh.index_count / 3;
+	size_t batch_tris = MIN(tri_count, (size_t)NORMALS_BATCH_TRIS);
+	uint32_t max_blocks =
+	    (batch_tris + NORMALS_BLOCK_TRIS - 1) / NORMALS_BLOCK_TRIS;
+	TArray<size_t> offsets((size_t)nc.shard_count * max_blocks + 1);
+	TArray<Vec3> face_normals(batch_tris + 1);
+	TArray<uint32_t> corner_tris(3 * batch_tris + 1);
+	TArray<uint32_t> corner_targets(3 * batch_tris + 1);
+	nc.offsets = offsets.data;
+	nc.face_normals = face_normals.data;
+	nc.corner_tris = corner_tris.data;
+	nc.corner_targets = corner_targets.data;
+
+	for (size_t t = 0; t < tri_count; t += NORMALS_BATCH_TRIS) {
+		nc.batch_begin = t;
+		nc.batch_end = MIN(t + NORMALS_BATCH_TRIS, tri_count);
+		nc.block_count = (nc.batch_end - t + NORMALS_BLOCK_TRIS - 1) /
+				 NORMALS_BLOCK_TRIS;
+		pool.parallel_for(nc.block_count, face_normals_task, &nc);
+
+		size_t offset = 0;
+		size_t cell_count = (size_t)nc.shard_count * nc.block_count;
+		for (size_t i = 0; i < cell_count; ++i) {
+			size_t n = nc.offsets[i];
+			nc.offsets[i] = offset;
+			offset += n;
+		}
+
+		pool.parallel_for(nc.block_count, scatter_corners_task, &nc);
+		pool.parallel_for(nc.shard_count, accumulate_shard_task, &nc);
+	}
+
+	pool.parallel_for(vtx_blocks, normalize_targets_task, &nc);
+	pool.parallel_for(vtx_blocks, copy_to_sources_task, &nc);
+}
+
+void compute_mesh_normals(const Mesh &mesh, MBuf &data, ThreadPool &pool)
+{
+	uint32_t *indices = data.indices + mesh.index_offset;
+	size_t tri_count = MAX(mesh.index_count / 3, (size_t)1);
+
+	compute_mesh_normals(mesh, data, &indices, tri_count, pool);
+}
+
+/**
+ * Triangles that are never held at once add their corners as they come,
+ * in their order, hence the same result as the serial loop.
+ */
+void start_mesh_normals(const Mesh &mesh, MBuf &data, uint32_t *remap,
+			ThreadPool &pool)
+{
+	clear_mesh_normals(mesh, data);
+	build_vertex_remap<VtxAttr::POS>(mesh, data, remap, pool);
+}
+
+void add_mesh_normals(const Mesh &mesh, MBuf &data, const uint32_t *remap,
+		      const uint32_t *indices, size_t index_count)
+{
+	accumulate_normals(indices, index_count,
+			   data.positions + mesh.vertex_offset, remap,
+			   data.normals + mesh.vertex_offset);
+}
+
+void finish_mesh_normals(const Mesh &mesh, MBuf &data, const uint32_t *remap,
+			 ThreadPool &pool)
+{
+	NormalsCtx nc;
+	nc.normals = data.normals + mesh.vertex_offset;
+	nc.remap = remap;
+	nc.vertex_count = mesh.vertex_count;
+
+	uint32_t vtx_blocks =
+	    (mesh.vertex_count + NORMALS_VTX_BLOCK - 1) / NORMALS_VTX_BLOCK;
+	pool.parallel_for(vtx_blocks, normalize_targets_task, &nc);
+	pool.parallel_for(vtx_blocks, copy_to_sources_task, &nc);
+}
+
 void copy_indices(MBuf &dst, size_t dst_off, const MBuf &src, size_t src_off,
 		  size_t idx_num, size_t vtx_off)
 {
@@ -156,6 +467,43 @@ void copy_vertices(MBuf &dst, size_t dst_off, const MBuf &src, size_t src_off,
 	}
 }
 
+template <typename T>
+static inline void gather_stream(T *dst, const T *src, const uint32_t *idx,
+				 size_t num)
+{
+	for (size_t i = 0; i < num; ++i) {
+		dst[i] = src[idx[i]];
+	}
+}
+
+void gather_vertices(MBuf &dst, size_t dst_off, const MBuf &src,
+		     const uint32_t *src_idx, size_t vtx_num, size_t src_off)
+{
+	/* Copy only common attributes */
+	uint32_t vtx_attr = src.vtx_attr & dst.vtx_attr;
+
+	assert(dst.vtx_capacity >= dst_off + vtx_num);
+
+	gather_stream(dst.positions + dst_off, src.positions + src_off,
+		      src_idx, vtx_num);
+	if (vtx_attr & VtxAttr::NML) {
+		gather_stream(dst.normals + dst_off, src.normals + src_off,
+			      src_idx, vtx_num);
+	}
+	if (vtx_attr & VtxAttr::UV0) {
+		gather_stream(dst.uv[0] + dst_off, src.uv[0] + src_off,
+			      src_idx, vtx_num);
+	}
+	if (vtx_attr & VtxAttr::UV1) {
+		gather_stream(dst.uv[1] + dst_off, src.uv[1] + src_off,
+			      src_idx, vtx_num);
+	}
+	if (vtx_attr & VtxAttr::MAP) {
+		gather_stream(dst.remap + dst_off, src.remap + src_off,
+			      src_idx, vtx_num);
+	}
+}
+
 uint32_t copy_unique_vertices(MBuf &dst_d, uint32_t dst_off, const MBuf &src_d,
 			      uint32_t *vtx_idx, uint32_t vtx_count,
 			      VertexTable &vtx_table, uint32_t *remap)
@@ -169,7 +517,37 @@ uint32_t copy_unique_vertices(MBuf &dst_d, uint32_t dst_off, const MBuf &src_d,
 	uint32_t new_vtx_count = 0;
 	for (size_t i = 0; i < vtx_count; ++i) {
 		size_t vtx_off = dst_off + new_vtx_count;
-		copy_vertices(dst_d, vtx_off, src_d, vtx_idx[i], 1);
+		copy_vertex(dst_d, vtx_off, src_d, vtx_idx[i]);
+		uint32_t *p;
+		p = vtx_table.get_or_set(vtx_off, new_vtx_count);
+		if (p) {
+			remap[vtx_idx[i]] = *p;
+		} else {
+			remap[vtx_idx[i]] = new_vtx_count;
+			new_vtx_count++;
+		}
+	}
+	return new_vtx_count;
+}
+
+template <uint32_t vtx_attr>
+uint32_t copy_unique_vertices(MBuf &dst_d, uint32_t dst_off,
+			      const MBuf &src_d, uint32_t *vtx_idx,
+			      uint32_t vtx_count,
+			      TVertexTable<vtx_attr> &vtx_table,
+			      uint32_t *remap)
+{
+	/* vtx_table should be based on dst_d and cleared */
+	assert(vtx_table.get_mesh_data() == &dst_d && vtx_table.size() == 0);
+	assert(dst_d.vtx_attr == vtx_attr);
+
+	/* Source should have all attributes of target */
+	assert((dst_d.vtx_attr & src_d.vtx_attr) == dst_d.vtx_attr);
+
+	uint32_t new_vtx_count = 0;
+	for (size_t i = 0; i < vtx_count; ++i) {
+		size_t vtx_off = dst_off + new_vtx_count;
+		copy_vertex<vtx_attr>(dst_d, vtx_off, src_d, vtx_idx[i]);
 		uint32_t *p;
 		p = vtx_table.get_or_set(vtx_off, new_vtx_count);
 		if (p) {
@@ -225,7 +603,7 @@ void join_mesh_from_indices(Mesh &dst_m, MBuf &dst_d, const Mesh &src_m,
 		size_t dst_off = dst_m.vertex_offset + dst_m.vertex_count;
 		size_t src_idx = src_d.indices[src_m.index_offset + i];
 		size_t src_off = src_idx + src_m.vertex_offset;
-		copy_vertices(dst_d, dst_off, src_d, src_off, 1);
+		copy_vertex(dst_d, dst_off, src_d, src_off);
 		uint32_t *p;
 		p = vtx_table.get_or_set(dst_off, dst_m.vertex_count);
 		if (p) {
@@ -255,7 +633,42 @@ void join_mesh_from_vertices(Mesh &dst_m, MBuf &dst_d, const Mesh &src_m,
 	for (size_t i = 0; i < src_m.vertex_count; ++i) {
 		size_t dst_off = dst_m.vertex_offset + dst_m.vertex_count;
 		size_t src_off = src_m.vertex_offset + i;
-		copy_vertices(dst_d, dst_off, src_d, src_off, 1);
+		copy_vertex(dst_d, dst_off, src_d, src_off);
+		uint32_t *p;
+		p = vtx_table.get_or_set(dst_off, dst_m.vertex_count);
+		if (p) {
+			remap[i] = *p;
+		} else {
+			remap[i] = dst_m.vertex_count;
+			dst_m.vertex_count++;
+		}
+	}
+
+	uint32_t *dst_idx =
+	    dst_d.indices + dst_m.index_offset + dst_m.index_count;
+	uint32_t *src_idx = src_d.indices + src_m.index_offset;
+	for (size_t j = 0; j < src_m.index_count; ++j) {
+		dst_idx[j] = remap[src_idx[j]];
+	}
+	dst_m.index_count += src_m.index_count;
+}
+
+template <uint32_t vtx_attr>
+void join_mesh_from_vertices(Mesh &dst_m, MBuf &dst_d, const Mesh &src_m,
+			     const MBuf &src_d,
+			     TVertexTable<vtx_attr> &vtx_table, uint32_t *remap)
+{
+	/* vtx_table should be based on dst_d */
+	assert(vtx_table.get_mesh_data() == &dst_d);
+	assert(dst_d.vtx_attr == vtx_attr);
+
+	/* Source should have all attributes of target */
+	assert((dst_d.vtx_attr & src_d.vtx_attr) == dst_d.vtx_attr);
+
+	for (size_t i = 0; i < src_m.vertex_count; ++i) {
+		size_t dst_off = dst_m.vertex_offset + dst_m.vertex_count;
+		size_t src_off = src_m.vertex_offset + i;
+		copy_vertex<vtx_attr>(dst_d, dst_off, src_d, src_off);
 		uint32_t *p;
 		p = vtx_table.get_or_set(dst_off, dst_m.vertex_count);
 		if (p) {
@@ -316,3 +729,41 @@ void skip_degenerate_tris(Mesh &mesh, MBuf &data)
 	}
 	mesh.index_count = new_idx_count;
 }
+
+/* Instantiations, for the attributes of mesh grid data */
+
+template void join_mesh_from_vertices<VtxAttr::P | VtxAttr::MAP>(
+    Mesh &dst_m, MBuf &dst_d, const Mesh &src_m, const MBuf &src_d,
+    TVertexTable<VtxAttr::P | VtxAttr::MAP> &vtx_table, uint32_t *remap);
+
+template uint32_t copy_unique_vertices<VtxAttr::P | VtxAttr::MAP>(
+    MBuf &dst_d, uint32_t dst_off, const MBuf &src_d, uint32_t *vtx_idx,
+    uint32_t vtx_count, TVertexTable<VtxAttr::P | VtxAttr::MAP> &vtx_table,
+    uint32_t *remap);
+
+template void join_mesh_from_vertices<VtxAttr::PN | VtxAttr::MAP>(
+    Mesh &dst_m, MBuf &dst_d, const Mesh &src_m, const MBuf &src_d,
+    TVertexTable<VtxAttr::PN | VtxAttr::MAP> &vtx_table, uint32_t *remap);
+
+template uint32_t copy_unique_vertices<VtxAttr::PN | VtxAttr::MAP>(
+    MBuf &dst_d, uint32_t dst_off, const MBuf &src_d, uint32_t *vtx_idx,
+    uint32_t vtx_count, TVertexTable<VtxAttr::PN | VtxAttr::MAP> &vtx_table,
+    uint32_t *remap);
+
+template void join_mesh_from_vertices<VtxAttr::PT | VtxAttr::MAP>(
+    Mesh &dst_m, MBuf &dst_d, const Mesh &src_m, const MBuf &src_d,
+    TVertexTable<VtxAttr::PT | VtxAttr::MAP> &vtx_table, uint32_t *remap);
+
+template uint32_t copy_unique_vertices<VtxAttr::PT | VtxAttr::MAP>(
+    MBuf &dst_d, uint32_t dst_off, const MBuf &src_d, uint32_t *vtx_idx,
+    uint32_t vtx_count, TVertexTable<VtxAttr::PT | VtxAttr::MAP> &vtx_table,
+    uint32_t *remap);
+
+template void join_mesh_from_vertices<VtxAttr::PNT | VtxAttr::MAP>(
+    Mesh &dst_m, MBuf &dst_d, const Mesh &src_m, const MBuf &src_d,
+    TVertexTable<VtxAttr::PNT | VtxAttr::MAP> &vtx_table, uint32_t *remap);
+
+template uint32_t copy_unique_vertices<VtxAttr::PNT | VtxAttr::MAP>(
+    MBuf &dst_d, uint32_t dst_off, const MBuf &src_d, uint32_t *vtx_idx,
+    uint32_t vtx_count, TVertexTable<VtxAttr::PNT | VtxAttr::MAP> &vtx_table,
+    uint32_t *remap);
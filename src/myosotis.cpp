@@ -107,6 +107,10 @@ bool Myosotis::new_frame()
 
 	ImGui::Checkbox("Continuous LOD", &cfg.continuous_lod);
 
+	ImGui::Checkbox("Incremental LOD", &cfg.incremental_lod);
+
+	ImGui::Checkbox("Triangle budget", &cfg.budget_lod);
+
 	ImGui::Checkbox("Colorize LOD", &cfg.colorize_lod);
 
 	ImGui::Checkbox("Colorize Cells", &cfg.colorize_cells);
@@ -129,6 +133,8 @@ bool Myosotis::new_frame()
 
 	ImGui::DragFloat("Pixel Error", &cfg.pix_error, 0.1, 0.5, 5, "%.1f");
 
+	ImGui::DragInt("Budget", &cfg.tri_budget, 10000, 10000, 100000000);
+
 	int &e = cfg.level;
 	ImGui::RadioButton("Level 0", &e, 0);
 	ImGui::SameLine();
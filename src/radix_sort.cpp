@@ -0,0 +1,146 @@
+#include "radix_sort.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sys_utils.h"
+#include "thread_pool.h"
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+struct RadixSortCtx {
+	uint64_t *keys[2];
+	uint32_t *vals[2];
+	size_t count;
+	int num_threads;
+	/* Index of the buffers holding the input of the current pass */
+	int src;
+	uint32_t shift;
+	/* num_threads histograms, turned into scatter offsets */
+	size_t *hist;
+	/* Per thread OR of key ^ keys[0], bits set where keys differ */
+	uint64_t *diff;
+};
+
+static inline void thread_slice(const RadixSortCtx *rs, int thread_id,
+				size_t &begin, size_t &end)
+{
+	begin = rs->count * thread_id / rs->num_threads;
+	end = rs->count * (thread_id + 1) / rs->num_threads;
+}
+
+static void radix_diff_job(void *ctx, int thread_id)
+{
+	RadixSortCtx *rs = (RadixSortCtx *)ctx;
+	const uint64_t *keys = rs->keys[0];
+	size_t begin, end;
+	thread_slice(rs, thread_id, begin, end);
+
+	uint64_t first = keys[0];
+	uint64_t diff = 0;
+	for (size_t i = begin; i < end; ++i) {
+		diff |= keys[i] ^ first;
+	}
+	rs->diff[thread_id] = diff;
+}
+
+static void radix_histogram_job(void *ctx, int thread_id)
+{
+	RadixSortCtx *rs = (RadixSortCtx *)ctx;
+	const uint64_t *keys = rs->keys[rs->src];
+	size_t *hist = rs->hist + (size_t)thread_id * RADIX_BUCKETS;
+	size_t begin, end;
+	thread_slice(rs, thread_id, begin, end);
+
+	memset(hist, 0, RADIX_BUCKETS * sizeof(size_t));
+	for (size_t i = begin; i < end; ++i) {
+		hist[(keys[i] >> rs->shift) & (RADIX_BUCKETS - 1)]++;
+	}
+}
+
+static void radix_scatter_job(void *ctx, int thread_id)
+{
+	RadixSortCtx *rs = (RadixSortCtx *)ctx;
+	const uint64_t *keys = rs->keys[rs->src];
+	const uint32_t *vals = rs->vals[rs->src];
+	uint64_t *dst_keys = rs->keys[rs->src ^ 1];
+	uint32_t *dst_vals = rs->vals[rs->src ^ 1];
+	size_t *offsets = rs->hist + (size_t)thread_id * RADIX_BUCKETS;
+	size_t begin, end;
+	thread_slice(rs, thread_id, begin, end);
+
+	for (size_t i = begin; i < end; ++i) {
+		size_t pos = offsets[(keys[i] >> rs->shift) &
+				     (RADIX_BUCKETS - 1)]++;
+		dst_keys[pos] = keys[i];
+		dst_vals[pos] = vals[i];
+	}
+}
+
+void radix_sort_pairs(uint64_t *keys, uint32_t *vals, size_t count,
+		      ThreadPool &pool)
+{
+	if (count < 2)
+		return;
+
+	RadixSortCtx rs;
+	rs.keys[0] = keys;
+	rs.vals[0] = vals;
+	rs.count = count;
+	rs.num_threads = pool.size();
+	rs.src = 0;
+	rs.shift = 0;
+	MALLOC_NUM(rs.hist, (size_t)rs.num_threads * RADIX_BUCKETS);
+	MALLOC_NUM(rs.diff, rs.num_threads);
+
+	pool.run(radix_diff_job, &rs);
+	uint64_t diff = 0;
+	for (int t = 0; t < rs.num_threads; ++t) {
+		diff |= rs.diff[t];
+	}
+
+	if (!diff) {
+		free(rs.diff);
+		free(rs.hist);
+		return;
+	}
+
+	MALLOC_NUM(rs.keys[1], count);
+	MALLOC_NUM(rs.vals[1], count);
+
+	for (uint32_t shift = 0; shift < 64; shift += RADIX_BITS) {
+		if (!((diff >> shift) & (RADIX_BUCKETS - 1)))
+			continue;
+		rs.shift = shift;
+
+		pool.run(radix_histogram_job, &rs);
+
+		/* Bucket major, thread minor : keeps the sort stable */
+		size_t offset = 0;
+		for (uint32_t b = 0; b < RADIX_BUCKETS; ++b) {
+			for (int t = 0; t < rs.num_threads; ++t) {
+				size_t &h = rs.hist[t * RADIX_BUCKETS + b];
+				size_t n = h;
+				h = offset;
+				offset += n;
+			}
+		}
+		assert(offset == count);
+
+		pool.run(radix_scatter_job, &rs);
+		rs.src ^= 1;
+	}
+
+	if (rs.src) {
+		memcpy(keys, rs.keys[1], count * sizeof(uint64_t));
+		memcpy(vals, rs.vals[1], count * sizeof(uint32_t));
+	}
+
+	free(rs.keys[1]);
+	free(rs.vals[1]);
+	free(rs.diff);
+	free(rs.hist);
+}
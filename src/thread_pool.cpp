@@ -0,0 +1,210 @@
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+
+struct WorkerArgs {
+	ThreadPool *pool;
+	int thread_id;
+};
+
+static void *worker_main(void *args)
+{
+	WorkerArgs *wa = (WorkerArgs *)args;
+	ThreadPool *pool = wa->pool;
+	int thread_id = wa->thread_id;
+	free(wa);
+
+	uint64_t seen = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->quit && pool->generation == seen) {
+			pthread_cond_wait(&pool->start_cond, &pool->mutex);
+		}
+		if (pool->quit)
+			break;
+		seen = pool->generation;
+		ThreadJob job = pool->job;
+		void *ctx = pool->job_ctx;
+		pthread_mutex_unlock(&pool->mutex);
+
+		job(ctx, thread_id);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (--pool->running == 0) {
+			pthread_cond_signal(&pool->done_cond);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+ThreadPool::ThreadPool(int num_threads)
+    : num_threads{num_threads > 0 ? num_threads : 1}
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&start_cond, NULL);
+	pthread_cond_init(&done_cond, NULL);
+
+	ranges = new Range[this->num_threads];
+	for (int i = 0; i < this->num_threads; ++i) {
+		ranges[i].bounds.store(0, std::memory_order_relaxed);
+	}
+
+	threads = (pthread_t *)malloc(this->num_threads * sizeof(pthread_t));
+	for (int i = 1; i < this->num_threads; ++i) {
+		WorkerArgs *args = (WorkerArgs *)malloc(sizeof(WorkerArgs));
+		args->pool = this;
+		args->thread_id = i;
+		pthread_create(&threads[i], NULL, worker_main, args);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	pthread_mutex_lock(&mutex);
+	quit = true;
+	pthread_cond_broadcast(&start_cond);
+	pthread_mutex_unlock(&mutex);
+
+	for (int i = 1; i < num_threads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	delete[] ranges;
+	pthread_cond_destroy(&done_cond);
+	pthread_cond_destroy(&start_cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+void ThreadPool::run(ThreadJob job, void *ctx)
+{
+	if (num_threads == 1) {
+		job(ctx, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&mutex);
+	assert(running == 0 && "Nested jobs are not supported");
+	this->job = job;
+	this->job_ctx = ctx;
+	running = num_threads - 1;
+	generation++;
+	pthread_cond_broadcast(&start_cond);
+	pthread_mutex_unlock(&mutex);
+
+	job(ctx, 0);
+
+	pthread_mutex_lock(&mutex);
+	while (running) {
+		pthread_cond_wait(&done_cond, &mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+static inline uint64_t pack_range(uint32_t begin, uint32_t end)
+{
+	return ((uint64_t)begin << 32) | end;
+}
+
+bool ThreadPool::pop_task(int thread_id, uint32_t &idx)
+{
+	std::atomic<uint64_t> &bounds = ranges[thread_id].bounds;
+	uint64_t b = bounds.load(std::memory_order_relaxed);
+
+	for (;;) {
+		uint32_t begin = b >> 32;
+		uint32_t end = b & 0xFFFFFFFF;
+		if (begin >= end)
+			return false;
+		if (bounds.compare_exchange_weak(b, pack_range(begin + 1, end),
+						 std::memory_order_acq_rel)) {
+			idx = begin;
+			return true;
+		}
+	}
+}
+
+bool ThreadPool::steal_tasks(int thread_id, uint32_t &idx)
+{
+	for (int k = 1; k < num_threads; ++k) {
+		int victim = (thread_id + k) % num_threads;
+		std::atomic<uint64_t> &bounds = ranges[victim].bounds;
+		uint64_t b = bounds.load(std::memory_order_relaxed);
+		for (;;) {
+			uint32_t begin = b >> 32;
+			uint32_t end = b & 0xFFFFFFFF;
+			if (begin >= end)
+				break;
+			/* Take the back half (at least one task) */
+			uint32_t take = (end - begin + 1) / 2;
+			uint32_t split = end - take;
+			if (bounds.compare_exchange_weak(
+				b, pack_range(begin, split),
+				std::memory_order_acq_rel)) {
+				/* Keep the first stolen task, publish the
+				 * rest as our own range. Our range is empty
+				 * so nobody else is writing to it. */
+				idx = split;
+				ranges[thread_id].bounds.store(
+				    pack_range(split + 1, end),
+				    std::memory_order_release);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static void parallel_for_job(void *ctx, int thread_id)
+{
+	ThreadPool *pool = (ThreadPool *)ctx;
+	uint32_t idx;
+
+	for (;;) {
+		if (!pool->pop_task(thread_id, idx) &&
+		    !pool->steal_tasks(thread_id, idx)) {
+			break;
+		}
+		pool->task(pool->task_ctx, idx, thread_id);
+	}
+}
+
+void ThreadPool::parallel_for(uint32_t count, ThreadTask task, void *ctx)
+{
+	if (count == 0)
+		return;
+
+	if (num_threads == 1) {
+		for (uint32_t i = 0; i < count; ++i) {
+			task(ctx, i, 0);
+		}
+		return;
+	}
+
+	/* Static initial partition, load balancing is left to stealing */
+	for (int t = 0; t < num_threads; ++t) {
+		uint32_t begin = (uint64_t)count * t / num_threads;
+		uint32_t end = (uint64_t)count * (t + 1) / num_threads;
+		ranges[t].bounds.store(pack_range(begin, end),
+				       std::memory_order_relaxed);
+	}
+	this->task = task;
+	this->task_ctx = ctx;
+
+	run(parallel_for_job, this);
+}
+
+int default_thread_count()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? (int)n : 1;
+}
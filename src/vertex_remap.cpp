@@ -3,7 +3,11 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include "concurrent_hash_table.h"
+#include "hash.h"
 #include "mesh.h"
+#include "radix_sort.h"
+#include "thread_pool.h"
 #include "vertex_table.h"
 
 
@@ -143,6 +147,246 @@ uint32_t build_vertex_remap_from_indices(const Mesh& mesh, const MBuf& data,
 	return (num);
 }
 
+/**
+ * Parallel build_vertex_remap. All threads share a table where every
+ * vertex lowers the value of its key to its own index, so that after a
+ * first pass each key holds the first of the equal vertices. The slot of
+ * every vertex is kept in remap meanwhile, and a second pass reads the
+ * slots, which gives the remap of the serial version.
+ */
+
+/* Vertices are processed by blocks of this many */
+#define WELD_BLOCK (1 << 16)
+
+/* From this many vertices on, the shared table no longer fits in caches
+ * and its random accesses cost more than sorting the vertices */
+#define WELD_SORT_MIN_VERTICES (1 << 23)
+
+template <uint32_t vtx_attr>
+using SharedVertexTable =
+    ConcurrentHashTable<uint32_t, uint32_t, TVertexHasher<vtx_attr>>;
+
+template <uint32_t vtx_attr>
+struct WeldCtx {
+	const Mesh *mesh;
+	uint32_t *remap;
+	SharedVertexTable<vtx_attr> *table;
+	/* Unique vertices found in every block */
+	uint32_t *counts;
+};
+
+template <uint32_t vtx_attr>
+static void weld_insert_task(void *ctx, uint32_t b, int thread_id)
+{
+	(void)thread_id;
+
+	WeldCtx<vtx_attr> *wc = (WeldCtx<vtx_attr> *)ctx;
+	size_t begin = (size_t)b * WELD_BLOCK;
+	size_t end = begin + WELD_BLOCK;
+	if (end > wc->mesh->vertex_count)
+		end = wc->mesh->vertex_count;
+
+	for (size_t i = begin; i < end; ++i) {
+		size_t slot;
+		wc->table->fetch_min(i + wc->mesh->vertex_offset, i, &slot);
+		wc->remap[i] = slot;
+	}
+}
+
+template <uint32_t vtx_attr>
+static void weld_lookup_task(void *ctx, uint32_t b, int thread_id)
+{
+	(void)thread_id;
+
+	WeldCtx<vtx_attr> *wc = (WeldCtx<vtx_attr> *)ctx;
+	size_t begin = (size_t)b * WELD_BLOCK;
+	size_t end = begin + WELD_BLOCK;
+	if (end > wc->mesh->vertex_count)
+		end = wc->mesh->vertex_count;
+
+	uint32_t num = 0;
+	for (size_t i = begin; i < end; ++i) {
+		wc->remap[i] = wc->table->value_at(wc->remap[i]);
+		num += (wc->remap[i] == i);
+	}
+	wc->counts[b] = num;
+}
+
+template <uint32_t vtx_attr>
+uint32_t build_vertex_remap(const Mesh& mesh, const MBuf& data,
+			    uint32_t *remap, ThreadPool &pool)
+{
+	/* Atomics buy nothing to a single thread */
+	if (pool.size() == 1)
+		return build_vertex_remap<vtx_attr>(mesh, data, remap);
+	if (mesh.vertex_count >= WELD_SORT_MIN_VERTICES)
+		return build_vertex_remap_sorted<vtx_attr>(mesh, data, remap,
+							   pool);
+
+	SharedVertexTable<vtx_attr> table(mesh.vertex_count, {&data});
+	uint32_t block_count =
+	    (mesh.vertex_count + WELD_BLOCK - 1) / WELD_BLOCK;
+
+	WeldCtx<vtx_attr> wc;
+	wc.mesh = &mesh;
+	wc.remap = remap;
+	wc.table = &table;
+	wc.counts = (uint32_t *)malloc(block_count * sizeof(uint32_t));
+
+	pool.parallel_for(block_count, weld_insert_task<vtx_attr>, &wc);
+	pool.parallel_for(block_count, weld_lookup_task<vtx_attr>, &wc);
+
+	uint32_t num = 0;
+	for (uint32_t b = 0; b < block_count; ++b) {
+		num += wc.counts[b];
+	}
+	free(wc.counts);
+
+	return (num);
+}
+
+/**
+ * Sort based alternative to the parallel build_vertex_remap. Vertices are
+ * given a 64 bits hash of their attribute bits and radix sorted by it, the
+ * sort being stable, vertices with the same hash form runs in index order.
+ * The first vertex of a run equal to a vertex is its remap target, hence
+ * remap[i] <= i and the remap is the same as the one of hash tables.
+ */
+
+template <uint32_t vtx_attr>
+struct SortWeldCtx {
+	const Mesh *mesh;
+	const MBuf *data;
+	uint32_t *remap;
+	uint64_t *keys;
+	uint32_t *vtx;
+	/* Remap targets found per block */
+	uint32_t *counts;
+};
+
+/* Bits of two consecutive floats */
+static inline uint64_t pack_bits(const float *f)
+{
+	const uint32_t *u = reinterpret_cast<const uint32_t *>(f);
+	return (((uint64_t)u[0] << 32) | u[1]);
+}
+
+static inline uint64_t float_bits(const float *f)
+{
+	return (*reinterpret_cast<const uint32_t *>(f));
+}
+
+template <uint32_t vtx_attr>
+static void weld_key_task(void *ctx, uint32_t b, int thread_id)
+{
+	(void)thread_id;
+
+	SortWeldCtx<vtx_attr> *wc = (SortWeldCtx<vtx_attr> *)ctx;
+	const MBuf &data = *wc->data;
+	size_t begin = (size_t)b * WELD_BLOCK;
+	size_t end = begin + WELD_BLOCK;
+	if (end > wc->mesh->vertex_count)
+		end = wc->mesh->vertex_count;
+
+	for (size_t i = begin; i < end; ++i) {
+		size_t v = i + wc->mesh->vertex_offset;
+		const float *pos = &data.positions[v].x;
+		uint64_t key = murmur2_64(0, pack_bits(pos));
+		key = murmur2_64(key, float_bits(pos + 2));
+		if constexpr (vtx_attr & VtxAttr::NML) {
+			const float *nml = &data.normals[v].x;
+			key = murmur2_64(key, pack_bits(nml));
+			key = murmur2_64(key, float_bits(nml + 2));
+		}
+		if constexpr (vtx_attr & VtxAttr::UV0) {
+			key = murmur2_64(key, pack_bits(&data.uv[0][v].x));
+		}
+		if constexpr (vtx_attr & VtxAttr::UV1) {
+			key = murmur2_64(key, pack_bits(&data.uv[1][v].x));
+		}
+		wc->keys[i] = key;
+		wc->vtx[i] = i;
+	}
+}
+
+/* Runs starting within a block of the sorted vertices */
+template <uint32_t vtx_attr>
+static void weld_runs_task(void *ctx, uint32_t b, int thread_id)
+{
+	(void)thread_id;
+
+	SortWeldCtx<vtx_attr> *wc = (SortWeldCtx<vtx_attr> *)ctx;
+	const Mesh &mesh = *wc->mesh;
+	const uint64_t *keys = wc->keys;
+	const uint32_t *vtx = wc->vtx;
+	uint32_t *remap = wc->remap;
+	TVertexHasher<vtx_attr> hasher{wc->data};
+	size_t begin = (size_t)b * WELD_BLOCK;
+	size_t end = begin + WELD_BLOCK;
+	if (end > mesh.vertex_count)
+		end = mesh.vertex_count;
+
+	while (begin > 0 && begin < end && keys[begin] == keys[begin - 1]) {
+		begin++;
+	}
+
+	uint32_t num = 0;
+	size_t run = begin;
+	while (run < end) {
+		size_t run_end = run + 1;
+		while (run_end < mesh.vertex_count &&
+		       keys[run_end] == keys[run]) {
+			run_end++;
+		}
+		/* Hash collisions aside, the first vertex is the target */
+		for (size_t i = run; i < run_end; ++i) {
+			uint32_t v = vtx[i] + mesh.vertex_offset;
+			remap[vtx[i]] = vtx[i];
+			for (size_t j = run; j < i; ++j) {
+				if (remap[vtx[j]] == vtx[j] &&
+				    hasher.is_equal(vtx[j] + mesh.vertex_offset,
+						    v)) {
+					remap[vtx[i]] = vtx[j];
+					break;
+				}
+			}
+			num += (remap[vtx[i]] == vtx[i]);
+		}
+		run = run_end;
+	}
+	wc->counts[b] = num;
+}
+
+template <uint32_t vtx_attr>
+uint32_t build_vertex_remap_sorted(const Mesh& mesh, const MBuf& data,
+				   uint32_t *remap, ThreadPool &pool)
+{
+	uint32_t block_count =
+	    (mesh.vertex_count + WELD_BLOCK - 1) / WELD_BLOCK;
+
+	SortWeldCtx<vtx_attr> wc;
+	wc.mesh = &mesh;
+	wc.data = &data;
+	wc.remap = remap;
+	wc.keys = (uint64_t *)malloc(mesh.vertex_count * sizeof(uint64_t));
+	wc.vtx = (uint32_t *)malloc(mesh.vertex_count * sizeof(uint32_t));
+	wc.counts = (uint32_t *)malloc(block_count * sizeof(uint32_t));
+
+	pool.parallel_for(block_count, weld_key_task<vtx_attr>, &wc);
+	radix_sort_pairs(wc.keys, wc.vtx, mesh.vertex_count, pool);
+	pool.parallel_for(block_count, weld_runs_task<vtx_attr>, &wc);
+
+	uint32_t num = 0;
+	for (uint32_t b = 0; b < block_count; ++b) {
+		num += wc.counts[b];
+	}
+	free(wc.counts);
+	free(wc.vtx);
+	free(wc.keys);
+
+	return (num);
+}
+
 /* Instantiations */
 
 template uint32_t build_vertex_remap<VtxAttr::P>(const Mesh& mesh, 
@@ -169,6 +413,30 @@ template uint32_t build_vertex_remap<VtxAttr::PNT>(
 template uint32_t build_vertex_remap_from_indices<VtxAttr::PNT>(
 		const Mesh& mesh, const MBuf& data,	uint32_t *remap);
 
+template uint32_t build_vertex_remap<VtxAttr::P>(const Mesh& mesh,
+		const MBuf& data, uint32_t *remap, ThreadPool &pool);
+
+template uint32_t build_vertex_remap<VtxAttr::PN>(const Mesh& mesh,
+		const MBuf& data, uint32_t *remap, ThreadPool &pool);
+
+template uint32_t build_vertex_remap<VtxAttr::PT>(const Mesh& mesh,
+		const MBuf& data, uint32_t *remap, ThreadPool &pool);
+
+template uint32_t build_vertex_remap<VtxAttr::PNT>(const Mesh& mesh,
+		const MBuf& data, uint32_t *remap, ThreadPool &pool);
+
+template uint32_t build_vertex_remap_sorted<VtxAttr::P>(const Mesh& mesh,
+		const MBuf& data, uint32_t *remap, ThreadPool &pool);
+
+template uint32_t build_vertex_remap_sorted<VtxAttr::PN>(const Mesh& mesh,
+		const MBuf& data, uint32_t *remap, ThreadPool &pool);
+
+template uint32_t build_vertex_remap_sorted<VtxAttr::PT>(const Mesh& mesh,
+		const MBuf& data, uint32_t *remap, ThreadPool &pool);
+
+template uint32_t build_vertex_remap_sorted<VtxAttr::PNT>(const Mesh& mesh,
+		const MBuf& data, uint32_t *remap, ThreadPool &pool);
+
 
 /* Apply remaps */
 